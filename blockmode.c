@@ -0,0 +1,121 @@
+#include "blockmode.h"
+#include "sysutil.h"
+
+static int send_full(int fd,const char *buf,int len,int flags);
+
+int block_send_header(int fd,int desc,unsigned int len)
+{
+	char header[3];
+	header[0] = (char)desc;
+	header[1] = (char)(len >> 8);
+	header[2] = (char)(len & 0xff);
+	// 块头和随后的数据合并发送
+	return send_full(fd,header,sizeof(header),MSG_MORE);
+}
+
+int block_send_marker(int fd,long long pos)
+{
+	char mark[BLOCK_MARK_LEN] = {0};
+	int len = sprintf(mark,"%lld",pos);
+	if( block_send_header(fd,BLOCK_DESC_MARK,len) == -1 )
+	{
+		return -1;
+	}
+	return send_full(fd,mark,len,0);
+}
+
+int block_send_eof(int fd)
+{
+	char header[3] = {BLOCK_DESC_EOF,0,0};
+	return send_full(fd,header,sizeof(header),0);
+}
+
+void block_reader_init(block_reader_t *br,int fd)
+{
+	bzero(br,sizeof(*br));
+	br->fd = fd;
+}
+
+int block_read(block_reader_t *br,char *buf,int len)
+{
+	while( br->remain == 0 )
+	{
+		if( br->eof || (br->desc & BLOCK_DESC_EOF) )
+		{
+			br->eof = 1;
+			return 0;
+		}
+
+		unsigned char header[3];
+		if( readn(br->fd,header,sizeof(header)) != sizeof(header) )
+		{
+			errno = ECONNRESET;
+			return -1;
+		}
+		br->desc = header[0];
+		br->remain = (header[1] << 8) | header[2];
+
+		if( br->desc & BLOCK_DESC_MARK )
+		{
+			char mark[BLOCK_MARK_LEN] = {0};
+			int n = br->remain < BLOCK_MARK_LEN ? br->remain : BLOCK_MARK_LEN - 1;
+			if( readn(br->fd,mark,n) != n )
+			{
+				errno = ECONNRESET;
+				return -1;
+			}
+			// 过长的标记丢弃多余部分
+			br->remain -= n;
+			while( br->remain > 0 )
+			{
+				char discard[BLOCK_MARK_LEN];
+				int m = br->remain < sizeof(discard) ? br->remain : sizeof(discard);
+				if( readn(br->fd,discard,m) != m )
+				{
+					errno = ECONNRESET;
+					return -1;
+				}
+				br->remain -= m;
+			}
+			memcpy(br->mark,mark,sizeof(mark));
+			// 标记块不携带文件数据，带EOF的标记块也结束文件
+			return BLOCK_GOT_MARK;
+		}
+	}
+
+	if( (unsigned int)len > br->remain )
+	{
+		len = br->remain;
+	}
+	int ret = read(br->fd,buf,len);
+	if( ret == 0 )
+	{
+		// EOF块之前连接被关闭
+		errno = ECONNRESET;
+		return -1;
+	}
+	if( ret > 0 )
+	{
+		br->remain -= ret;
+	}
+	return ret;
+}
+
+static int send_full(int fd,const char *buf,int len,int flags)
+{
+	while( len > 0 )
+	{
+		int ret = send(fd,buf,len,flags | MSG_NOSIGNAL);
+		if( ret == -1 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef __BLOCKMODE_H__
+#define __BLOCKMODE_H__
+
+#include "common.h"
+
+// 块传输模式(MODE B，RFC 959 3.4.2)
+// 每个块以3字节的头开始：1字节描述符和2字节(网络字节序)的数据长度。
+// 文件结束由EOF描述符表示而不是关闭连接，所以一个数据连接可以连续传输多个文件。
+// 重启标记块的数据是文件的字节位置(十进制文本)，可以直接用于REST
+
+#define BLOCK_DESC_EOR		0x80
+#define BLOCK_DESC_EOF		0x40
+#define BLOCK_DESC_ERRORS	0x20
+#define BLOCK_DESC_MARK		0x10
+
+// 一个块最多的数据字节数
+#define BLOCK_MAX_DATA		65535
+// 下载时每隔多少字节插入一个重启标记
+#define BLOCK_MARK_INTERVAL	(16*1024*1024)
+// 接受的重启标记的最大长度
+#define BLOCK_MARK_LEN		64
+
+// block_read读到重启标记
+#define BLOCK_GOT_MARK		-2
+
+typedef struct block_reader
+{
+	int fd;
+	// 当前块的描述符，以及还没有读取的数据字节数
+	int desc;
+	unsigned int remain;
+	// 已经读到EOF块
+	int eof;
+	// 最近一个重启标记
+	char mark[BLOCK_MARK_LEN];
+} block_reader_t;
+
+/**
+ * block_send_header - 发送块头，数据随后由调用者发送
+ * @fd - 数据连接
+ * @desc - 描述符
+ * @len - 数据长度，不超过BLOCK_MAX_DATA
+ * return value - 成功返回0，失败返回-1
+ */
+int block_send_header(int fd,int desc,unsigned int len);
+
+/**
+ * block_send_marker - 发送重启标记块
+ * @fd - 数据连接
+ * @pos - 已经发送到的文件位置
+ * return value - 成功返回0，失败返回-1
+ */
+int block_send_marker(int fd,long long pos);
+
+/**
+ * block_send_eof - 发送空的EOF块，表示文件结束
+ * @fd - 数据连接
+ * return value - 成功返回0，失败返回-1
+ */
+int block_send_eof(int fd);
+
+/**
+ * block_reader_init - 开始接收一个文件
+ * @br - 接收状态
+ * @fd - 数据连接
+ */
+void block_reader_init(block_reader_t *br,int fd);
+
+/**
+ * block_read - 读取块中的数据
+ * @br - 接收状态
+ * @buf - 缓冲区
+ * @len - 缓冲区大小
+ * return value - 读到的数据字节数；文件结束(EOF块)返回0；
+ *                读到重启标记返回BLOCK_GOT_MARK，标记保存在br->mark；
+ *                出错或者连接在EOF块之前关闭返回-1
+ */
+int block_read(block_reader_t *br,char *buf,int len);
+
+#endif /* __BLOCKMODE_H__ */
@@ -0,0 +1,390 @@
+#include "bwclass.h"
+#include "common.h"
+#include "session.h"
+#include "ratelimit.h"
+#include "sysutil.h"
+#include "tunable.h"
+
+#define BWCLASS_MATCH_MAX	64
+#define BWCLASS_TRANSFERS	4096
+
+#define BWCLASS_MATCH_USER	1
+#define BWCLASS_MATCH_GROUP	2
+#define BWCLASS_MATCH_CIDR	3
+
+typedef struct bwclass
+{
+	char name[BWCLASS_NAME_LEN];
+	unsigned int weight;
+	unsigned int min_rate;
+} bwclass_t;
+
+typedef struct bwclass_match
+{
+	int cls;
+	int type;
+	char name[BWCLASS_NAME_LEN];
+	// 网络字节序
+	unsigned int net;
+	unsigned int mask;
+} bwclass_match_t;
+
+// 正在进行的传输，进程异常退出后通过pid清理
+typedef struct bwclass_transfer
+{
+	pid_t pid;
+	int cls;
+	int dir;
+} bwclass_transfer_t;
+
+typedef struct bwclass_shm
+{
+	pthread_mutex_t lock;
+	token_bucket_t bucket[BWCLASS_MAX][2];
+	unsigned int share[BWCLASS_MAX][2];
+	unsigned int active[BWCLASS_MAX][2];
+	bwclass_transfer_t transfers[BWCLASS_TRANSFERS];
+} bwclass_shm_t;
+
+// 0号类别为默认类别，未匹配任何规则的会话属于该类别
+static bwclass_t s_classes[BWCLASS_MAX] = { { "default", 1, 0 } };
+static int s_class_count = 1;
+
+static bwclass_match_t s_matches[BWCLASS_MATCH_MAX];
+static int s_match_count = 0;
+
+static bwclass_shm_t *s_bw;
+
+static int find_class(const char *name);
+static int match_group(const char *group,struct passwd *pw);
+static void rebalance(int dir);
+
+void bwclass_parse_class(const char *value)
+{
+	char name[BWCLASS_NAME_LEN] = {0};
+	unsigned int weight;
+	unsigned int min_rate;
+
+	if( sscanf(value,"%31[^,],%u,%u",name,&weight,&min_rate) != 3 || weight == 0 )
+	{
+		fprintf(stderr, "bad bw_class in config file: %s\n", value);
+		exit(EXIT_FAILURE);
+	}
+
+	int cls = find_class(name);
+	if( cls == -1 )
+	{
+		if( s_class_count == BWCLASS_MAX )
+		{
+			fprintf(stderr, "too many bw_class in config file\n");
+			exit(EXIT_FAILURE);
+		}
+		cls = s_class_count++;
+		strcpy(s_classes[cls].name,name);
+	}
+	s_classes[cls].weight = weight;
+	s_classes[cls].min_rate = min_rate;
+}
+
+void bwclass_parse_match(const char *value)
+{
+	char name[BWCLASS_NAME_LEN] = {0};
+	char rule[MAX_SET_VALUE_LEN] = {0};
+
+	if( sscanf(value,"%31[^,],%127s",name,rule) != 2 || s_match_count == BWCLASS_MATCH_MAX )
+	{
+		fprintf(stderr, "bad bw_class_match in config file: %s\n", value);
+		exit(EXIT_FAILURE);
+	}
+
+	bwclass_match_t *m = &s_matches[s_match_count];
+	memset(m,0,sizeof(*m));
+	m->cls = find_class(name);
+	if( m->cls == -1 )
+	{
+		fprintf(stderr, "bw_class_match before bw_class: %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	if( strncmp(rule,"user:",5) == 0 )
+	{
+		m->type = BWCLASS_MATCH_USER;
+		strncpy(m->name,rule + 5,BWCLASS_NAME_LEN - 1);
+	}
+	else if( strncmp(rule,"group:",6) == 0 )
+	{
+		m->type = BWCLASS_MATCH_GROUP;
+		strncpy(m->name,rule + 6,BWCLASS_NAME_LEN - 1);
+	}
+	else if( strncmp(rule,"cidr:",5) == 0 )
+	{
+		char ip[INET_ADDRSTRLEN] = {0};
+		unsigned int bits = 32;
+		struct in_addr addr;
+		if( sscanf(rule + 5,"%15[^/]/%u",ip,&bits) < 1 || bits > 32 ||
+			inet_pton(AF_INET,ip,&addr) != 1 )
+		{
+			fprintf(stderr, "bad cidr in config file: %s\n", rule);
+			exit(EXIT_FAILURE);
+		}
+		m->type = BWCLASS_MATCH_CIDR;
+		m->mask = bits == 0 ? 0 : htonl(0xFFFFFFFFU << (32 - bits));
+		m->net = addr.s_addr & m->mask;
+	}
+	else
+	{
+		fprintf(stderr, "bad bw_class_match in config file: %s\n", value);
+		exit(EXIT_FAILURE);
+	}
+	++s_match_count;
+}
+
+void bwclass_init()
+{
+	// 没有配置带宽类别时不参与调度
+	if( s_class_count == 1 )
+	{
+		return;
+	}
+
+	s_bw = (bwclass_shm_t *)shm_alloc(sizeof(bwclass_shm_t));
+	shm_mutex_init(&s_bw->lock);
+
+	int i;
+	for( i = 0; i < s_class_count; ++i )
+	{
+		ratelimit_bucket_init(&s_bw->bucket[i][RATE_DOWNLOAD],0);
+		ratelimit_bucket_init(&s_bw->bucket[i][RATE_UPLOAD],0);
+	}
+}
+
+void bwclass_classify(session_t *sess,struct passwd *pw)
+{
+	sess->bw_class = 0;
+
+	// 按配置顺序，第一条匹配的规则生效
+	int i;
+	for( i = 0; i < s_match_count; ++i )
+	{
+		bwclass_match_t *m = &s_matches[i];
+		// cidr规则只适用于IPv4客户端
+		if( m->type == BWCLASS_MATCH_CIDR && !sess->ipv6 && (sess->rl_ip & m->mask) == m->net )
+		{
+			break;
+		}
+		if( pw == NULL )
+		{
+			continue;
+		}
+		if( m->type == BWCLASS_MATCH_USER && strcmp(m->name,pw->pw_name) == 0 )
+		{
+			break;
+		}
+		if( m->type == BWCLASS_MATCH_GROUP && match_group(m->name,pw) )
+		{
+			break;
+		}
+	}
+
+	if( i < s_match_count )
+	{
+		sess->bw_class = s_matches[i].cls;
+	}
+}
+
+void bwclass_transfer_begin(session_t *sess,int is_upload)
+{
+	sess->bw_transfer_slot = -1;
+	if( s_bw == NULL )
+	{
+		return;
+	}
+
+	int dir = is_upload ? RATE_UPLOAD : RATE_DOWNLOAD;
+
+	shm_mutex_lock(&s_bw->lock);
+	int i;
+	for( i = 0; i < BWCLASS_TRANSFERS; ++i )
+	{
+		bwclass_transfer_t *t = &s_bw->transfers[i];
+		if( t->pid == 0 )
+		{
+			t->pid = getpid();
+			t->cls = sess->bw_class;
+			t->dir = dir;
+			sess->bw_transfer_slot = i;
+			break;
+		}
+	}
+	rebalance(dir);
+	shm_mutex_unlock(&s_bw->lock);
+}
+
+void bwclass_transfer_end(session_t *sess)
+{
+	if( s_bw == NULL || sess->bw_transfer_slot == -1 )
+	{
+		return;
+	}
+
+	shm_mutex_lock(&s_bw->lock);
+	bwclass_transfer_t *t = &s_bw->transfers[sess->bw_transfer_slot];
+	int dir = t->dir;
+	t->pid = 0;
+	rebalance(dir);
+	shm_mutex_unlock(&s_bw->lock);
+
+	sess->bw_transfer_slot = -1;
+}
+
+long long bwclass_charge(session_t *sess,int dir,int bytes,long long now)
+{
+	if( s_bw == NULL || sess->bw_transfer_slot == -1 )
+	{
+		return 0;
+	}
+
+	shm_mutex_lock(&s_bw->lock);
+	long long wait_ns = ratelimit_bucket_take(&s_bw->bucket[sess->bw_class][dir],bytes,now);
+	shm_mutex_unlock(&s_bw->lock);
+
+	return wait_ns;
+}
+
+void bwclass_describe(session_t *sess,char *buf,unsigned int len)
+{
+	buf[0] = '\0';
+	if( s_bw == NULL )
+	{
+		return;
+	}
+
+	bwclass_t *c = &s_classes[sess->bw_class];
+	int off = snprintf(buf,len,"Bandwidth class is %s (weight %u, guaranteed %u bytes/s)\r\n",
+		c->name,c->weight,c->min_rate);
+
+	shm_mutex_lock(&s_bw->lock);
+	int dir;
+	for( dir = RATE_DOWNLOAD; dir <= RATE_UPLOAD && off < (int)len; ++dir )
+	{
+		const char *what = dir == RATE_DOWNLOAD ? "download" : "upload";
+		unsigned int share = s_bw->share[sess->bw_class][dir];
+		unsigned int active = s_bw->active[sess->bw_class][dir];
+		if( share == 0 )
+		{
+			off += snprintf(buf + off,len - off,"Class %s share is unlimited\r\n",what);
+		}
+		else
+		{
+			off += snprintf(buf + off,len - off,"Class %s share in bytes/s is %u over %u transfers\r\n",
+				what,share,active);
+		}
+	}
+	shm_mutex_unlock(&s_bw->lock);
+}
+
+static int find_class(const char *name)
+{
+	int i;
+	for( i = 0; i < s_class_count; ++i )
+	{
+		if( strcmp(s_classes[i].name,name) == 0 )
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int match_group(const char *group,struct passwd *pw)
+{
+	struct group *gr = getgrnam(group);
+	if( gr == NULL )
+	{
+		return 0;
+	}
+	if( gr->gr_gid == pw->pw_gid )
+	{
+		return 1;
+	}
+
+	char **member;
+	for( member = gr->gr_mem; *member != NULL; ++member )
+	{
+		if( strcmp(*member,pw->pw_name) == 0 )
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// 重新计算dir方向上各类别的带宽份额，调用者需持锁
+static void rebalance(int dir)
+{
+	unsigned int capacity = dir == RATE_DOWNLOAD ?
+		tunable_global_download_max_rate : tunable_global_upload_max_rate;
+
+	int i;
+	for( i = 0; i < s_class_count; ++i )
+	{
+		s_bw->active[i][dir] = 0;
+	}
+
+	pid_t self = getpid();
+	for( i = 0; i < BWCLASS_TRANSFERS; ++i )
+	{
+		bwclass_transfer_t *t = &s_bw->transfers[i];
+		if( t->pid == 0 )
+		{
+			continue;
+		}
+		// 清理异常退出的会话留下的传输记录
+		if( t->pid != self && kill(t->pid,0) == -1 && errno == ESRCH )
+		{
+			t->pid = 0;
+			continue;
+		}
+		if( t->dir == dir )
+		{
+			++s_bw->active[t->cls][dir];
+		}
+	}
+
+	unsigned long long sum_min = 0;
+	unsigned long long sum_weight = 0;
+	for( i = 0; i < s_class_count; ++i )
+	{
+		if( s_bw->active[i][dir] > 0 )
+		{
+			sum_min += s_classes[i].min_rate;
+			sum_weight += s_classes[i].weight;
+		}
+	}
+
+	for( i = 0; i < s_class_count; ++i )
+	{
+		unsigned long long share = 0;
+		if( capacity > 0 && s_bw->active[i][dir] > 0 )
+		{
+			// 先满足保底带宽(总和超出时按比例缩减)，剩余部分按权重分配
+			unsigned long long min_rate = s_classes[i].min_rate;
+			unsigned long long spare = 0;
+			if( sum_min > capacity )
+			{
+				min_rate = min_rate * capacity / sum_min;
+			}
+			else
+			{
+				spare = capacity - sum_min;
+			}
+			share = min_rate + spare * s_classes[i].weight / sum_weight;
+			if( share == 0 )
+			{
+				share = 1;
+			}
+		}
+		s_bw->share[i][dir] = (unsigned int)share;
+		s_bw->bucket[i][dir].rate = (unsigned int)share;
+	}
+}
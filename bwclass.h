@@ -0,0 +1,70 @@
+#ifndef __BWCLASS_H__
+#define __BWCLASS_H__
+
+// 带宽类别
+// 按用户、组或来源网段把会话划入不同类别，每个类别有权重和保底带宽。
+// 全局带宽(global_*_max_rate)饱和时，先满足活跃类别的保底带宽，
+// 剩余部分按权重分给有活跃传输的类别，同一类别内的传输共享该类别的令牌桶。
+
+#define BWCLASS_MAX		16
+#define BWCLASS_NAME_LEN	32
+
+struct session;
+struct passwd;
+
+/**
+ * bwclass_parse_class - 解析配置 bw_class=<名称>,<权重>,<保底字节/秒>
+ * @value - 配置值
+ */
+void bwclass_parse_class(const char *value);
+
+/**
+ * bwclass_parse_match - 解析配置 bw_class_match=<名称>,user:<用户名>|group:<组名>|cidr:<a.b.c.d/n>
+ * @value - 配置值
+ */
+void bwclass_parse_match(const char *value);
+
+/**
+ * bwclass_init - 分配共享的调度状态，必须在fork会话进程之前调用
+ */
+void bwclass_init();
+
+/**
+ * bwclass_classify - 根据来源IP和登录用户(未登录时pw为NULL)确定会话所属类别
+ * @sess - 会话
+ * @pw - 登录用户
+ */
+void bwclass_classify(struct session *sess,struct passwd *pw);
+
+/**
+ * bwclass_transfer_begin - 会话开始一次传输，重新分配各类别的带宽
+ * @sess - 会话
+ * @is_upload - 1为上传，0为下载
+ */
+void bwclass_transfer_begin(struct session *sess,int is_upload);
+
+/**
+ * bwclass_transfer_end - 传输结束，重新分配各类别的带宽
+ * @sess - 会话
+ */
+void bwclass_transfer_end(struct session *sess);
+
+/**
+ * bwclass_charge - 从会话所属类别的令牌桶中扣除bytes个令牌
+ * @sess - 会话
+ * @dir - RATE_DOWNLOAD或RATE_UPLOAD
+ * @bytes - 传输的字节数
+ * @now - 当前时间(纳秒)
+ * return value - 需要等待的纳秒数
+ */
+long long bwclass_charge(struct session *sess,int dir,int bytes,long long now);
+
+/**
+ * bwclass_describe - 生成STAT中显示的类别和当前带宽份额信息
+ * @sess - 会话
+ * @buf - 输出缓冲区，每行以\r\n结尾
+ * @len - 缓冲区大小
+ */
+void bwclass_describe(struct session *sess,char *buf,unsigned int len);
+
+#endif /* __BWCLASS_H__ */
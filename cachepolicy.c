@@ -0,0 +1,112 @@
+#include "cachepolicy.h"
+#include "common.h"
+#include "tunable.h"
+
+static void drop_behind(cache_cursor_t *cc,long long pos);
+
+void cache_read_begin(cache_cursor_t *cc,int fd,long long offset,long long file_size)
+{
+	cc->fd = fd;
+	cc->start = offset;
+	cc->ra_end = offset;
+	cc->flushed = offset;
+	cc->dropped = offset;
+	cc->drop = tunable_cache_drop_threshold > 0 && file_size > tunable_cache_drop_threshold;
+
+	if( tunable_readahead_window > 0 )
+	{
+		// 整个文件按顺序访问，内核会加大预读
+		posix_fadvise(fd,offset,0,POSIX_FADV_SEQUENTIAL);
+		cache_read_advance(cc,offset);
+	}
+}
+
+void cache_read_advance(cache_cursor_t *cc,long long pos)
+{
+	long long window = tunable_readahead_window;
+
+	// 游标越过窗口的一半时发出下一个窗口的预读，WILLNEED是异步的
+	if( window > 0 && cc->ra_end - pos < window / 2 )
+	{
+		long long ra_start = cc->ra_end > pos ? cc->ra_end : pos;
+		posix_fadvise(cc->fd,ra_start,pos + window - ra_start,POSIX_FADV_WILLNEED);
+		cc->ra_end = pos + window;
+	}
+
+	drop_behind(cc,pos);
+}
+
+void cache_write_begin(cache_cursor_t *cc,int fd,long long offset,long long expected_size)
+{
+	cc->fd = fd;
+	cc->start = offset;
+	cc->ra_end = offset;
+	cc->flushed = offset;
+	cc->dropped = offset;
+	cc->drop = tunable_cache_drop_threshold > 0 && expected_size > tunable_cache_drop_threshold;
+}
+
+void cache_write_advance(cache_cursor_t *cc,long long pos)
+{
+	// 大小未知时，写入量超过阈值后才开始丢弃缓存
+	if( !cc->drop && tunable_cache_drop_threshold > 0 &&
+		pos - cc->start > tunable_cache_drop_threshold )
+	{
+		cc->drop = 1;
+	}
+
+	// 脏页回写之后才能丢弃，没有配置回写窗口时按CACHE_DROP_WINDOW回写
+	long long window = tunable_writebehind_window;
+	if( window == 0 )
+	{
+		if( !cc->drop )
+		{
+			return;
+		}
+		window = CACHE_DROP_WINDOW;
+	}
+
+	while( pos - cc->flushed >= window )
+	{
+		// 异步提交当前窗口的回写，然后等待上一个窗口回写完成，
+		// 这样磁盘上始终只有一到两个窗口的脏数据
+		sync_file_range(cc->fd,cc->flushed,window,SYNC_FILE_RANGE_WRITE);
+		if( cc->flushed - window >= cc->start )
+		{
+			sync_file_range(cc->fd,cc->flushed - window,window,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			drop_behind(cc,cc->flushed);
+		}
+		cc->flushed += window;
+	}
+}
+
+void cache_write_end(cache_cursor_t *cc,long long pos)
+{
+	if( (tunable_writebehind_window == 0 && !cc->drop) || pos <= cc->flushed )
+	{
+		return;
+	}
+
+	// 只提交不等待，剩余的脏数据由内核按正常节奏回写
+	sync_file_range(cc->fd,cc->flushed,pos - cc->flushed,SYNC_FILE_RANGE_WRITE);
+	cc->flushed = pos;
+}
+
+// 丢弃[dropped,pos)范围的缓存，脏页不会被丢弃
+static void drop_behind(cache_cursor_t *cc,long long pos)
+{
+	if( !cc->drop || pos <= cc->dropped )
+	{
+		return;
+	}
+
+	// 积累到一定量再调用，减少系统调用次数
+	if( pos - cc->dropped < CACHE_DROP_CHUNK )
+	{
+		return;
+	}
+
+	posix_fadvise(cc->fd,cc->dropped,pos - cc->dropped,POSIX_FADV_DONTNEED);
+	cc->dropped = pos;
+}
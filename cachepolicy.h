@@ -0,0 +1,63 @@
+#ifndef __CACHEPOLICY_H__
+#define __CACHEPOLICY_H__
+
+// 流式传输的页缓存策略
+// 下载：顺序预读窗口(WILLNEED)，大文件在游标之后丢弃已发送部分的缓存(DONTNEED)；
+// 上传：按窗口提前回写(sync_file_range)，避免积累大量脏页后集中回写阻塞，
+//       大文件回写完成的部分同样丢弃缓存，不挤占其他小文件的缓存
+
+typedef struct cache_cursor
+{
+	int fd;
+	// 是否丢弃游标之后的缓存
+	int drop;
+	// 传输开始位置
+	long long start;
+	// 已发出预读请求的结束位置
+	long long ra_end;
+	// 已提交回写的结束位置
+	long long flushed;
+	// 已丢弃缓存的结束位置
+	long long dropped;
+} cache_cursor_t;
+
+/**
+ * cache_read_begin - 开始下载
+ * @cc - 游标
+ * @fd - 文件
+ * @offset - 开始位置
+ * @file_size - 文件大小
+ */
+void cache_read_begin(cache_cursor_t *cc,int fd,long long offset,long long file_size);
+
+/**
+ * cache_read_advance - 已发送到pos位置，推进预读窗口并丢弃已发送部分的缓存
+ * @cc - 游标
+ * @pos - 当前位置
+ */
+void cache_read_advance(cache_cursor_t *cc,long long pos);
+
+/**
+ * cache_write_begin - 开始上传
+ * @cc - 游标
+ * @fd - 文件
+ * @offset - 开始位置
+ * @expected_size - 预计写入的字节数，未知为0
+ */
+void cache_write_begin(cache_cursor_t *cc,int fd,long long offset,long long expected_size);
+
+/**
+ * cache_write_advance - 已写入到pos位置，按窗口提交回写
+ * @cc - 游标
+ * @pos - 当前位置
+ */
+void cache_write_advance(cache_cursor_t *cc,long long pos);
+
+/**
+ * cache_write_end - 上传结束，提交剩余部分的回写
+ * @cc - 游标
+ * @pos - 结束位置
+ */
+void cache_write_end(cache_cursor_t *cc,long long pos);
+
+#endif /* __CACHEPOLICY_H__ */
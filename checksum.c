@@ -0,0 +1,758 @@
+#include "checksum.h"
+#include <sys/xattr.h>
+// 硬件加速(SSE4.2 CRC32、SHA扩展)只在x86上编译，其他平台使用查表和标量实现
+#if defined(__x86_64__) || defined(__i386__)
+#define CKSUM_HW_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// 计算文件摘要时每次读取的字节数
+#define CKSUM_READ_SIZE		(1024*1024)
+
+#define ROTL32(x,n)	(((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR32(x,n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static const char *s_algo_names[CKSUM_COUNT] =
+{
+	"SHA-256", "SHA-1", "MD5", "CRC32", "CRC32C"
+};
+
+static const uint32_t s_md5_k[64] =
+{
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const int s_md5_r[64] =
+{
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static const uint32_t s_sha256_k[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// CRC查表(slicing-by-8)，第一次使用时生成
+static uint32_t s_crc32_table[8][256];
+static uint32_t s_crc32c_table[8][256];
+static int s_has_sse42;
+static int s_has_sha;
+static pthread_once_t s_init_once = PTHREAD_ONCE_INIT;
+
+static void checksum_global_init();
+static void crc_table_init(uint32_t table[8][256],uint32_t poly);
+static uint32_t crc_sliced(uint32_t table[8][256],uint32_t crc,const unsigned char *p,size_t len);
+#ifdef CKSUM_HW_X86
+static uint32_t crc32c_hw(uint32_t crc,const unsigned char *p,size_t len);
+#endif
+static void md5_blocks(uint32_t *state,const unsigned char *p,size_t blocks);
+static void sha1_blocks(uint32_t *state,const unsigned char *p,size_t blocks);
+static void sha256_blocks(uint32_t *state,const unsigned char *p,size_t blocks);
+#ifdef CKSUM_HW_X86
+static void sha256_blocks_shani(uint32_t *state,const unsigned char *p,size_t blocks);
+#endif
+static void compress_blocks(checksum_ctx_t *ctx,const unsigned char *p,size_t blocks);
+static void get_cache_name(int algo,char *name,size_t len);
+static int hash_range(int fd,int algo,long long start,long long end,char *hex,long long *p_pos,int *p_cancel);
+static void* checksum_job_routine(void *arg);
+
+int checksum_lookup(const char *name)
+{
+	int i;
+	for( i = 0; i < CKSUM_COUNT; ++i )
+	{
+		if( strcasecmp(name,s_algo_names[i]) == 0 )
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+const char* checksum_name(int algo)
+{
+	return s_algo_names[algo];
+}
+
+void checksum_init(checksum_ctx_t *ctx,int algo)
+{
+	pthread_once(&s_init_once,checksum_global_init);
+
+	bzero(ctx,sizeof(*ctx));
+	ctx->algo = algo;
+	switch( algo )
+	{
+		case CKSUM_CRC32:
+		case CKSUM_CRC32C:
+			ctx->crc = 0xffffffff;
+			break;
+		case CKSUM_MD5:
+		case CKSUM_SHA1:
+			ctx->state[0] = 0x67452301;
+			ctx->state[1] = 0xefcdab89;
+			ctx->state[2] = 0x98badcfe;
+			ctx->state[3] = 0x10325476;
+			ctx->state[4] = 0xc3d2e1f0;
+			break;
+		case CKSUM_SHA256:
+			ctx->state[0] = 0x6a09e667;
+			ctx->state[1] = 0xbb67ae85;
+			ctx->state[2] = 0x3c6ef372;
+			ctx->state[3] = 0xa54ff53a;
+			ctx->state[4] = 0x510e527f;
+			ctx->state[5] = 0x9b05688c;
+			ctx->state[6] = 0x1f83d9ab;
+			ctx->state[7] = 0x5be0cd19;
+			break;
+	}
+}
+
+void checksum_update(checksum_ctx_t *ctx,const void *buf,size_t len)
+{
+	const unsigned char *p = (const unsigned char*)buf;
+	ctx->length += len;
+
+	if( ctx->algo == CKSUM_CRC32 )
+	{
+		ctx->crc = crc_sliced(s_crc32_table,ctx->crc,p,len);
+		return;
+	}
+	else if( ctx->algo == CKSUM_CRC32C )
+	{
+#ifdef CKSUM_HW_X86
+		if( s_has_sse42 )
+		{
+			ctx->crc = crc32c_hw(ctx->crc,p,len);
+			return;
+		}
+#endif
+		ctx->crc = crc_sliced(s_crc32c_table,ctx->crc,p,len);
+		return;
+	}
+
+	// 先补齐上次剩下的不完整分组，再直接处理整分组
+	if( ctx->block_len > 0 )
+	{
+		size_t n = 64 - ctx->block_len;
+		if( n > len )
+		{
+			n = len;
+		}
+		memcpy(ctx->block + ctx->block_len,p,n);
+		ctx->block_len += n;
+		p += n;
+		len -= n;
+		if( ctx->block_len < 64 )
+		{
+			return;
+		}
+		compress_blocks(ctx,ctx->block,1);
+		ctx->block_len = 0;
+	}
+
+	if( len >= 64 )
+	{
+		compress_blocks(ctx,p,len / 64);
+		p += len & ~(size_t)63;
+		len &= 63;
+	}
+
+	memcpy(ctx->block,p,len);
+	ctx->block_len = len;
+}
+
+void checksum_final(checksum_ctx_t *ctx,char *hex)
+{
+	unsigned char digest[CKSUM_MAX_DIGEST];
+	int digest_len = checksum_digest(ctx,digest);
+	int i;
+	for( i = 0; i < digest_len; ++i )
+	{
+		sprintf(hex + 2*i,"%02x",digest[i]);
+	}
+}
+
+int checksum_digest(checksum_ctx_t *ctx,unsigned char *digest)
+{
+	int i;
+	if( ctx->algo == CKSUM_CRC32 || ctx->algo == CKSUM_CRC32C )
+	{
+		uint32_t crc = ctx->crc ^ 0xffffffff;
+		digest[0] = crc >> 24;
+		digest[1] = crc >> 16;
+		digest[2] = crc >> 8;
+		digest[3] = crc;
+		return 4;
+	}
+
+	// 填充：0x80，若干0，最后8字节是比特长度(MD5小端，SHA大端)
+	uint64_t bits = ctx->length * 8;
+	ctx->block[ctx->block_len++] = 0x80;
+	if( ctx->block_len > 56 )
+	{
+		memset(ctx->block + ctx->block_len,0,64 - ctx->block_len);
+		compress_blocks(ctx,ctx->block,1);
+		ctx->block_len = 0;
+	}
+	memset(ctx->block + ctx->block_len,0,56 - ctx->block_len);
+	for( i = 0; i < 8; ++i )
+	{
+		if( ctx->algo == CKSUM_MD5 )
+		{
+			ctx->block[56 + i] = (unsigned char)(bits >> (8 * i));
+		}
+		else
+		{
+			ctx->block[63 - i] = (unsigned char)(bits >> (8 * i));
+		}
+	}
+	compress_blocks(ctx,ctx->block,1);
+
+	int words = ctx->algo == CKSUM_MD5 ? 4 : (ctx->algo == CKSUM_SHA1 ? 5 : 8);
+	for( i = 0; i < words; ++i )
+	{
+		uint32_t w = ctx->state[i];
+		if( ctx->algo == CKSUM_MD5 )
+		{
+			digest[4*i] = w;
+			digest[4*i+1] = w >> 8;
+			digest[4*i+2] = w >> 16;
+			digest[4*i+3] = w >> 24;
+		}
+		else
+		{
+			digest[4*i] = w >> 24;
+			digest[4*i+1] = w >> 16;
+			digest[4*i+2] = w >> 8;
+			digest[4*i+3] = w;
+		}
+	}
+
+	return words * 4;
+}
+
+int checksum_file(int fd,int algo,long long start,long long end,char *hex)
+{
+	return hash_range(fd,algo,start,end,hex,NULL,NULL);
+}
+
+int checksum_job_start(checksum_job_t *job,int fd,int algo,long long start,long long end)
+{
+	bzero(job,sizeof(*job));
+	job->fd = fd;
+	job->algo = algo;
+	job->start = start;
+	job->end = end;
+	job->pos = start;
+	job->result = -1;
+
+	// 信号只交给会话线程处理
+	sigset_t all_set;
+	sigset_t old_set;
+	sigfillset(&all_set);
+	pthread_sigmask(SIG_BLOCK,&all_set,&old_set);
+	int ret = pthread_create(&job->thread,NULL,checksum_job_routine,job);
+	pthread_sigmask(SIG_SETMASK,&old_set,NULL);
+
+	return ret == 0 ? 0 : -1;
+}
+
+long long checksum_job_pos(checksum_job_t *job)
+{
+	return __atomic_load_n(&job->pos,__ATOMIC_RELAXED);
+}
+
+int checksum_job_finish(checksum_job_t *job,int cancel,char *hex)
+{
+	if( cancel )
+	{
+		__atomic_store_n(&job->cancel,1,__ATOMIC_RELAXED);
+	}
+	pthread_join(job->thread,NULL);
+
+	if( cancel || job->result == -1 )
+	{
+		return -1;
+	}
+	strcpy(hex,job->hex);
+
+	return 0;
+}
+
+static void* checksum_job_routine(void *arg)
+{
+	checksum_job_t *job = (checksum_job_t*)arg;
+	job->result = hash_range(job->fd,job->algo,job->start,job->end,job->hex,&job->pos,&job->cancel);
+
+	return NULL;
+}
+
+// p_pos不为NULL时随时更新已经计算到的位置，*p_cancel变为1时放弃计算
+static int hash_range(int fd,int algo,long long start,long long end,char *hex,long long *p_pos,int *p_cancel)
+{
+	char *buf = (char*)malloc(CKSUM_READ_SIZE);
+	if( buf == NULL )
+	{
+		return -1;
+	}
+
+	posix_fadvise(fd,start,end - start,POSIX_FADV_SEQUENTIAL);
+
+	checksum_ctx_t ctx;
+	checksum_init(&ctx,algo);
+
+	long long pos = start;
+	while( pos < end )
+	{
+		long long want = end - pos > CKSUM_READ_SIZE ? CKSUM_READ_SIZE : end - pos;
+		ssize_t ret = pread(fd,buf,want,pos);
+		if( ret == -1 && errno == EINTR )
+		{
+			continue;
+		}
+		else if( ret <= 0 )
+		{
+			free(buf);
+			return -1;
+		}
+
+		checksum_update(&ctx,buf,ret);
+		pos += ret;
+		if( p_pos != NULL )
+		{
+			__atomic_store_n(p_pos,pos,__ATOMIC_RELAXED);
+		}
+		if( p_cancel != NULL && __atomic_load_n(p_cancel,__ATOMIC_RELAXED) )
+		{
+			free(buf);
+			return -1;
+		}
+	}
+
+	free(buf);
+	checksum_final(&ctx,hex);
+
+	return 0;
+}
+
+int checksum_cache_get(int fd,int algo,const struct stat *sbuf,char *hex)
+{
+	char name[MAX_SET_NAME_LEN];
+	char value[MAX_LINE];
+	get_cache_name(algo,name,sizeof(name));
+
+	ssize_t len = fgetxattr(fd,name,value,sizeof(value) - 1);
+	if( len <= 0 )
+	{
+		return -1;
+	}
+	value[len] = '\0';
+
+	// mtime秒.纳秒 大小 摘要
+	long long sec;
+	long long nsec;
+	long long size;
+	char digest[CKSUM_HEX_LEN];
+	if( sscanf(value,"%lld.%lld %lld %64s",&sec,&nsec,&size,digest) != 4 )
+	{
+		return -1;
+	}
+	if( sec != sbuf->st_mtim.tv_sec || nsec != sbuf->st_mtim.tv_nsec || size != sbuf->st_size )
+	{
+		return -1;
+	}
+
+	strcpy(hex,digest);
+	return 0;
+}
+
+void checksum_cache_put(int fd,int algo,const struct stat *sbuf,const char *hex)
+{
+	char name[MAX_SET_NAME_LEN];
+	char value[MAX_LINE];
+	get_cache_name(algo,name,sizeof(name));
+
+	snprintf(value,sizeof(value),"%lld.%09ld %lld %s",(long long)sbuf->st_mtim.tv_sec,
+		(long)sbuf->st_mtim.tv_nsec,(long long)sbuf->st_size,hex);
+	fsetxattr(fd,name,value,strlen(value),0);
+}
+
+static void get_cache_name(int algo,char *name,size_t len)
+{
+	// user.miniftpd.sha-256
+	snprintf(name,len,"user.miniftpd.%s",s_algo_names[algo]);
+	char *p = name;
+	for( ; *p != '\0'; ++p )
+	{
+		*p = tolower(*p);
+	}
+}
+
+static void checksum_global_init()
+{
+	crc_table_init(s_crc32_table,0xedb88320);
+	crc_table_init(s_crc32c_table,0x82f63b78);
+
+#ifdef CKSUM_HW_X86
+	unsigned int eax;
+	unsigned int ebx;
+	unsigned int ecx;
+	unsigned int edx;
+	if( __get_cpuid(1,&eax,&ebx,&ecx,&edx) )
+	{
+		s_has_sse42 = (ecx & bit_SSE4_2) != 0;
+		// SHA扩展指令的实现还用到了SSSE3和SSE4.1
+		s_has_sha = (ecx & bit_SSSE3) && (ecx & bit_SSE4_1);
+	}
+	if( !__get_cpuid_count(7,0,&eax,&ebx,&ecx,&edx) || !(ebx & bit_SHA) )
+	{
+		s_has_sha = 0;
+	}
+#endif
+}
+
+static void crc_table_init(uint32_t table[8][256],uint32_t poly)
+{
+	int i;
+	int j;
+	for( i = 0; i < 256; ++i )
+	{
+		uint32_t crc = i;
+		for( j = 0; j < 8; ++j )
+		{
+			crc = (crc >> 1) ^ ((crc & 1) ? poly : 0);
+		}
+		table[0][i] = crc;
+	}
+	for( i = 0; i < 256; ++i )
+	{
+		for( j = 1; j < 8; ++j )
+		{
+			table[j][i] = (table[j-1][i] >> 8) ^ table[0][table[j-1][i] & 0xff];
+		}
+	}
+}
+
+static uint32_t crc_sliced(uint32_t table[8][256],uint32_t crc,const unsigned char *p,size_t len)
+{
+	while( len >= 8 )
+	{
+		uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+		uint32_t hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+		crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+			table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+			table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+			table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while( len-- > 0 )
+	{
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	}
+
+	return crc;
+}
+
+#ifdef CKSUM_HW_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc,const unsigned char *p,size_t len)
+{
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+	while( len >= 8 )
+	{
+		uint64_t v;
+		memcpy(&v,p,sizeof(v));
+		crc64 = _mm_crc32_u64(crc64,v);
+		p += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)crc64;
+#else
+	// 32位x86没有64位的crc32指令
+	while( len >= 4 )
+	{
+		uint32_t v;
+		memcpy(&v,p,sizeof(v));
+		crc = _mm_crc32_u32(crc,v);
+		p += 4;
+		len -= 4;
+	}
+#endif
+	while( len-- > 0 )
+	{
+		crc = _mm_crc32_u8(crc,*p++);
+	}
+
+	return crc;
+}
+#endif
+
+static void compress_blocks(checksum_ctx_t *ctx,const unsigned char *p,size_t blocks)
+{
+	switch( ctx->algo )
+	{
+		case CKSUM_MD5:
+			md5_blocks(ctx->state,p,blocks);
+			break;
+		case CKSUM_SHA1:
+			sha1_blocks(ctx->state,p,blocks);
+			break;
+		case CKSUM_SHA256:
+#ifdef CKSUM_HW_X86
+			if( s_has_sha )
+			{
+				sha256_blocks_shani(ctx->state,p,blocks);
+				break;
+			}
+#endif
+			sha256_blocks(ctx->state,p,blocks);
+			break;
+	}
+}
+
+static void md5_blocks(uint32_t *state,const unsigned char *p,size_t blocks)
+{
+	for( ; blocks > 0; --blocks, p += 64 )
+	{
+		uint32_t m[16];
+		int i;
+		for( i = 0; i < 16; ++i )
+		{
+			m[i] = p[4*i] | (p[4*i+1] << 8) | (p[4*i+2] << 16) | ((uint32_t)p[4*i+3] << 24);
+		}
+
+		uint32_t a = state[0];
+		uint32_t b = state[1];
+		uint32_t c = state[2];
+		uint32_t d = state[3];
+		for( i = 0; i < 64; ++i )
+		{
+			uint32_t f;
+			int g;
+			if( i < 16 )
+			{
+				f = (b & c) | (~b & d);
+				g = i;
+			}
+			else if( i < 32 )
+			{
+				f = (d & b) | (~d & c);
+				g = (5*i + 1) & 15;
+			}
+			else if( i < 48 )
+			{
+				f = b ^ c ^ d;
+				g = (3*i + 5) & 15;
+			}
+			else
+			{
+				f = c ^ (b | ~d);
+				g = (7*i) & 15;
+			}
+
+			uint32_t tmp = d;
+			d = c;
+			c = b;
+			b = b + ROTL32(a + f + s_md5_k[i] + m[g],s_md5_r[i]);
+			a = tmp;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+	}
+}
+
+static void sha1_blocks(uint32_t *state,const unsigned char *p,size_t blocks)
+{
+	for( ; blocks > 0; --blocks, p += 64 )
+	{
+		uint32_t w[80];
+		int i;
+		for( i = 0; i < 16; ++i )
+		{
+			w[i] = ((uint32_t)p[4*i] << 24) | (p[4*i+1] << 16) | (p[4*i+2] << 8) | p[4*i+3];
+		}
+		for( i = 16; i < 80; ++i )
+		{
+			w[i] = ROTL32(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16],1);
+		}
+
+		uint32_t a = state[0];
+		uint32_t b = state[1];
+		uint32_t c = state[2];
+		uint32_t d = state[3];
+		uint32_t e = state[4];
+		for( i = 0; i < 80; ++i )
+		{
+			uint32_t f;
+			uint32_t k;
+			if( i < 20 )
+			{
+				f = (b & c) | (~b & d);
+				k = 0x5a827999;
+			}
+			else if( i < 40 )
+			{
+				f = b ^ c ^ d;
+				k = 0x6ed9eba1;
+			}
+			else if( i < 60 )
+			{
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8f1bbcdc;
+			}
+			else
+			{
+				f = b ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+
+			uint32_t tmp = ROTL32(a,5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = ROTL32(b,30);
+			b = a;
+			a = tmp;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+	}
+}
+
+static void sha256_blocks(uint32_t *state,const unsigned char *p,size_t blocks)
+{
+	for( ; blocks > 0; --blocks, p += 64 )
+	{
+		uint32_t w[64];
+		int i;
+		for( i = 0; i < 16; ++i )
+		{
+			w[i] = ((uint32_t)p[4*i] << 24) | (p[4*i+1] << 16) | (p[4*i+2] << 8) | p[4*i+3];
+		}
+		for( i = 16; i < 64; ++i )
+		{
+			uint32_t s0 = ROTR32(w[i-15],7) ^ ROTR32(w[i-15],18) ^ (w[i-15] >> 3);
+			uint32_t s1 = ROTR32(w[i-2],17) ^ ROTR32(w[i-2],19) ^ (w[i-2] >> 10);
+			w[i] = w[i-16] + s0 + w[i-7] + s1;
+		}
+
+		uint32_t a = state[0];
+		uint32_t b = state[1];
+		uint32_t c = state[2];
+		uint32_t d = state[3];
+		uint32_t e = state[4];
+		uint32_t f = state[5];
+		uint32_t g = state[6];
+		uint32_t h = state[7];
+		for( i = 0; i < 64; ++i )
+		{
+			uint32_t s1 = ROTR32(e,6) ^ ROTR32(e,11) ^ ROTR32(e,25);
+			uint32_t ch = (e & f) ^ (~e & g);
+			uint32_t t1 = h + s1 + ch + s_sha256_k[i] + w[i];
+			uint32_t s0 = ROTR32(a,2) ^ ROTR32(a,13) ^ ROTR32(a,22);
+			uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+			uint32_t t2 = s0 + maj;
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+// SHA扩展指令：sha256rnds2一次完成两轮，状态按ABEF/CDGH排列，
+// 消息扩展由sha256msg1/sha256msg2完成，每次处理4个字
+#ifdef CKSUM_HW_X86
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha256_blocks_shani(uint32_t *state,const unsigned char *p,size_t blocks)
+{
+	const __m128i shuf_mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,0x0405060700010203ULL);
+
+	__m128i tmp = _mm_loadu_si128((const __m128i*)&state[0]);
+	__m128i state1 = _mm_loadu_si128((const __m128i*)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp,0xb1);			// CDAB
+	state1 = _mm_shuffle_epi32(state1,0x1b);		// EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp,state1,8);		// ABEF
+	state1 = _mm_blend_epi16(state1,tmp,0xf0);		// CDGH
+
+	for( ; blocks > 0; --blocks, p += 64 )
+	{
+		__m128i abef_save = state0;
+		__m128i cdgh_save = state1;
+		__m128i w[4];
+		int i;
+		for( i = 0; i < 16; ++i )
+		{
+			__m128i msg;
+			if( i < 4 )
+			{
+				msg = _mm_loadu_si128((const __m128i*)(p + 16*i));
+				w[i] = _mm_shuffle_epi8(msg,shuf_mask);
+			}
+			else
+			{
+				// W[i] = msg2(msg1(W[i-4],W[i-3]) + alignr(W[i-1],W[i-2]),W[i-1])
+				msg = _mm_sha256msg1_epu32(w[i & 3],w[(i+1) & 3]);
+				msg = _mm_add_epi32(msg,_mm_alignr_epi8(w[(i+3) & 3],w[(i+2) & 3],4));
+				w[i & 3] = _mm_sha256msg2_epu32(msg,w[(i+3) & 3]);
+			}
+
+			msg = _mm_add_epi32(w[i & 3],_mm_loadu_si128((const __m128i*)&s_sha256_k[4*i]));
+			state1 = _mm_sha256rnds2_epu32(state1,state0,msg);
+			msg = _mm_shuffle_epi32(msg,0x0e);
+			state0 = _mm_sha256rnds2_epu32(state0,state1,msg);
+		}
+
+		state0 = _mm_add_epi32(state0,abef_save);
+		state1 = _mm_add_epi32(state1,cdgh_save);
+	}
+
+	tmp = _mm_shuffle_epi32(state0,0x1b);			// FEBA
+	state1 = _mm_shuffle_epi32(state1,0xb1);		// DCHG
+	state0 = _mm_blend_epi16(tmp,state1,0xf0);		// DCBA
+	state1 = _mm_alignr_epi8(state1,tmp,8);			// ABEF
+
+	_mm_storeu_si128((__m128i*)&state[0],state0);
+	_mm_storeu_si128((__m128i*)&state[4],state1);
+}
+#endif
@@ -0,0 +1,151 @@
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+#include "common.h"
+#include <stdint.h>
+
+// 文件校验(HASH/XCRC/XMD5/XSHA1/XSHA256)
+// CRC32C和SHA-256在CPU支持时使用SSE4.2的crc32指令和SHA扩展指令，
+// 整个文件的结果缓存在扩展属性user.miniftpd.<算法>中，以mtime和大小作为键，
+// 文件未修改时再次请求不需要读取文件
+
+#define CKSUM_SHA256	0
+#define CKSUM_SHA1	1
+#define CKSUM_MD5	2
+#define CKSUM_CRC32	3
+#define CKSUM_CRC32C	4
+#define CKSUM_COUNT	5
+
+// 最长摘要(SHA-256)的字节数，以及十六进制长度+1
+#define CKSUM_MAX_DIGEST	32
+#define CKSUM_HEX_LEN	65
+
+typedef struct checksum_ctx
+{
+	int algo;
+	// 已处理的字节数
+	uint64_t length;
+	// CRC32/CRC32C
+	uint32_t crc;
+	// MD5/SHA-1/SHA-256的链接变量
+	uint32_t state[8];
+	// 不足一个分组的数据
+	unsigned char block[64];
+	int block_len;
+} checksum_ctx_t;
+
+// 在后台线程中计算文件摘要，用于sendfile下载时同时从页缓存计算
+typedef struct checksum_job
+{
+	pthread_t thread;
+	int fd;
+	int algo;
+	long long start;
+	long long end;
+	// 已经计算到的位置
+	long long pos;
+	int cancel;
+	int result;
+	char hex[CKSUM_HEX_LEN];
+} checksum_job_t;
+
+/**
+ * checksum_lookup - 按HASH命令使用的名称查找算法
+ * @name - 算法名称，如SHA-256，不区分大小写
+ * return value - 算法编号，不支持返回-1
+ */
+int checksum_lookup(const char *name);
+
+/**
+ * checksum_name - 算法名称
+ * @algo - 算法编号
+ */
+const char* checksum_name(int algo);
+
+/**
+ * checksum_init - 开始计算
+ * @ctx - 上下文
+ * @algo - 算法编号
+ */
+void checksum_init(checksum_ctx_t *ctx,int algo);
+
+/**
+ * checksum_update - 追加数据
+ * @ctx - 上下文
+ * @buf - 数据
+ * @len - 长度
+ */
+void checksum_update(checksum_ctx_t *ctx,const void *buf,size_t len);
+
+/**
+ * checksum_final - 结束计算，输出小写十六进制摘要
+ * @ctx - 上下文
+ * @hex - 输出缓冲区，至少CKSUM_HEX_LEN字节
+ */
+void checksum_final(checksum_ctx_t *ctx,char *hex);
+
+/**
+ * checksum_digest - 结束计算，输出二进制摘要
+ * @ctx - 上下文
+ * @digest - 输出缓冲区，至少CKSUM_MAX_DIGEST字节
+ * return value - 摘要的字节数
+ */
+int checksum_digest(checksum_ctx_t *ctx,unsigned char *digest);
+
+/**
+ * checksum_file - 计算文件[start,end)范围的摘要
+ * @fd - 文件
+ * @algo - 算法编号
+ * @start - 开始位置
+ * @end - 结束位置(不含)
+ * @hex - 输出缓冲区，至少CKSUM_HEX_LEN字节
+ * return value - 成功返回0，读取失败返回-1
+ */
+int checksum_file(int fd,int algo,long long start,long long end,char *hex);
+
+/**
+ * checksum_job_start - 启动后台线程计算文件[start,end)范围的摘要
+ * @job - 任务
+ * @fd - 文件，只使用pread，不影响文件偏移
+ * @algo - 算法编号
+ * @start - 开始位置
+ * @end - 结束位置(不含)
+ * return value - 成功返回0，失败返回-1
+ */
+int checksum_job_start(checksum_job_t *job,int fd,int algo,long long start,long long end);
+
+/**
+ * checksum_job_pos - 后台线程已经计算到的位置
+ * @job - 任务
+ */
+long long checksum_job_pos(checksum_job_t *job);
+
+/**
+ * checksum_job_finish - 等待后台线程结束
+ * @job - 任务
+ * @cancel - 为1时让线程尽快退出，不需要结果
+ * @hex - 输出缓冲区，至少CKSUM_HEX_LEN字节，cancel为1时可以为NULL
+ * return value - 计算完成返回0，失败或者取消返回-1
+ */
+int checksum_job_finish(checksum_job_t *job,int cancel,char *hex);
+
+/**
+ * checksum_cache_get - 读取缓存的整个文件的摘要
+ * @fd - 文件
+ * @algo - 算法编号
+ * @sbuf - 文件当前的状态，mtime或大小不一致时缓存无效
+ * @hex - 输出缓冲区，至少CKSUM_HEX_LEN字节
+ * return value - 命中返回0，否则返回-1
+ */
+int checksum_cache_get(int fd,int algo,const struct stat *sbuf,char *hex);
+
+/**
+ * checksum_cache_put - 缓存整个文件的摘要，文件系统不支持扩展属性时忽略
+ * @fd - 文件
+ * @algo - 算法编号
+ * @sbuf - 计算时文件的状态
+ * @hex - 摘要
+ */
+void checksum_cache_put(int fd,int algo,const struct stat *sbuf,const char *hex);
+
+#endif /* __CHECKSUM_H__ */
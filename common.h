@@ -9,6 +9,7 @@
 #include <stdlib.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netdb.h>
@@ -16,6 +17,7 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <pwd.h>
+#include <grp.h>
 #include <ctype.h>
 #include <shadow.h>
 #include <crypt.h>
@@ -23,6 +25,8 @@
 #include <time.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <limits.h>
 #include <sys/select.h>
 #include <wchar.h>
 #include <sys/ioctl.h>
@@ -33,6 +37,10 @@
 #include <sys/sendfile.h>
 #include <sys/wait.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/prctl.h>
 
 #define ERR_EXIT(err_str) do { perror(err_str);  \
 		exit(EXIT_FAILURE); } while(0)
@@ -57,4 +65,28 @@
 
 #define PID_IP_COUNT		256
 
+// 开启内核限速(SO_MAX_PACING_RATE)时每次sendfile的字节数
+#define PACING_CHUNK_SIZE	(256*1024)
+
+// 丢弃已传输部分页缓存的最小粒度
+#define CACHE_DROP_CHUNK	(1024*1024)
+
+// 只丢弃缓存(没有配置writebehind_window)时回写的粒度
+#define CACHE_DROP_WINDOW	(8*1024*1024)
+
+// 长时间操作期间检查控制连接的间隔(毫秒)
+#define TREE_HASH_POLL_MS	100
+
+// send_fds/recv_fds一次最多传递的描述符个数
+#define MAX_PASS_FDS		4
+
+// RETR在建立数据连接之前预读的字节数
+#define RETR_START_READAHEAD	(256*1024)
+
+// 被动模式端口池最多预先绑定的端口数，每个nobody进程都持有这些描述符
+#define PASV_POOL_MAX		512
+
+// 主进程阻塞等待之间最多连续accept的连接数，之后处理挂起的SIGCHLD
+#define ACCEPT_BATCH		32
+
 #endif /* __COMMON_H_ */
@@ -0,0 +1,170 @@
+#include "deltasync.h"
+#include "checksum.h"
+#include "sysutil.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// 计算签名时每次读取的最小字节数
+#define DELTA_READ_SIZE		(1024*1024)
+// 边车文件头部的最大长度
+#define DELTA_HEADER_MAX	128
+
+static void delta_sig_name(const char *path,char *name,unsigned int len);
+static int delta_sig_build(int fd,long long size,int block_size,int out_fd,
+	delta_progress_t p_progress,void *arg);
+
+uint32_t delta_weak_sum(const unsigned char *buf,int len)
+{
+	uint32_t s1 = 0;
+	uint32_t s2 = 0;
+	int i = 0;
+#ifdef __SSE2__
+	// 每16字节：s2增加16*s1和本组按(16-k)加权的和，s1增加本组的和
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i weight_lo = _mm_setr_epi16(16,15,14,13,12,11,10,9);
+	const __m128i weight_hi = _mm_setr_epi16(8,7,6,5,4,3,2,1);
+	for( ; i + 16 <= len; i += 16 )
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+		s2 += s1 * 16;
+
+		__m128i sad = _mm_sad_epu8(v,zero);
+		s1 += _mm_cvtsi128_si32(sad) + _mm_cvtsi128_si32(_mm_srli_si128(sad,8));
+
+		__m128i m = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(v,zero),weight_lo),
+			_mm_madd_epi16(_mm_unpackhi_epi8(v,zero),weight_hi));
+		m = _mm_add_epi32(m,_mm_srli_si128(m,8));
+		m = _mm_add_epi32(m,_mm_srli_si128(m,4));
+		s2 += _mm_cvtsi128_si32(m);
+	}
+#endif
+	for( ; i < len; ++i )
+	{
+		s1 += buf[i];
+		s2 += s1;
+	}
+	return (s1 & 0xffff) | (s2 << 16);
+}
+
+int delta_sig_open(int fd,const char *path,const struct stat *sbuf,int block_size,
+	delta_progress_t p_progress,void *arg,long long *p_off)
+{
+	char name[MAX_LINE] = {0};
+	delta_sig_name(path,name,sizeof(name));
+
+	// 头部：<mtime秒>.<纳秒> <大小> <块大小>\n
+	char header[DELTA_HEADER_MAX] = {0};
+	int header_len = snprintf(header,sizeof(header),"%ld.%09ld %lld %d\n",(long)sbuf->st_mtim.tv_sec,
+		(long)sbuf->st_mtim.tv_nsec,(long long)sbuf->st_size,block_size);
+	long long blocks = (sbuf->st_size + block_size - 1) / block_size;
+	*p_off = header_len;
+
+	int sig_fd = open(name,O_RDONLY);
+	if( sig_fd != -1 )
+	{
+		char old_header[DELTA_HEADER_MAX] = {0};
+		struct stat sig_buf;
+		if( pread(sig_fd,old_header,header_len,0) == header_len && memcmp(old_header,header,header_len) == 0 &&
+			fstat(sig_fd,&sig_buf) == 0 && sig_buf.st_size == header_len + blocks * DELTA_SIG_LEN )
+		{
+			return sig_fd;
+		}
+		close(sig_fd);
+	}
+
+	// 先写入本会话私有的临时文件，完成后替换，其他会话不会读到一半的签名，
+	// 同时计算同一文件签名的会话也不会写同一个文件
+	static unsigned int s_seq = 0;
+	char part_name[MAX_LINE + 32] = {0};
+	snprintf(part_name,sizeof(part_name),"%s.%d.%u.tmp",name,(int)getpid(),++s_seq);
+	sig_fd = open(part_name,O_CREAT | O_EXCL | O_RDWR,0666);
+	if( sig_fd == -1 )
+	{
+		return -1;
+	}
+	if( writen(sig_fd,header,header_len) != header_len ||
+		delta_sig_build(fd,sbuf->st_size,block_size,sig_fd,p_progress,arg) == -1 ||
+		rename(part_name,name) == -1 )
+	{
+		close(sig_fd);
+		unlink(part_name);
+		return -1;
+	}
+	return sig_fd;
+}
+
+// 文件a/b的边车文件为a/.b.sigs
+static void delta_sig_name(const char *path,char *name,unsigned int len)
+{
+	const char *base = strrchr(path,'/');
+	if( base == NULL )
+	{
+		snprintf(name,len,".%s.sigs",path);
+	}
+	else
+	{
+		snprintf(name,len,"%.*s/.%s.sigs",(int)(base - path),path,base + 1);
+	}
+}
+
+static int delta_sig_build(int fd,long long size,int block_size,int out_fd,
+	delta_progress_t p_progress,void *arg)
+{
+	// 每次读取整数个块
+	int read_size = (DELTA_READ_SIZE + block_size - 1) / block_size * block_size;
+	unsigned char *buf = (unsigned char*)malloc(read_size);
+	// 一次读取的块的签名一起写出
+	unsigned char *sigs = (unsigned char*)malloc(read_size / block_size * DELTA_SIG_LEN);
+	if( buf == NULL || sigs == NULL )
+	{
+		free(buf);
+		free(sigs);
+		return -1;
+	}
+	posix_fadvise(fd,0,size,POSIX_FADV_SEQUENTIAL);
+
+	int ret = 0;
+	long long pos = 0;
+	while( pos < size )
+	{
+		int len = size - pos > read_size ? read_size : size - pos;
+		if( pread(fd,buf,len,pos) != len )
+		{
+			ret = -1;
+			break;
+		}
+
+		int count = 0;
+		int off;
+		for( off = 0; off < len; off += block_size )
+		{
+			int n = len - off > block_size ? block_size : len - off;
+			unsigned char *sig = sigs + count * DELTA_SIG_LEN;
+			uint32_t weak = htonl(delta_weak_sum(buf + off,n));
+			memcpy(sig,&weak,4);
+
+			checksum_ctx_t ctx;
+			checksum_init(&ctx,CKSUM_SHA256);
+			checksum_update(&ctx,buf + off,n);
+			checksum_digest(&ctx,sig + 4);
+			++count;
+		}
+		if( writen(out_fd,sigs,count * DELTA_SIG_LEN) != count * DELTA_SIG_LEN )
+		{
+			ret = -1;
+			break;
+		}
+
+		pos += len;
+		if( p_progress(arg,pos) != 0 )
+		{
+			ret = -1;
+			break;
+		}
+	}
+
+	free(buf);
+	free(sigs);
+	return ret;
+}
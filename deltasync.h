@@ -0,0 +1,54 @@
+#ifndef __DELTASYNC_H__
+#define __DELTASYNC_H__
+
+#include "common.h"
+#include <stdint.h>
+
+// 增量同步(SITE SIGS / SITE DELTA)，与rsync的算法相同：
+// 1. 客户端用SITE SIGS取得服务器上文件的块签名，每块36字节：
+//    4字节弱校验和(网络字节序) + 32字节SHA-256，最后一块可以不足块大小。
+//    弱校验和a = sum(x[i]) mod 2^16，b = sum((len-i)*x[i]) mod 2^16，值为a | b<<16，
+//    窗口滑动一个字节时 a' = a - x_out + x_in，b' = b - len*x_out + a'
+// 2. 客户端在本地文件上滚动计算弱校验和，与签名匹配的块用复制指令代替，
+//    用SITE DELTA上传指令流，服务器按指令从旧文件复制或者写入新数据生成新文件。
+//    指令(整数为网络字节序)：
+//      'C' <8字节旧文件位置> <8字节长度>  从旧文件复制
+//      'L' <4字节长度> <数据>            新数据
+//      'E'                               结束
+// 签名计算后保存在同目录的隐藏边车文件.<文件名>.sigs中，以mtime、大小和块大小作为键
+
+#define DELTA_MIN_BLOCK		512
+#define DELTA_MAX_BLOCK		(16*1024*1024)
+// 一块签名的字节数
+#define DELTA_SIG_LEN		36
+
+#define DELTA_OP_COPY		'C'
+#define DELTA_OP_LITERAL	'L'
+#define DELTA_OP_END		'E'
+
+// 计算签名时的进度回调，done为已经计算的字节数，返回非0取消计算
+typedef int (*delta_progress_t)(void *arg,long long done);
+
+/**
+ * delta_weak_sum - 计算一块数据的弱校验和(SSE2向量化)
+ * @buf - 数据
+ * @len - 长度
+ * return value - 弱校验和
+ */
+uint32_t delta_weak_sum(const unsigned char *buf,int len);
+
+/**
+ * delta_sig_open - 取得文件的块签名，边车文件有效时直接使用，否则重新计算并保存
+ * @fd - 文件
+ * @path - 文件路径，用于确定边车文件的位置
+ * @sbuf - 文件当前的状态
+ * @block_size - 块大小
+ * @p_progress - 计算时的进度回调
+ * @arg - 回调参数
+ * @p_off - 返回签名在边车文件中的开始位置
+ * return value - 边车文件的fd，失败或者被取消返回-1
+ */
+int delta_sig_open(int fd,const char *path,const struct stat *sbuf,int block_size,
+	delta_progress_t p_progress,void *arg,long long *p_off);
+
+#endif /* __DELTASYNC_H__ */
@@ -0,0 +1,389 @@
+#include "directio.h"
+
+static int set_direct(int fd,int enable);
+static int aio_setup(aio_context_t *p_ctx,int nr);
+static void aio_destroy(aio_context_t ctx);
+static int aio_submit(aio_context_t ctx,struct iocb **iocbs,int nr);
+static int aio_wait(aio_context_t ctx,struct io_event *events,int min_nr,int nr);
+static void reader_submit(direct_reader_t *dr);
+static int write_direct_batch(direct_writer_t *dw,struct iocb *iocbs,int nr);
+static int write_buffered(direct_writer_t *dw,long long pos,const char *buf,long long len);
+
+int directio_reader_begin(direct_reader_t *dr,int fd,long long offset,long long file_size)
+{
+	bzero(dr,sizeof(*dr));
+	if( aio_setup(&dr->ctx,DIRECT_QUEUE_DEPTH) == -1 )
+	{
+		return -1;
+	}
+	if( posix_memalign((void**)&dr->mem,DIRECT_ALIGN,DIRECT_BUF_SIZE * DIRECT_QUEUE_DEPTH) != 0 )
+	{
+		aio_destroy(dr->ctx);
+		return -1;
+	}
+	if( set_direct(fd,1) == -1 )
+	{
+		free(dr->mem);
+		aio_destroy(dr->ctx);
+		return -1;
+	}
+
+	dr->fd = fd;
+	dr->file_size = file_size;
+	dr->submit_pos = offset & ~((long long)DIRECT_ALIGN - 1);
+	dr->deliver_pos = offset;
+
+	// 一开始就提交满队列
+	while( dr->inflight < DIRECT_QUEUE_DEPTH && dr->submit_pos < dr->file_size )
+	{
+		reader_submit(dr);
+	}
+
+	return 0;
+}
+
+int directio_reader_next(direct_reader_t *dr,char **p_buf,int max_len)
+{
+	if( dr->deliver_pos >= dr->file_size )
+	{
+		return 0;
+	}
+
+	// 上次交付完的缓冲区调用者已经用完，补充新的请求
+	while( dr->inflight < DIRECT_QUEUE_DEPTH && dr->submit_pos < dr->file_size )
+	{
+		reader_submit(dr);
+	}
+	if( dr->inflight == 0 )
+	{
+		return -1;
+	}
+
+	// 等待head请求完成，期间完成的其他请求记录下来
+	struct io_event events[DIRECT_QUEUE_DEPTH];
+	while( dr->result[dr->head] == -1 )
+	{
+		int nr = aio_wait(dr->ctx,events,1,DIRECT_QUEUE_DEPTH);
+		if( nr == -1 )
+		{
+			return -1;
+		}
+		int i;
+		for( i = 0; i < nr; ++i )
+		{
+			long long res = events[i].res;
+			dr->result[events[i].data] = res < 0 ? -2 : res;
+		}
+	}
+	if( dr->result[dr->head] == -2 )
+	{
+		return -1;
+	}
+
+	struct iocb *cb = &dr->iocbs[dr->head];
+	if( dr->deliver_pos < (long long)cb->aio_offset )
+	{
+		// 前一个请求读到的数据不足(文件被截断)
+		return -1;
+	}
+	long long avail = cb->aio_offset + dr->result[dr->head] - dr->deliver_pos;
+	if( avail <= 0 )
+	{
+		// 文件被截断
+		return -1;
+	}
+
+	int len = avail > max_len ? max_len : avail;
+	*p_buf = (char*)(unsigned long)cb->aio_buf + (dr->deliver_pos - cb->aio_offset);
+	dr->deliver_pos += len;
+
+	// 这个请求的数据已经全部交付，调用者用完之后(下次调用时)缓冲区用于新的请求
+	if( len == avail )
+	{
+		--dr->inflight;
+		dr->head = (dr->head + 1) % DIRECT_QUEUE_DEPTH;
+	}
+
+	return len;
+}
+
+void directio_reader_end(direct_reader_t *dr)
+{
+	// 等待在途请求完成后才能释放缓冲区
+	struct io_event events[DIRECT_QUEUE_DEPTH];
+	int pending = 0;
+	int i;
+	for( i = 0; i < DIRECT_QUEUE_DEPTH; ++i )
+	{
+		if( dr->result[i] == -1 )
+		{
+			++pending;
+		}
+	}
+	while( pending > 0 )
+	{
+		int nr = aio_wait(dr->ctx,events,1,DIRECT_QUEUE_DEPTH);
+		if( nr == -1 )
+		{
+			break;
+		}
+		pending -= nr;
+	}
+
+	aio_destroy(dr->ctx);
+	free(dr->mem);
+	set_direct(dr->fd,0);
+}
+
+int directio_writer_begin(direct_writer_t *dw,int fd)
+{
+	bzero(dw,sizeof(*dw));
+	if( aio_setup(&dw->ctx,DIRECT_QUEUE_DEPTH) == -1 )
+	{
+		return -1;
+	}
+
+	// 先确认文件系统支持O_DIRECT，写入时再按需要切换
+	if( set_direct(fd,1) == -1 )
+	{
+		aio_destroy(dw->ctx);
+		return -1;
+	}
+	set_direct(fd,0);
+	dw->fd = fd;
+	dw->direct = 0;
+
+	return 0;
+}
+
+int directio_writev(direct_writer_t *dw,long long pos,const struct iovec *iov,int count)
+{
+	struct iocb iocbs[DIRECT_QUEUE_DEPTH];
+	int nr = 0;
+	int i;
+	for( i = 0; i < count; ++i )
+	{
+		const char *buf = (const char*)iov[i].iov_base;
+		long long len = iov[i].iov_len;
+		long long head = 0;
+		long long body = 0;
+		if( pos % DIRECT_ALIGN != 0 )
+		{
+			// 开头不对齐，整段普通写入，调用者保证这一段到对齐位置为止
+			head = len;
+		}
+		else
+		{
+			body = len & ~((long long)DIRECT_ALIGN - 1);
+		}
+
+		if( head > 0 || nr == DIRECT_QUEUE_DEPTH )
+		{
+			if( write_direct_batch(dw,iocbs,nr) == -1 )
+			{
+				return -1;
+			}
+			nr = 0;
+		}
+
+		if( head > 0 )
+		{
+			if( write_buffered(dw,pos,buf,head) == -1 )
+			{
+				return -1;
+			}
+			pos += head;
+			continue;
+		}
+
+		if( body > 0 )
+		{
+			struct iocb *cb = &iocbs[nr++];
+			bzero(cb,sizeof(*cb));
+			cb->aio_lio_opcode = IOCB_CMD_PWRITE;
+			cb->aio_fildes = dw->fd;
+			cb->aio_buf = (unsigned long)buf;
+			cb->aio_nbytes = body;
+			cb->aio_offset = pos;
+			pos += body;
+		}
+
+		// 结尾不足一块的部分，必须在前面的O_DIRECT写入完成之后普通写入
+		if( len > body )
+		{
+			if( write_direct_batch(dw,iocbs,nr) == -1 )
+			{
+				return -1;
+			}
+			nr = 0;
+			if( write_buffered(dw,pos,buf + body,len - body) == -1 )
+			{
+				return -1;
+			}
+			pos += len - body;
+		}
+	}
+
+	return write_direct_batch(dw,iocbs,nr);
+}
+
+void directio_writer_end(direct_writer_t *dw)
+{
+	aio_destroy(dw->ctx);
+	if( dw->direct )
+	{
+		set_direct(dw->fd,0);
+	}
+}
+
+static int set_direct(int fd,int enable)
+{
+	int flags = fcntl(fd,F_GETFL);
+	if( flags == -1 )
+	{
+		return -1;
+	}
+	flags = enable ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+
+	return fcntl(fd,F_SETFL,flags);
+}
+
+static int aio_setup(aio_context_t *p_ctx,int nr)
+{
+	*p_ctx = 0;
+	return syscall(__NR_io_setup,nr,p_ctx) == 0 ? 0 : -1;
+}
+
+static void aio_destroy(aio_context_t ctx)
+{
+	syscall(__NR_io_destroy,ctx);
+}
+
+static int aio_submit(aio_context_t ctx,struct iocb **iocbs,int nr)
+{
+	int ret;
+	do
+	{
+		ret = syscall(__NR_io_submit,ctx,nr,iocbs);
+	} while( ret == -1 && errno == EINTR );
+
+	return ret;
+}
+
+static int aio_wait(aio_context_t ctx,struct io_event *events,int min_nr,int nr)
+{
+	int ret;
+	do
+	{
+		ret = syscall(__NR_io_getevents,ctx,min_nr,nr,events,NULL);
+	} while( ret == -1 && errno == EINTR );
+
+	return ret;
+}
+
+static void reader_submit(direct_reader_t *dr)
+{
+	int slot = (dr->head + dr->inflight) % DIRECT_QUEUE_DEPTH;
+	struct iocb *cb = &dr->iocbs[slot];
+	bzero(cb,sizeof(*cb));
+	cb->aio_data = slot;
+	cb->aio_lio_opcode = IOCB_CMD_PREAD;
+	cb->aio_fildes = dr->fd;
+	cb->aio_buf = (unsigned long)(dr->mem + (long long)slot * DIRECT_BUF_SIZE);
+	cb->aio_nbytes = DIRECT_BUF_SIZE;
+	cb->aio_offset = dr->submit_pos;
+
+	struct iocb *p_cb = cb;
+	if( aio_submit(dr->ctx,&p_cb,1) != 1 )
+	{
+		dr->result[slot] = -2;
+	}
+	else
+	{
+		dr->result[slot] = -1;
+	}
+	dr->submit_pos += DIRECT_BUF_SIZE;
+	++dr->inflight;
+}
+
+static int write_direct_batch(direct_writer_t *dw,struct iocb *iocbs,int nr)
+{
+	if( nr == 0 )
+	{
+		return 0;
+	}
+	if( !dw->direct )
+	{
+		if( set_direct(dw->fd,1) == -1 )
+		{
+			return -1;
+		}
+		dw->direct = 1;
+	}
+
+	struct iocb *p_iocbs[DIRECT_QUEUE_DEPTH];
+	int i;
+	for( i = 0; i < nr; ++i )
+	{
+		p_iocbs[i] = &iocbs[i];
+	}
+	int submitted = aio_submit(dw->ctx,p_iocbs,nr);
+	if( submitted <= 0 )
+	{
+		return -1;
+	}
+
+	// 等待全部完成，短写视为失败
+	int ret = submitted == nr ? 0 : -1;
+	struct io_event events[DIRECT_QUEUE_DEPTH];
+	int done = 0;
+	while( done < submitted )
+	{
+		int n = aio_wait(dw->ctx,events,1,DIRECT_QUEUE_DEPTH);
+		if( n == -1 )
+		{
+			return -1;
+		}
+		for( i = 0; i < n; ++i )
+		{
+			struct iocb *cb = (struct iocb*)(unsigned long)events[i].obj;
+			if( events[i].res < 0 || (unsigned long long)events[i].res != cb->aio_nbytes )
+			{
+				ret = -1;
+			}
+		}
+		done += n;
+	}
+
+	return ret;
+}
+
+static int write_buffered(direct_writer_t *dw,long long pos,const char *buf,long long len)
+{
+	if( dw->direct )
+	{
+		if( set_direct(dw->fd,0) == -1 )
+		{
+			return -1;
+		}
+		dw->direct = 0;
+	}
+
+	while( len > 0 )
+	{
+		ssize_t ret = pwrite(dw->fd,buf,len,pos);
+		if( ret == -1 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			return -1;
+		}
+		buf += ret;
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
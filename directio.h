@@ -0,0 +1,96 @@
+#ifndef __DIRECTIO_H__
+#define __DIRECTIO_H__
+
+#include "common.h"
+#include <linux/aio_abi.h>
+#include <sys/uio.h>
+
+// 超过odirect_threshold的文件绕过页缓存(O_DIRECT)传输，
+// 使用内核异步IO(io_submit)同时提交多个对齐的读写请求。
+// O_DIRECT要求文件位置、长度和内存地址都按块对齐：
+// 下载从向下对齐的位置开始读取，跳过开头多出的部分；
+// 上传时不对齐的开头和结尾用普通写入完成
+
+// 对齐粒度，不小于常见设备的逻辑块大小
+#define DIRECT_ALIGN		4096
+// 下载时每个请求的大小
+#define DIRECT_BUF_SIZE		(1024*1024)
+// 同时在途的请求数
+#define DIRECT_QUEUE_DEPTH	4
+
+typedef struct direct_reader
+{
+	aio_context_t ctx;
+	int fd;
+	char *mem;
+	long long file_size;
+	// 下一个请求的文件位置(已对齐)
+	long long submit_pos;
+	// 下一个交给调用者的字节的文件位置
+	long long deliver_pos;
+	// 按提交顺序交付，head是下一个要交付的请求
+	int head;
+	int inflight;
+	struct iocb iocbs[DIRECT_QUEUE_DEPTH];
+	// 请求的结果，-1表示尚未完成
+	long long result[DIRECT_QUEUE_DEPTH];
+} direct_reader_t;
+
+typedef struct direct_writer
+{
+	aio_context_t ctx;
+	int fd;
+	// fd当前是否处于O_DIRECT模式
+	int direct;
+} direct_writer_t;
+
+/**
+ * directio_reader_begin - 以O_DIRECT方式从offset开始读取文件
+ * @dr - 读取状态
+ * @fd - 文件，成功时被切换为O_DIRECT模式
+ * @offset - 开始位置，可以不对齐
+ * @file_size - 读到该位置为止(文件大小，或者RANG范围的结束位置)
+ * return value - 成功返回0，文件系统不支持或者失败返回-1，调用者继续使用普通方式
+ */
+int directio_reader_begin(direct_reader_t *dr,int fd,long long offset,long long file_size);
+
+/**
+ * directio_reader_next - 取得后续的数据，同时保持DIRECT_QUEUE_DEPTH个请求在途
+ * @dr - 读取状态
+ * @p_buf - 返回数据地址，在下次调用之前有效
+ * @max_len - 最多返回的字节数
+ * return value - 返回的字节数，文件结束返回0，失败返回-1
+ */
+int directio_reader_next(direct_reader_t *dr,char **p_buf,int max_len);
+
+/**
+ * directio_reader_end - 等待在途请求完成，释放缓冲区，恢复fd的普通模式
+ * @dr - 读取状态
+ */
+void directio_reader_end(direct_reader_t *dr);
+
+/**
+ * directio_writer_begin - 准备以O_DIRECT方式写入fd
+ * @dw - 写入状态
+ * @fd - 文件
+ * return value - 成功返回0，文件系统不支持或者失败返回-1
+ */
+int directio_writer_begin(direct_writer_t *dw,int fd);
+
+/**
+ * directio_writev - 从pos开始依次写入iov，已对齐的部分以O_DIRECT方式批量提交
+ * @dw - 写入状态
+ * @pos - 文件位置
+ * @iov - 数据，每一段的地址必须按DIRECT_ALIGN对齐
+ * @count - 段数
+ * return value - 成功返回0，失败返回-1
+ */
+int directio_writev(direct_writer_t *dw,long long pos,const struct iovec *iov,int count);
+
+/**
+ * directio_writer_end - 释放异步IO上下文，恢复fd的普通模式
+ * @dw - 写入状态
+ */
+void directio_writer_end(direct_writer_t *dw);
+
+#endif /* __DIRECTIO_H__ */
@@ -0,0 +1,276 @@
+#include "durability.h"
+#include "common.h"
+#include "sysutil.h"
+#include "tunable.h"
+
+#define DURABILITY_NONE		0
+#define DURABILITY_FDATASYNC	1
+#define DURABILITY_GROUP	2
+
+// 一次组提交最多合并的请求数
+#define GROUP_COMMIT_MAX	64
+
+typedef struct flush_req
+{
+	int fd;
+	int reply_fd;
+	char result;
+} flush_req_t;
+
+static int s_mode = DURABILITY_NONE;
+// 会话向刷盘进程发送请求的套接字
+static int s_flush_fd = -1;
+
+static void flusher_loop(int sock_fd);
+static int flusher_recv(int sock_fd,flush_req_t *req,const struct timespec *deadline);
+static void flusher_commit(flush_req_t *reqs,int count);
+static void *flusher_sync(void *arg);
+
+void durability_init()
+{
+	if( tunable_upload_durability == NULL || strcmp(tunable_upload_durability,"none") == 0 )
+	{
+		s_mode = DURABILITY_NONE;
+		return;
+	}
+	else if( strcmp(tunable_upload_durability,"fdatasync") == 0 )
+	{
+		s_mode = DURABILITY_FDATASYNC;
+		return;
+	}
+	else if( strcmp(tunable_upload_durability,"group") != 0 )
+	{
+		fprintf(stderr, "bad upload_durability in config file: %s\n", tunable_upload_durability);
+		exit(EXIT_FAILURE);
+	}
+	s_mode = DURABILITY_GROUP;
+
+	// 使用数据报套接字，多个会话并发发送的请求不会交错
+	int sockfds[2];
+	if( socketpair(AF_LOCAL,SOCK_DGRAM,0,sockfds) < 0 )
+	{
+		ERR_EXIT("socketpair");
+	}
+
+	pid_t pid = fork();
+	switch(pid)
+	{
+		case -1:
+			ERR_EXIT("fork flusher");
+			break;
+		case 0:
+			close(sockfds[1]);
+			flusher_loop(sockfds[0]);
+			exit(EXIT_SUCCESS);
+			break;
+		default:
+			close(sockfds[0]);
+			s_flush_fd = sockfds[1];
+			break;
+	}
+}
+
+int durability_sync(int fd)
+{
+	if( s_mode == DURABILITY_NONE )
+	{
+		return 0;
+	}
+	else if( s_mode == DURABILITY_FDATASYNC )
+	{
+		return fdatasync(fd);
+	}
+
+	// 每个请求带一个应答通道，刷盘完成后刷盘进程写回一个字节的结果
+	int replyfds[2];
+	if( socketpair(AF_LOCAL,SOCK_STREAM,0,replyfds) < 0 )
+	{
+		return fdatasync(fd);
+	}
+
+	int fds[2] = { fd, replyfds[1] };
+	if( send_fds(s_flush_fd,fds,2) == -1 )
+	{
+		close(replyfds[0]);
+		close(replyfds[1]);
+		return fdatasync(fd);
+	}
+	close(replyfds[1]);
+
+	char result;
+	int ret = readn(replyfds[0],&result,sizeof(result));
+	close(replyfds[0]);
+	if( ret != sizeof(result) )
+	{
+		// 刷盘进程异常，退回到自己刷盘
+		return fdatasync(fd);
+	}
+
+	return result == 0 ? 0 : -1;
+}
+
+int durability_sync_dir(const char *path)
+{
+	if( s_mode == DURABILITY_NONE )
+	{
+		return 0;
+	}
+
+	char dir[MAX_LINE] = {0};
+	const char *base = strrchr(path,'/');
+	if( base == NULL )
+	{
+		strcpy(dir,".");
+	}
+	else if( base == path )
+	{
+		strcpy(dir,"/");
+	}
+	else
+	{
+		snprintf(dir,sizeof(dir),"%.*s",(int)(base - path),path);
+	}
+
+	int fd = open(dir,O_RDONLY | O_DIRECTORY);
+	if( fd == -1 )
+	{
+		return -1;
+	}
+	int ret = durability_sync(fd);
+	close(fd);
+	return ret;
+}
+
+static void flusher_loop(int sock_fd)
+{
+	// 主进程退出时刷盘进程随之退出
+	prctl(PR_SET_PDEATHSIG,SIGTERM);
+	signal(SIGCHLD,SIG_DFL);
+
+	struct passwd *pw = getpwnam("nobody");
+	if( pw != NULL )
+	{
+		setegid(pw->pw_gid);
+		seteuid(pw->pw_uid);
+	}
+
+	flush_req_t reqs[GROUP_COMMIT_MAX];
+	while(1)
+	{
+		// 阻塞等待第一个请求，然后从它到达起的group_commit_usec内继续收集，
+		// 后续请求不会延长第一个请求的等待
+		int count = 0;
+		if( flusher_recv(sock_fd,&reqs[count],NULL) == 0 )
+		{
+			++count;
+		}
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC,&deadline);
+		deadline.tv_sec += tunable_group_commit_usec / 1000000;
+		deadline.tv_nsec += (long)(tunable_group_commit_usec % 1000000) * 1000;
+		if( deadline.tv_nsec >= 1000000000 )
+		{
+			++deadline.tv_sec;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while( count > 0 && count < GROUP_COMMIT_MAX &&
+			flusher_recv(sock_fd,&reqs[count],&deadline) == 0 )
+		{
+			++count;
+		}
+
+		if( count > 0 )
+		{
+			flusher_commit(reqs,count);
+		}
+	}
+}
+
+// deadline为NULL时阻塞等待，否则最多等到deadline(CLOCK_MONOTONIC)
+static int flusher_recv(int sock_fd,flush_req_t *req,const struct timespec *deadline)
+{
+	if( deadline != NULL )
+	{
+		struct pollfd pfd;
+		pfd.fd = sock_fd;
+		pfd.events = POLLIN;
+		int ret;
+		do
+		{
+			struct timespec now;
+			struct timespec left = {0,0};
+			clock_gettime(CLOCK_MONOTONIC,&now);
+			long long nsec = (long long)(deadline->tv_sec - now.tv_sec) * 1000000000LL +
+				(deadline->tv_nsec - now.tv_nsec);
+			if( nsec > 0 )
+			{
+				left.tv_sec = nsec / 1000000000LL;
+				left.tv_nsec = nsec % 1000000000LL;
+			}
+			ret = ppoll(&pfd,1,&left,NULL);
+		} while( ret < 0 && errno == EINTR );
+		if( ret <= 0 )
+		{
+			return -1;
+		}
+	}
+
+	int fds[2];
+	int received = recv_fds(sock_fd,fds,2);
+	if( received != 2 )
+	{
+		// 只收到一部分描述符时关闭，避免泄漏
+		int i;
+		for( i = 0; i < received; ++i )
+		{
+			close(fds[i]);
+		}
+		return -1;
+	}
+
+	req->fd = fds[0];
+	req->reply_fd = fds[1];
+	req->result = -1;
+
+	return 0;
+}
+
+static void flusher_commit(flush_req_t *reqs,int count)
+{
+	// 每个文件各自fdatasync：只等待本批文件自己的数据，不受同一文件系统上其他
+	// 大量写入的影响，回写错误也能可靠地报告(syncfs在5.8之前的内核上不返回)。
+	// 多个文件并行刷盘，文件系统可以把它们合并到同一次日志提交
+	pthread_t tids[GROUP_COMMIT_MAX];
+	int started[GROUP_COMMIT_MAX];
+	int i;
+	for( i = 1; i < count; ++i )
+	{
+		started[i] = pthread_create(&tids[i],NULL,flusher_sync,&reqs[i]) == 0;
+		if( !started[i] )
+		{
+			flusher_sync(&reqs[i]);
+		}
+	}
+	flusher_sync(&reqs[0]);
+	for( i = 1; i < count; ++i )
+	{
+		if( started[i] )
+		{
+			pthread_join(tids[i],NULL);
+		}
+	}
+
+	for( i = 0; i < count; ++i )
+	{
+		writen(reqs[i].reply_fd,&reqs[i].result,sizeof(reqs[i].result));
+		close(reqs[i].reply_fd);
+		close(reqs[i].fd);
+	}
+}
+
+static void *flusher_sync(void *arg)
+{
+	flush_req_t *req = (flush_req_t*)arg;
+	req->result = fdatasync(req->fd) == 0 ? 0 : 1;
+	return NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef __DURABILITY_H__
+#define __DURABILITY_H__
+
+// 上传的持久化策略(upload_durability)
+// none      - 不主动刷盘，226之后掉电可能丢数据
+// fdatasync - 每个文件上传完成后fdatasync，然后才回复226
+// group     - 组提交：会话把文件fd交给刷盘进程，刷盘进程把一段时间内
+//             收到的请求合并处理(并行fdatasync，由文件系统合并日志提交)，
+//             完成后通知各会话回复226
+
+/**
+ * durability_init - 检查配置，组提交模式下创建刷盘进程，必须在fork会话进程之前调用
+ */
+void durability_init();
+
+/**
+ * durability_sync - 按配置的策略把fd的数据写到磁盘
+ * @fd - 上传的文件
+ * return value - 成功返回0，失败返回-1
+ */
+int durability_sync(int fd);
+
+/**
+ * durability_sync_dir - 按配置的策略把path所在目录的目录项写到磁盘，
+ *                       用于新建文件或rename替换文件之后
+ * @path - 文件路径
+ * return value - 成功返回0，失败返回-1
+ */
+int durability_sync_dir(const char *path);
+
+#endif /* __DURABILITY_H__ */
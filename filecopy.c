@@ -0,0 +1,64 @@
+#include "filecopy.h"
+#include <linux/fs.h>
+
+#ifndef FICLONE
+#define FICLONE		_IOW(0x94, 9, int)
+#endif
+#ifndef FICLONERANGE
+struct file_clone_range
+{
+	__s64 src_fd;
+	__u64 src_offset;
+	__u64 src_length;
+	__u64 dest_offset;
+};
+#define FICLONERANGE	_IOW(0x94, 13, struct file_clone_range)
+#endif
+
+int file_clone(int src_fd,int dst_fd)
+{
+	return ioctl(dst_fd,FICLONE,src_fd);
+}
+
+int file_clone_range(int src_fd,long long src_off,long long len,int dst_fd,long long dst_off)
+{
+	struct file_clone_range range;
+	range.src_fd = src_fd;
+	range.src_offset = src_off;
+	range.src_length = len;
+	range.dest_offset = dst_off;
+	return ioctl(dst_fd,FICLONERANGE,&range);
+}
+
+long long file_copy_chunk(int src_fd,long long *src_off,int dst_fd,long long *dst_off,long long len)
+{
+	loff_t in_off = *src_off;
+	loff_t out_off = *dst_off;
+	ssize_t ret;
+	do
+	{
+		ret = copy_file_range(src_fd,&in_off,dst_fd,&out_off,len,0);
+	} while( ret == -1 && errno == EINTR );
+
+	// 跨文件系统(旧内核)、内核不支持或者文件系统不支持时，
+	// 用sendfile在页缓存之间复制，仍然不经过用户空间
+	if( ret == -1 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL) )
+	{
+		if( lseek(dst_fd,*dst_off,SEEK_SET) == -1 )
+		{
+			return -1;
+		}
+		off_t off = *src_off;
+		do
+		{
+			ret = sendfile(dst_fd,src_fd,&off,len);
+		} while( ret == -1 && errno == EINTR );
+	}
+
+	if( ret > 0 )
+	{
+		*src_off += ret;
+		*dst_off += ret;
+	}
+	return ret;
+}
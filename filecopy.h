@@ -0,0 +1,46 @@
+#ifndef __FILECOPY_H__
+#define __FILECOPY_H__
+
+#include "common.h"
+
+// 服务器端文件复制(SITE CPFR/CPTO)和拼接(SITE CONCAT)，数据不经过用户空间：
+// 文件系统支持时(XFS、btrfs等)用FICLONE共享数据块，瞬间完成；
+// 否则用copy_file_range在内核中复制(NFS/CIFS可以交给服务器端完成)，
+// 跨文件系统等copy_file_range不支持的情况再退回到文件之间的sendfile
+
+// copy_file_range每次复制的最大字节数，每块之间检查控制连接
+#define FILE_COPY_CHUNK		(64*1024*1024)
+// SITE CONCAT最多拼接的文件数
+#define CONCAT_MAX_PARTS	64
+
+/**
+ * file_clone - 让dst_fd共享src_fd的全部数据块(reflink)
+ * @src_fd - 源文件
+ * @dst_fd - 目标文件，必须以写方式打开并与源文件在同一文件系统
+ * return value - 成功返回0，文件系统不支持返回-1
+ */
+int file_clone(int src_fd,int dst_fd);
+
+/**
+ * file_clone_range - 让dst_fd的[dst_off,dst_off+len)共享src_fd的[src_off,src_off+len)
+ * @src_fd - 源文件
+ * @src_off - 源文件位置
+ * @len - 长度，不是块大小的整数倍时范围必须到源文件末尾
+ * @dst_fd - 目标文件
+ * @dst_off - 目标文件位置，必须按文件系统块大小对齐
+ * return value - 成功返回0，不支持或者没有对齐返回-1
+ */
+int file_clone_range(int src_fd,long long src_off,long long len,int dst_fd,long long dst_off);
+
+/**
+ * file_copy_chunk - 在内核中复制最多len字节
+ * @src_fd - 源文件
+ * @src_off - 源文件位置，返回时增加已复制的字节数
+ * @dst_fd - 目标文件
+ * @dst_off - 目标文件位置，返回时增加已复制的字节数
+ * @len - 最多复制的字节数
+ * return value - 复制的字节数，源文件结束返回0，失败返回-1
+ */
+long long file_copy_chunk(int src_fd,long long *src_off,int dst_fd,long long *dst_off,long long len);
+
+#endif /* __FILECOPY_H__ */
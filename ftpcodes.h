@@ -1,6 +1,7 @@
 #ifndef __FTPCODES_H__
 #define __FTPCODES_H__
 
+#define FTP_MARK              	110
 #define FTP_DATACONN          	150
 
 #define FTP_NOOPOK            	200
@@ -20,6 +21,7 @@
 #define FTP_STATOK          	211
 #define FTP_SIZEOK            	213
 #define FTP_MDTMOK            	213
+#define FTP_HASHOK            	213
 #define FTP_STATFILE_OK       	213
 #define FTP_SITEHELP          	214
 #define FTP_HELP              	214
@@ -34,6 +36,8 @@
 #define FTP_LOGINOK           	230
 #define FTP_AUTHOK            	234
 #define FTP_CWDOK             	250
+#define FTP_TRANSFERDONE      	250
+#define FTP_XHASHOK           	250
 #define FTP_RMDIROK           	250
 #define FTP_DELEOK            	250
 #define FTP_RENAMEOK          	250
@@ -52,13 +56,16 @@
 #define FTP_TLS_FAIL          	421
 #define FTP_BADSENDCONN    425
 #define FTP_BADSENDNET        	426
+#define FTP_FILEBUSY          	450
 #define FTP_BADSENDFILE       	451
+#define FTP_NOSPACE           	452
 
 #define FTP_BADCMD            	500
 #define FTP_BADOPTS           	501
 #define FTP_COMMANDNOTIMPL    502
 #define FTP_NEEDUSER          	503
 #define FTP_NEEDRNFR          	503
+#define FTP_OPBUSY            	503
 #define FTP_BADPBSZ           	503
 #define FTP_BADPROT           	503
 #define FTP_BADSTRU           	504
@@ -73,5 +80,6 @@
 #define FTP_FILEFAIL          	550
 #define FTP_NOPERM            	550
 #define FTP_UPLOADFAIL        	553
+#define FTP_BADRESTART        	554
 
 #endif /* __FTPCODES_H__ */
\ No newline at end of file
@@ -5,6 +5,19 @@
 #include "ftpcodes.h"
 #include "tunable.h"
 #include "privsock.h"
+#include "ratelimit.h"
+#include "bwclass.h"
+#include "cachepolicy.h"
+#include "prefetch.h"
+#include "durability.h"
+#include "uploadpipe.h"
+#include "directio.h"
+#include "checksum.h"
+#include "treehash.h"
+#include "filecopy.h"
+#include "blockmode.h"
+#include "tarstream.h"
+#include "deltasync.h"
 
 // declare in main.c
 session_t *p_sess;
@@ -19,7 +32,10 @@ static void do_quit(session_t *sess);
 // 传输参数命令
 static void do_port(session_t *sess);
 static void do_pasv(session_t *sess);
+static void do_eprt(session_t *sess);
+static void do_epsv(session_t *sess);
 static void do_type(session_t *sess);
+static void do_mode(session_t *sess);
 
 // 服务命令
 static void do_retr(session_t *sess);
@@ -42,6 +58,15 @@ static void do_size(session_t *sess);
 static void do_stat(session_t *sess);
 static void do_noop(session_t *sess);
 static void do_help(session_t *sess);
+static void do_allo(session_t *sess);
+static void do_mdtm(session_t *sess);
+static void do_opts(session_t *sess);
+static void do_hash(session_t *sess);
+static void do_rang(session_t *sess);
+static void do_xcrc(session_t *sess);
+static void do_xmd5(session_t *sess);
+static void do_xsha1(session_t *sess);
+static void do_xsha256(session_t *sess);
 
 static ftpcmd_t ctrl_cmds_map[] =
 {
@@ -60,9 +85,11 @@ static ftpcmd_t ctrl_cmds_map[] =
 	// 传输参数命令
 	{ "PORT",	do_port },
 	{ "PASV",	do_pasv },
+	{ "EPRT",	do_eprt },
+	{ "EPSV",	do_epsv },
 	{ "TYPE",	do_type },
 	{ "STRU",	NULL },
-	{ "MODE",	NULL },
+	{ "MODE",	do_mode },
 
 	// 服务命令
 	{ "RETR",	do_retr },
@@ -86,23 +113,71 @@ static ftpcmd_t ctrl_cmds_map[] =
 	{ "SYST",	do_syst },
 	{ "FEAT",	do_feat },
 	{ "SIZE",	do_size },
+	{ "MDTM",	do_mdtm },
 	{ "STAT",	do_stat },
 	{ "NOOP",	do_noop },
 	{ "HELP",	do_help },
 	{ "STOU",	NULL },
-	{ "ALLO",	NULL }
+	{ "ALLO",	do_allo },
+	{ "OPTS",	do_opts },
+	{ "HASH",	do_hash },
+	{ "RANG",	do_rang },
+	{ "XCRC",	do_xcrc },
+	{ "XMD5",	do_xmd5 },
+	{ "XSHA1",	do_xsha1 },
+	{ "XSHA256",	do_xsha256 }
 };
 
 int    get_transfer_fd(session_t *sess);
+void   discard_transfer_fd(session_t *sess);
 int    port_active(session_t *sess);
 int    pasv_active(session_t *sess);
 int    get_port_fd(session_t *sess);
+int    reject_after_epsv_all(session_t *sess);
+unsigned short pasv_listen(session_t *sess);
+int    connect_port_fd(session_t *sess);
+int    port_addr_allowed(session_t *sess,const struct sockaddr_storage *addr);
 int    get_pasv_fd(session_t *sess);
-int    lock_file_read(int fd);
-int    lock_file_write(int fd);
-int   lock_internal(int fd,int lock_type);
+void   close_data_fd(session_t *sess,int keep);
+int    send_data(session_t *sess,const char *buf,int len);
+int    send_file_data(session_t *sess,int fd,long long len);
+int    retr_archive(session_t *sess,long long offset);
+void   get_partial_name(const char *path,char *part_name,unsigned int len);
+void   get_private_name(const char *path,char *tmp_name,unsigned int len);
+int    open_private_file(const char *path,char *tmp_name,unsigned int len,int *is_tmpfile);
+int    claim_partial_file(const char *path,const char *part_name,char *tmp_name,unsigned int len,long long offset);
+int    publish_private_file(int fd,int is_tmpfile,const char *tmp_name,const char *dest);
+void   abandon_private_file(int fd,int is_tmpfile,const char *tmp_name,const char *part_name,int keep);
+void   remove_created_file(int fd,const char *path);
+int    lock_file_read(int fd,long long start,long long len);
+int    lock_file_write(int fd,long long start,long long len);
+int   lock_internal(int fd,int lock_type,long long start,long long len);
+int   lock_file_trywrite(int fd,long long start,long long len);
+int   lock_busy(int ret);
 int   unlock_file(int fd);
 
+// 上传时写盘一侧的状态，流水线模式下由写盘线程访问
+typedef struct upload_sink_ctx
+{
+	int fd;
+	long long write_pos;
+	long long lock_end;
+	cache_cursor_t *p_cc;
+	// 上传的同时计算摘要，不计算为NULL
+	checksum_ctx_t *p_hash;
+	// 是否可以使用O_DIRECT，以及预计的结束位置(未知为0)
+	int direct;
+	long long expected_end;
+	direct_writer_t dw;
+} upload_sink_ctx_t;
+
+int   upload_sink(void *arg,const struct iovec *iov,int count);
+int   hash_common(session_t *sess,const char *path,int algo,long long *p_start,long long *p_end,char *hex);
+void  xhash_common(session_t *sess,int algo);
+void  parse_xhash_arg(const char *arg,char *path,long long *p_start,long long *p_end);
+int   transfer_hash_algo();
+void  get_transfer_ok_text(int algo,const char *hex,char *text,unsigned int len);
+
 void limit_rate(session_t *sess,int bytes_transfered,int is_upload);
 void start_cmdio_alarm();
 void start_data_alarm();
@@ -115,6 +190,17 @@ void check_abor(session_t *sess);
 
 void do_site_chmod(session_t *sess,char *chmod_arg);
 void do_site_umask(session_t *sess,char *umask_arg);
+void do_site_treehash(session_t *sess,char *path);
+void do_site_cpfr(session_t *sess,char *path);
+void do_site_cpto(session_t *sess,char *path);
+void do_site_concat(session_t *sess,char *arg);
+int   copy_file_data(session_t *sess,int src_fd,int dst_fd,long long dst_off,long long len);
+void do_site_sigs(session_t *sess,char *arg);
+void do_site_delta(session_t *sess,char *path);
+int   sigs_progress(void *arg,long long done);
+int   recv_full(session_t *sess,block_reader_t *br,void *buf,int len);
+
+int   poll_ctrl(session_t *sess,int timeout_ms);
 
 void handle_child(session_t *sess)
 {
@@ -221,6 +307,9 @@ static void do_pass(session_t *sess)
 
 	umask(tunable_local_umask);
 
+	ratelimit_attach_user(sess,pw->pw_uid);
+	bwclass_classify(sess,pw);
+
 	chdir(pw->pw_dir);
 	ftp_relply(sess,FTP_LOGINOK,"Login successful.");
 }
@@ -258,31 +347,61 @@ void do_quit(session_t *sess)
 
 void do_port(session_t *sess)
 {
-	unsigned int v[6];
+	if( reject_after_epsv_all(sess) )
+	{
+		return;
+	}
+	// PORT只能表示IPv4地址
+	if( sess->ipv6 )
+	{
+		ftp_relply(sess,FTP_BADSENDCONN,"Use EPRT for IPv6 connections.");
+		return;
+	}
+
+	unsigned int v[6] = {0};
 
 	sscanf(sess->cmd_arg, "%u,%u,%u,%u,%u,%u", &v[2], &v[3], &v[4], &v[5], &v[0], &v[1]);
-	sess->port_addr = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in));
-	memset(sess->port_addr, 0, sizeof(struct sockaddr_in));
-	sess->port_addr->sin_family = AF_INET;
-	unsigned char *p = (unsigned char *)&sess->port_addr->sin_port;
+	struct sockaddr_storage addr;
+	memset(&addr, 0, sizeof(addr));
+	struct sockaddr_in *sa_in = (struct sockaddr_in *)&addr;
+	sa_in->sin_family = AF_INET;
+	unsigned char *p = (unsigned char *)&sa_in->sin_port;
 	p[0] = v[0];
 	p[1] = v[1];
 
-	p = (unsigned char *)&sess->port_addr->sin_addr;
+	p = (unsigned char *)&sa_in->sin_addr;
 	p[0] = v[2];
 	p[1] = v[3];
 	p[2] = v[4];
 	p[3] = v[5];
 
+	if( !port_addr_allowed(sess,&addr) )
+	{
+		ftp_relply(sess,FTP_BADCMD,"Illegal PORT command.");
+		return;
+	}
+
+	// 替换之前的PORT地址或者还没有使用的PASV监听套接字
+	discard_transfer_fd(sess);
+	sess->port_addr = (struct sockaddr_storage *)malloc(sizeof(struct sockaddr_storage));
+	memcpy(sess->port_addr, &addr, sizeof(addr));
+
 	ftp_relply(sess, FTP_PORTOK, "PORT command successful. Consider using PASV.");
 }
 
 void do_pasv(session_t *sess)
 {
-	char local_ip[16] = {0};
-	getlocalip(local_ip);
-	
-	
+	if( reject_after_epsv_all(sess) )
+	{
+		return;
+	}
+	// 227回复只能表示IPv4地址
+	if( sess->ipv6 )
+	{
+		ftp_relply(sess,FTP_BADSENDCONN,"Use EPSV for IPv6 connections.");
+		return;
+	}
+
 	// change to nobody process
 	/*
 	sess->pasv_listen_fd = tcp_server(local_ip,0);
@@ -296,11 +415,15 @@ void do_pasv(session_t *sess)
 	unsigned short port = ntohs(sa_in.sin_port);
 	*/
 
-	priv_sock_send_cmd(sess->child_fd,PRIV_SOCK_PASV_LISTEN);
-	unsigned short port = (int)priv_sock_get_int(sess->child_fd);
+	unsigned short port = pasv_listen(sess);
+	if( port == 0 )
+	{
+		ftp_relply(sess,FTP_BADSENDCONN,"No passive port available, try again later.");
+		return;
+	}
 
-	unsigned int v[4];
-	sscanf(local_ip,"%u.%u.%u.%u",&v[0],&v[1],&v[2],&v[3]);
+	unsigned int v[4] = {0};
+	sscanf(sess->pasv_ip,"%u.%u.%u.%u",&v[0],&v[1],&v[2],&v[3]);
 	char text[MAX_LINE] = {0};
 	sprintf(text,"Entering Passive Mode (%u,%u,%u,%u,%u,%u).",v[0],v[1],v[2],v[3],(port >> 8),(port & 0xFF));
 
@@ -308,6 +431,91 @@ void do_pasv(session_t *sess)
 
 }
 
+// EPRT |af|addr|port|，分隔符为参数的第一个字符，af为1(IPv4)或者2(IPv6)，
+// 必须与控制连接的地址族相同
+void do_eprt(session_t *sess)
+{
+	if( reject_after_epsv_all(sess) )
+	{
+		return;
+	}
+
+	char delim = sess->cmd_arg[0];
+	char field[3][MAX_ARG] = {{0}};
+	const char *p = sess->cmd_arg + 1;
+	int i;
+	for( i = 0; i < 3 && delim >= 33 && delim <= 126; ++i )
+	{
+		const char *end = strchr(p,delim);
+		if( end == NULL || end - p >= MAX_ARG )
+		{
+			break;
+		}
+		memcpy(field[i],p,end - p);
+		p = end + 1;
+	}
+	unsigned int port = 0;
+	if( i != 3 || sscanf(field[2],"%u",&port) != 1 || port == 0 || port > 65535 )
+	{
+		ftp_relply(sess,FTP_BADOPTS,"Bad EPRT command.");
+		return;
+	}
+	if( strcmp(field[0],sess->ipv6 ? "2" : "1") != 0 )
+	{
+		ftp_relply(sess,FTP_EPSVBAD,sess->ipv6 ? "Network protocol not supported, use (2)" :
+			"Network protocol not supported, use (1)");
+		return;
+	}
+
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	if( sockaddr_from_ip(field[1],port,&addr,&addr_len) == -1 || sockaddr_is_v6(&addr) != sess->ipv6 )
+	{
+		ftp_relply(sess,FTP_BADOPTS,"Bad EPRT address.");
+		return;
+	}
+	if( !port_addr_allowed(sess,&addr) )
+	{
+		ftp_relply(sess,FTP_BADCMD,"Illegal EPRT command.");
+		return;
+	}
+
+	discard_transfer_fd(sess);
+	sess->port_addr = (struct sockaddr_storage *)malloc(sizeof(struct sockaddr_storage));
+	memcpy(sess->port_addr,&addr,sizeof(addr));
+
+	ftp_relply(sess,FTP_EPRTOK,"EPRT command successful. Consider using EPSV.");
+}
+
+// EPSV的回复不包含地址，客户端连接控制连接的服务器地址，IPv4和IPv6都适用
+void do_epsv(session_t *sess)
+{
+	str_upper(sess->cmd_arg);
+	if( strcmp(sess->cmd_arg,"ALL") == 0 )
+	{
+		sess->epsv_all = 1;
+		ftp_relply(sess,FTP_EPSVALLOK,"EPSV ALL ok.");
+		return;
+	}
+	if( sess->cmd_arg[0] != '\0' && strcmp(sess->cmd_arg,sess->ipv6 ? "2" : "1") != 0 )
+	{
+		ftp_relply(sess,FTP_EPSVBAD,sess->ipv6 ? "Network protocol not supported, use (2)" :
+			"Network protocol not supported, use (1)");
+		return;
+	}
+
+	unsigned short port = pasv_listen(sess);
+	if( port == 0 )
+	{
+		ftp_relply(sess,FTP_BADSENDCONN,"No passive port available, try again later.");
+		return;
+	}
+
+	char text[MAX_LINE] = {0};
+	sprintf(text,"Entering Extended Passive Mode (|||%u|)",port);
+	ftp_relply(sess,FTP_EPSVOK,text);
+}
+
 void do_type(session_t *sess)
 {
 	// switch to ascii mode
@@ -327,41 +535,99 @@ void do_type(session_t *sess)
 	}
 }
 
-void do_retr(session_t *sess)
+// MODE S/B，块模式下数据连接在传输之间保持打开
+void do_mode(session_t *sess)
 {
-	if( get_transfer_fd(sess) == 0 )
+	if( strcasecmp(sess->cmd_arg,"S") == 0 )
 	{
-		return;
+		sess->block_mode = 0;
+		if( sess->block_fd != -1 )
+		{
+			close(sess->block_fd);
+			sess->block_fd = -1;
+		}
+		ftp_relply(sess,FTP_MODEOK,"Mode set to S.");
+	}
+	else if( strcasecmp(sess->cmd_arg,"B") == 0 )
+	{
+		sess->block_mode = 1;
+		ftp_relply(sess,FTP_MODEOK,"Mode set to B.");
+	}
+	else
+	{
+		ftp_relply(sess,FTP_BADMODE,"Bad MODE command.");
 	}
+}
 
+void do_retr(session_t *sess)
+{
+	// 先打开文件再建立数据连接：路径错误不需要浪费一个数据连接，
+	// 第一个窗口的磁盘读取与privsock往返、accept/connect并行进行
 	long long offset = sess->restart_pos;
 	sess->restart_pos = 0;
+	// RANG指定的范围只发送[rang_start,rang_end]，客户端可以用多个数据连接并行分段下载
+	long long end = -1;
+	if( sess->rang_set )
+	{
+		offset = sess->rang_start;
+		end = sess->rang_end + 1;
+		sess->rang_set = 0;
+	}
 
-	int fd = open(sess->cmd_arg,O_RDONLY);
+	// SIZE/MDTM时可能已经打开并预读了该文件
+	int fd = prefetch_take(sess,sess->cmd_arg);
+	int prefetched = fd != -1;
+	if( fd == -1 )
+	{
+		fd = open(sess->cmd_arg,O_RDONLY);
+	}
 	if( fd == -1 )
 	{
+		if( retr_archive(sess,offset) )
+		{
+			return;
+		}
+		discard_transfer_fd(sess);
 		ftp_relply(sess,FTP_FILEFAIL,"Open file failed.");
 		return;
 	}
 
-	// add read lock
+	// 判断是否为普通文件
 	int ret;
-	ret = lock_file_read(fd);
+	struct stat sbuf;
+	ret = fstat(fd,&sbuf);
 
-	if( ret == -1 )
+	if( ret == -1 || !S_ISREG(sbuf.st_mode) )
 	{
+		close(fd);
+		discard_transfer_fd(sess);
 		ftp_relply(sess,FTP_FILEFAIL,"Open file faild.");
 		return;
 	}
 
-	// 判断是否为普通文件
-	struct stat sbuf;
-	ret = fstat(fd,&sbuf);
+	if( end == -1 || end > sbuf.st_size )
+	{
+		end = sbuf.st_size;
+	}
 
-	if( !S_ISREG(sbuf.st_mode) )
+	// add read lock,只锁定本次要发送的范围
+	if( offset < end )
 	{
-		ftp_relply(sess,FTP_FILEFAIL,"Open file faild.");
-		return;
+		ret = lock_file_read(fd,offset,end - offset);
+		if( ret == -1 )
+		{
+			close(fd);
+			discard_transfer_fd(sess);
+			if( lock_busy(ret) )
+			{
+				ftp_relply(sess,FTP_FILEBUSY,"File is being written, try again later.");
+			}
+			else
+			{
+				ftp_relply(sess,FTP_FILEFAIL,"Open file faild.");
+			}
+			return;
+		}
 	}
 
 	// 断点续传，seek到发送的偏移位置 
@@ -370,10 +636,26 @@ void do_retr(session_t *sess)
 		ret = lseek(fd,offset,SEEK_SET);
 		if( ret == -1 )
 		{
+			close(fd);
+			discard_transfer_fd(sess);
 			ftp_relply(sess,FTP_FILEFAIL,"Failed to open file.");
 			return;
 		}
 	}
+
+	// SIZE/MDTM时已经预读过的文件和绕过页缓存的大文件除外
+	if( !prefetched && offset < end &&
+		!(tunable_odirect_threshold > 0 && sbuf.st_size >= tunable_odirect_threshold) )
+	{
+		posix_fadvise(fd,offset,end - offset > RETR_START_READAHEAD ? RETR_START_READAHEAD : end - offset,
+			POSIX_FADV_WILLNEED);
+	}
+
+	if( get_transfer_fd(sess) == 0 )
+	{
+		close(fd);
+		return;
+	}
 	
 	char text[MAX_LINE] = {0};
 	if( sess->is_ascii )
@@ -424,7 +706,7 @@ void do_retr(session_t *sess)
 	}
 	*/
 
-	long long bytes_to_send = sbuf.st_size;
+	long long bytes_to_send = end;
 	if( offset > bytes_to_send )
 	{
 		bytes_to_send = 0;
@@ -433,17 +715,134 @@ void do_retr(session_t *sess)
 	{
 		bytes_to_send -= offset;
 	}
-	
-	sess->bw_transfer_start_sec = get_time_sec();
-	sess->bw_transfer_start_usec = get_time_usec();
+
+	bwclass_transfer_begin(sess,0);
+
+	cache_cursor_t cc;
+	long long send_pos = offset;
+	cache_read_begin(&cc,fd,offset,sbuf.st_size);
+
+	// 内核按速率发送时使用大块sendfile，否则按4K分块在用户态限速
+	int chunk_size = 4*MAX_LINE;
+	if( ratelimit_start_pacing(sess,sess->data_fd) )
+	{
+		chunk_size = PACING_CHUNK_SIZE;
+	}
+
+	// 大文件绕过页缓存，异步读取多个对齐的块，再从用户态缓冲区发送
+	direct_reader_t dr;
+	int direct = tunable_odirect_threshold > 0 && sbuf.st_size >= tunable_odirect_threshold &&
+		bytes_to_send > 0 && directio_reader_begin(&dr,fd,offset,end) == 0;
+
+	// 从头发送整个文件时同时计算摘要(transfer_hash)，已有缓存则直接使用。
+	// sendfile时由后台线程从页缓存读取计算，O_DIRECT时直接计算用户态缓冲区
+	int hash_algo = offset == 0 && end == sbuf.st_size ? transfer_hash_algo() : -1;
+	char hash_hex[CKSUM_HEX_LEN] = {0};
+	checksum_ctx_t hash_ctx;
+	checksum_job_t hash_job;
+	int hash_running = 0;
+	if( hash_algo != -1 && checksum_cache_get(fd,hash_algo,&sbuf,hash_hex) == -1 )
+	{
+		if( direct )
+		{
+			checksum_init(&hash_ctx,hash_algo);
+		}
+		else if( checksum_job_start(&hash_job,fd,hash_algo,0,sbuf.st_size) == 0 )
+		{
+			hash_running = 1;
+		}
+		else
+		{
+			hash_algo = -1;
+		}
+	}
+
+	// 块模式下每个块最多BLOCK_MAX_DATA字节，block_left是当前块还没有发送的数据
+	long long block_left = 0;
+	long long next_mark = offset + BLOCK_MARK_INTERVAL;
 
 	while( bytes_to_send > 0 )
 	{
-		int num_this_time = bytes_to_send > (4*MAX_LINE) ? (4*MAX_LINE) : bytes_to_send;
-		ret = sendfile(sess->data_fd,fd,NULL,num_this_time);
-		if( ret == -1 )
+		int num_this_time = bytes_to_send > chunk_size ? chunk_size : bytes_to_send;
+		if( sess->block_mode )
 		{
-			flag = 2;
+			if( block_left == 0 )
+			{
+				// 按固定间隔插入重启标记，连接中断后客户端可以用REST <标记>续传
+				if( send_pos >= next_mark )
+				{
+					if( block_send_marker(sess->data_fd,send_pos) == -1 )
+					{
+						flag = 2;
+						break;
+					}
+					next_mark = send_pos + BLOCK_MARK_INTERVAL;
+				}
+				block_left = bytes_to_send > BLOCK_MAX_DATA ? BLOCK_MAX_DATA : bytes_to_send;
+				if( block_send_header(sess->data_fd,0,block_left) == -1 )
+				{
+					flag = 2;
+					break;
+				}
+			}
+			if( num_this_time > block_left )
+			{
+				num_this_time = block_left;
+			}
+		}
+		if( direct )
+		{
+			char *p_data;
+			ret = directio_reader_next(&dr,&p_data,num_this_time);
+			if( ret <= 0 )
+			{
+				flag = 1;
+				break;
+			}
+			if( writen(sess->data_fd,p_data,ret) != ret )
+			{
+				flag = 2;
+				break;
+			}
+			if( hash_algo != -1 && hash_hex[0] == '\0' )
+			{
+				checksum_update(&hash_ctx,p_data,ret);
+			}
+		}
+		else
+		{
+			ret = sendfile(sess->data_fd,fd,NULL,num_this_time);
+			if( ret == -1 )
+			{
+				if( errno == EINTR && !sess->abor_received )
+				{
+					continue;
+				}
+				flag = 2;
+				break;
+			}
+			// 发送过程中文件被截断，读不到剩余的数据
+			if( ret == 0 )
+			{
+				flag = 1;
+				break;
+			}
+		}
+
+		send_pos += ret;
+		if( sess->block_mode )
+		{
+			block_left -= ret;
+		}
+		if( !direct )
+		{
+			// 后台线程计算摘要时，丢弃页缓存不能超过它已经读到的位置
+			long long cache_pos = send_pos;
+			if( hash_running && checksum_job_pos(&hash_job) < cache_pos )
+			{
+				cache_pos = checksum_job_pos(&hash_job);
+			}
+			cache_read_advance(&cc,cache_pos);
 		}
 
 		limit_rate(sess,ret,0);
@@ -458,15 +857,53 @@ void do_retr(session_t *sess)
 	if( bytes_to_send == 0 )
 	{
 		flag = 0;
+		if( sess->block_mode && !sess->abor_received && block_send_eof(sess->data_fd) == -1 )
+		{
+			flag = 2;
+		}
 	}
 
-	close(sess->data_fd);
-	sess->data_fd = -1;
+	if( direct )
+	{
+		directio_reader_end(&dr);
+	}
+	ratelimit_stop_pacing(sess);
+	bwclass_transfer_end(sess);
+
+	int transfer_ok = flag == 0 && !sess->abor_received;
+	close_data_fd(sess,transfer_ok);
+	if( hash_algo != -1 && hash_hex[0] == '\0' )
+	{
+		int hash_ret = 0;
+		if( hash_running )
+		{
+			hash_ret = checksum_job_finish(&hash_job,!transfer_ok,hash_hex);
+		}
+		else if( transfer_ok )
+		{
+			checksum_final(&hash_ctx,hash_hex);
+		}
+
+		// 传输期间文件未被修改才缓存
+		struct stat end_buf;
+		if( transfer_ok && hash_ret == 0 && fstat(fd,&end_buf) == 0 &&
+			end_buf.st_mtim.tv_sec == sbuf.st_mtim.tv_sec && end_buf.st_mtim.tv_nsec == sbuf.st_mtim.tv_nsec &&
+			end_buf.st_size == sbuf.st_size )
+		{
+			checksum_cache_put(fd,hash_algo,&sbuf,hash_hex);
+		}
+		else
+		{
+			hash_hex[0] = '\0';
+		}
+	}
 	close(fd);
 
-	if( flag == 0 && !sess->abor_received )
+	if( transfer_ok )
 	{
-		ftp_relply(sess,FTP_TRANSFEROK,"Transfer complete.");
+		char text[MAX_LINE] = {0};
+		get_transfer_ok_text(hash_algo,hash_hex,text,sizeof(text));
+		ftp_relply(sess,sess->block_fd != -1 ? FTP_TRANSFERDONE : FTP_TRANSFEROK,text);
 	}
 	else if( flag == 1 )
 	{
@@ -495,40 +932,62 @@ void do_appe(session_t *sess)
 
 void do_list(session_t *sess)
 {
+	// 目录打开失败时不建立数据连接
+	DIR *dir = opendir(".");
+	if( dir == NULL )
+	{
+		discard_transfer_fd(sess);
+		ftp_relply(sess,FTP_FILEFAIL,"Failed to open directory.");
+		return;
+	}
+
 	// create data socket link
 	if( get_transfer_fd(sess) == 0 )
 	{
+		closedir(dir);
 		return;
 	}
 	ftp_relply(sess,FTP_DATACONN,"Here comes the directory list.");
 
-	list_common(sess,1);
+	list_common(sess,dir,1);
 
-	close(sess->data_fd);
+	close_data_fd(sess,!sess->block_mode || block_send_eof(sess->data_fd) == 0);
 
-	ftp_relply(sess,FTP_TRANSFEROK,"Directory send OK.");
+	ftp_relply(sess,sess->block_fd != -1 ? FTP_TRANSFERDONE : FTP_TRANSFEROK,"Directory send OK.");
 }
 
 void do_nlst(session_t *sess)
 {
+	// 目录打开失败时不建立数据连接
+	DIR *dir = opendir(".");
+	if( dir == NULL )
+	{
+		discard_transfer_fd(sess);
+		ftp_relply(sess,FTP_FILEFAIL,"Failed to open directory.");
+		return;
+	}
+
 	// create data socket link
 	if( get_transfer_fd(sess) == 0 )
 	{
+		closedir(dir);
 		return;
 	}
 	ftp_relply(sess,FTP_DATACONN,"Here comes the directory list.");
 
-	list_common(sess,0);
+	list_common(sess,dir,0);
 
-	close(sess->data_fd);
+	close_data_fd(sess,!sess->block_mode || block_send_eof(sess->data_fd) == 0);
 
-	ftp_relply(sess,FTP_TRANSFEROK,"Directory send OK.");
+	ftp_relply(sess,sess->block_fd != -1 ? FTP_TRANSFERDONE : FTP_TRANSFEROK,"Directory send OK.");
 }
 
 void do_rest(session_t *sess)
 {
 	// 断点续传位移
 	sess->restart_pos = str_to_longlong(sess->cmd_arg);
+	sess->rang_set = 0;
+	prefetch_hint(sess,NULL,sess->restart_pos);
 
 	char text[MAX_LINE] = {0};
 	sprintf(text,"%s (%lld).","Restart position accepted",sess->restart_pos);
@@ -641,9 +1100,15 @@ void do_site(session_t *sess)
 {
 	// SITE CHMOD <param> <file>
 	// SITE UMASK [umask]
+	// SITE TREEHASH <file>
+	// SITE CPFR <file>
+	// SITE CPTO <file>
+	// SITE CONCAT <file> <part1> <part2> ...
+	// SITE SIGS <block size> <file>
+	// SITE DELTA <file>
 	// SITE HELP
 	char cmd[100] = {0};
-	char arg[100] = {0};
+	char arg[MAX_ARG] = {0};
 
 	str_split(sess->cmd_arg,cmd,arg,' ')   ;
 	if( strcmp(cmd,"CHMOD") == 0 )
@@ -654,9 +1119,33 @@ void do_site(session_t *sess)
 	{
 		do_site_umask(sess,arg);
 	}
+	else if( strcmp(cmd,"TREEHASH") == 0 )
+	{
+		do_site_treehash(sess,arg);
+	}
+	else if( strcmp(cmd,"CPFR") == 0 )
+	{
+		do_site_cpfr(sess,arg);
+	}
+	else if( strcmp(cmd,"CPTO") == 0 )
+	{
+		do_site_cpto(sess,arg);
+	}
+	else if( strcmp(cmd,"CONCAT") == 0 )
+	{
+		do_site_concat(sess,arg);
+	}
+	else if( strcmp(cmd,"SIGS") == 0 )
+	{
+		do_site_sigs(sess,arg);
+	}
+	else if( strcmp(cmd,"DELTA") == 0 )
+	{
+		do_site_delta(sess,arg);
+	}
 	else if( strcmp(cmd,"HELP") == 0 )
 	{
-		ftp_relply(sess,FTP_SITEHELP,"CHMOD UMASK HELP");
+		ftp_relply(sess,FTP_SITEHELP,"CHMOD UMASK TREEHASH CPFR CPTO CONCAT SIGS DELTA HELP");
 	}
 	else
 	{
@@ -674,12 +1163,28 @@ void do_feat(session_t *sess)
 	ftp_lrelply(sess,FTP_FEAT,"Features:");
 	writen(sess->ctrl_fd,"EPRT\r\n",strlen("EPRT\r\n"));
 	writen(sess->ctrl_fd,"EPSV\r\n",strlen("EPSV\r\n"));
+
+	// 当前选择的算法后面加*
+	char text[MAX_LINE] = "HASH ";
+	int i;
+	for( i = 0; i < CKSUM_COUNT; ++i )
+	{
+		strcat(text,checksum_name(i));
+		strcat(text,i == sess->hash_algo ? "*" : "");
+		strcat(text,i + 1 < CKSUM_COUNT ? ";" : "\r\n");
+	}
+	writen(sess->ctrl_fd,text,strlen(text));
 	writen(sess->ctrl_fd,"MDTM\r\n",strlen("MDTM\r\n"));
 	writen(sess->ctrl_fd,"PASV\r\n",strlen("PASV\r\n"));
+	writen(sess->ctrl_fd,"RANG STREAM\r\n",strlen("RANG STREAM\r\n"));
 	writen(sess->ctrl_fd,"REST STREAM\r\n",strlen("REST STREAM\r\n"));
 	writen(sess->ctrl_fd,"SIZE\r\n",strlen("SIZE\r\n"));
 	writen(sess->ctrl_fd,"TVFS\r\n",strlen("TVFS\r\n"));
 	writen(sess->ctrl_fd,"UTF8\r\n",strlen("UTF8\r\n"));
+	writen(sess->ctrl_fd,"XCRC\r\n",strlen("XCRC\r\n"));
+	writen(sess->ctrl_fd,"XMD5\r\n",strlen("XMD5\r\n"));
+	writen(sess->ctrl_fd,"XSHA1\r\n",strlen("XSHA1\r\n"));
+	writen(sess->ctrl_fd,"XSHA256\r\n",strlen("XSHA256\r\n"));
 
 	ftp_relply(sess,FTP_FEAT,"End");
 }
@@ -699,9 +1204,34 @@ void do_size(session_t *sess)
 		return;
 	}
 
+	// 记录下来，紧接着覆盖上传同一文件时作为预分配大小的估计
+	sess->size_hint = s_buf.st_size;
+	sess->size_hint_dev = s_buf.st_dev;
+	sess->size_hint_ino = s_buf.st_ino;
+
 	char text[MAX_LINE];
 	sprintf(text,"%lld",(long long)s_buf.st_size);
 	ftp_relply(sess,FTP_SIZEOK,text);
+
+	// 客户端接下来很可能RETR这个文件
+	prefetch_hint(sess,sess->cmd_arg,0);
+}
+
+void do_mdtm(session_t *sess)
+{
+	struct stat s_buf;
+	if( stat(sess->cmd_arg,&s_buf) < 0 || !S_ISREG(s_buf.st_mode) )
+	{
+		ftp_relply(sess,FTP_FILEFAIL,"Could not get file modification time.");
+		return;
+	}
+
+	char text[MAX_LINE] = {0};
+	struct tm *p_tm = gmtime(&s_buf.st_mtime);
+	strftime(text,sizeof(text),"%Y%m%d%H%M%S",p_tm);
+	ftp_relply(sess,FTP_MDTMOK,text);
+
+	prefetch_hint(sess,sess->cmd_arg,0);
 }
 
 void do_stat(session_t *sess)
@@ -738,6 +1268,9 @@ void do_stat(session_t *sess)
 	sprintf(text,"At session startup,client count was %u\r\n",sess->num_clients);
 	writen(sess->ctrl_fd,text,strlen(text));
 
+	bwclass_describe(sess,text,sizeof(text));
+	writen(sess->ctrl_fd,text,strlen(text));
+
 	ftp_relply(sess,FTP_STATOK,"End of status.");
 }
 
@@ -759,32 +1292,168 @@ void do_help(session_t *sess)
     	writen(sess->ctrl_fd, " RNTO SITE SIZE SMNT STAT STOR STOU STRU SYST TYPE USER XCUP XCWD XMKD\r\n",
         strlen(" RNTO SITE SIZE SMNT STAT STOR STOU STRU SYST TYPE USER XCUP XCWD XMKD\r\n"));
     	
-    	writen(sess->ctrl_fd, " XPWD XRMD\r\n", strlen(" XPWD XRMD\r\n"));
+    	writen(sess->ctrl_fd, " XPWD XRMD HASH RANG XCRC XMD5 XSHA1 XSHA256\r\n",
+        strlen(" XPWD XRMD HASH RANG XCRC XMD5 XSHA1 XSHA256\r\n"));
     	
     	ftp_relply(sess, FTP_HELP, "Help OK.");
 }
 
-void ftp_relply(session_t *sess,int status,const char *text)
+// ALLO <size> [R <record-size>]
+void do_allo(session_t *sess)
 {
-	char buf[MAX_LINE] = {0};
-	sprintf(buf,"%d %s\r\n",status,text);
-	writen(sess->ctrl_fd,buf,strlen(buf));
-}
+	long long size = str_to_longlong(sess->cmd_arg);
+	if( size <= 0 )
+	{
+		ftp_relply(sess,FTP_BADOPTS,"Bad ALLO size.");
+		return;
+	}
 
-void ftp_lrelply(session_t *sess,int status,const char *text)
-{
-	char buf[MAX_LINE] = {0};
-	sprintf(buf,"%d-%s\r\n",status,text);
-	writen(sess->ctrl_fd,buf,strlen(buf));
+	if( tunable_allo_check_space )
+	{
+		struct statvfs vfs;
+		if( statvfs(".",&vfs) == 0 &&
+			(unsigned long long)size > (unsigned long long)vfs.f_bavail * vfs.f_frsize )
+		{
+			ftp_relply(sess,FTP_NOSPACE,"Insufficient storage space.");
+			return;
+		}
+	}
+
+	sess->alloc_size = size;
+	ftp_relply(sess,FTP_ALLOOK,"ALLO command successful.");
 }
 
-int list_common(session_t *sess,int detail)
+// OPTS HASH [<算法>]，OPTS UTF8 ON
+void do_opts(session_t *sess)
 {
-	DIR *dir = opendir(".");
-	if( dir == NULL )
+	char opt[MAX_ARG] = {0};
+	char value[MAX_ARG] = {0};
+	str_split(sess->cmd_arg,opt,value,' ');
+	str_upper(opt);
+
+	if( strcmp(opt,"HASH") == 0 )
 	{
-		return 0;
+		if( value[0] != '\0' )
+		{
+			int algo = checksum_lookup(value);
+			if( algo == -1 )
+			{
+				ftp_relply(sess,FTP_BADOPTS,"Unknown algorithm.");
+				return;
+			}
+			sess->hash_algo = algo;
+		}
+		ftp_relply(sess,FTP_OPTSOK,checksum_name(sess->hash_algo));
+	}
+	else if( strcmp(opt,"UTF8") == 0 )
+	{
+		ftp_relply(sess,FTP_OPTSOK,"Always in UTF8 mode.");
+	}
+	else
+	{
+		ftp_relply(sess,FTP_BADOPTS,"Option not understood.");
+	}
+}
+
+// HASH <path>，范围由RANG或REST指定
+void do_hash(session_t *sess)
+{
+	long long start = sess->restart_pos;
+	long long end = -1;
+	sess->restart_pos = 0;
+	if( sess->rang_set )
+	{
+		start = sess->rang_start;
+		end = sess->rang_end + 1;
+		sess->rang_set = 0;
+	}
+
+	char hex[CKSUM_HEX_LEN];
+	if( hash_common(sess,sess->cmd_arg,sess->hash_algo,&start,&end,hex) == -1 )
+	{
+		return;
+	}
+
+	// 213 SHA-256 0-49 <摘要> <文件名>，范围的结束位置含在范围内
+	char text[MAX_LINE] = {0};
+	snprintf(text,sizeof(text),"%s %lld-%lld %s %.900s",checksum_name(sess->hash_algo),
+		start,end > start ? end - 1 : start,hex,sess->cmd_arg);
+	ftp_relply(sess,FTP_HASHOK,text);
+}
+
+// RANG <start> <end>，结束位置含在范围内；RANG 1 0取消
+void do_rang(session_t *sess)
+{
+	char start_str[MAX_ARG] = {0};
+	char end_str[MAX_ARG] = {0};
+	str_split(sess->cmd_arg,start_str,end_str,' ');
+	if( !str_is_number(start_str) || !str_is_number(end_str) )
+	{
+		ftp_relply(sess,FTP_BADOPTS,"Bad RANG arguments.");
+		return;
+	}
+
+	long long start = str_to_longlong(start_str);
+	long long end = str_to_longlong(end_str);
+	if( start == 1 && end == 0 )
+	{
+		sess->rang_set = 0;
+		ftp_relply(sess,FTP_RESTOK,"Transfer byte range reset.");
+		return;
+	}
+	if( end < start )
+	{
+		ftp_relply(sess,FTP_BADOPTS,"Bad RANG arguments.");
+		return;
 	}
+
+	// RANG和REST互斥
+	sess->restart_pos = 0;
+	sess->rang_set = 1;
+	sess->rang_start = start;
+	sess->rang_end = end;
+
+	char text[MAX_LINE] = {0};
+	sprintf(text,"Restarting at %lld. Ending byte at %lld.",start,end);
+	ftp_relply(sess,FTP_RESTOK,text);
+}
+
+void do_xcrc(session_t *sess)
+{
+	xhash_common(sess,CKSUM_CRC32);
+}
+
+void do_xmd5(session_t *sess)
+{
+	xhash_common(sess,CKSUM_MD5);
+}
+
+void do_xsha1(session_t *sess)
+{
+	xhash_common(sess,CKSUM_SHA1);
+}
+
+void do_xsha256(session_t *sess)
+{
+	xhash_common(sess,CKSUM_SHA256);
+}
+
+void ftp_relply(session_t *sess,int status,const char *text)
+{
+	char buf[MAX_LINE] = {0};
+	sprintf(buf,"%d %s\r\n",status,text);
+	writen(sess->ctrl_fd,buf,strlen(buf));
+}
+
+void ftp_lrelply(session_t *sess,int status,const char *text)
+{
+	char buf[MAX_LINE] = {0};
+	sprintf(buf,"%d-%s\r\n",status,text);
+	writen(sess->ctrl_fd,buf,strlen(buf));
+}
+
+int list_common(session_t *sess,DIR *dir,int detail)
+{
 	struct dirent *dt;
 	struct stat sbuf;
 	while( (dt = readdir(dir)) != NULL )
@@ -827,7 +1496,7 @@ int list_common(session_t *sess,int detail)
 		{
 			sprintf(buf,"%s\r\n",dt->d_name);
 		}
-		writen(sess->data_fd,buf,strlen(buf));
+		send_data(sess,buf,strlen(buf));
 	}
 
 	closedir(dir);
@@ -839,79 +1508,140 @@ void limit_rate(session_t *sess,int bytes_transfered,int is_upload)
 {
 	sess->data_process = 1;
 
-	long cur_sec = get_time_sec();
-	long cur_usec = get_time_usec();
-
-	double elapsed;
-	elapsed = (double)cur_sec - sess->bw_transfer_start_sec;
-	elapsed += (double)(cur_usec - sess->bw_transfer_start_usec) / (double)1000000;
+	// 按令牌桶消耗会话/用户/IP/全局各级令牌，不足时睡眠
+	ratelimit_charge(sess,bytes_transfered,is_upload);
+}
 
-	if( elapsed <= (double)0 )
-	{
-		elapsed = (double)0.01;
+void    upload_common(session_t *sess,int is_append)
+{
+	// 先创建文件并加锁再建立数据连接，失败时不浪费数据连接；
+	// 截断在连接建立之后进行，连接失败不会破坏原文件
+	long long offset = sess->restart_pos;
+	sess->restart_pos = 0;
+	// RANG只用于下载，不能留到之后的RETR
+	sess->rang_set = 0;
+
+	// 预分配大小：客户端通过ALLO告知，否则如果刚刚对同一文件执行过SIZE，
+	// 按原文件大小估计(覆盖上传时新旧版本大小通常相近)
+	long long alloc_size = sess->alloc_size;
+	sess->alloc_size = 0;
+	if( alloc_size == 0 && sess->size_hint > 0 && !is_append )
+	{
+		struct stat hint_buf;
+		if( stat(sess->cmd_arg,&hint_buf) == 0 &&
+			hint_buf.st_dev == sess->size_hint_dev && hint_buf.st_ino == sess->size_hint_ino )
+		{
+			alloc_size = sess->size_hint - offset;
+		}
 	}
-
-	// cal cur transfer v
-	unsigned int bw_rate = (unsigned int)((double)bytes_transfered / elapsed);
-	
-	double rate_ratio;
-	if( is_upload )
+	sess->size_hint = 0;
+
+	// 快照模式：STOR和REST+STOR先写入本会话私有的临时文件，传输成功后原子替换目标文件，
+	// 下载者不会被写锁阻塞，并且总是看到完整的版本
+	int snapshot = tunable_upload_snapshot && !is_append;
+	int is_tmpfile = 0;
+	char part_name[MAX_LINE] = {0};
+	char tmp_name[MAX_LINE] = {0};
+	// 本次新建了目标文件：数据连接建立之前失败时删除，不留下空文件
+	int created = 0;
+	int fd;
+	if( snapshot )
+	{
+		get_partial_name(sess->cmd_arg,part_name,sizeof(part_name));
+		if( offset != 0 )
+		{
+			fd = claim_partial_file(sess->cmd_arg,part_name,tmp_name,sizeof(tmp_name),offset);
+		}
+		else
+		{
+			fd = open_private_file(sess->cmd_arg,tmp_name,sizeof(tmp_name),&is_tmpfile);
+		}
+	}
+	else
 	{
-		if( bw_rate < sess->bw_upload_rate_max )
+		fd = open(sess->cmd_arg,O_CREAT | O_EXCL | O_WRONLY,0666);
+		if( fd != -1 )
 		{
-			// needn't limit rate
-			sess->bw_transfer_start_sec = cur_sec;
-			sess->bw_transfer_start_usec = cur_usec;
-			return;
+			created = 1;
+		}
+		else if( errno == EEXIST )
+		{
+			fd = open(sess->cmd_arg,O_CREAT | O_WRONLY,0666);
 		}
-		rate_ratio = bw_rate / sess->bw_upload_rate_max;
 	}
-	 else
-	 {
-	 	if( bw_rate < sess->bw_download_rate_max )
-	 	{
-	 		// needn't limit rate
-	 		sess->bw_transfer_start_sec = cur_sec;
-			sess->bw_transfer_start_usec = cur_usec;
-	 		return;
-	 	}
-	 	rate_ratio = bw_rate / sess->bw_download_rate_max;
-	 }
-
-	 // 睡眠时间 = （当前传输速度 / 最大传输速度 - 1) * 当前传输时间
-	 double pause_time;
-	 pause_time = (rate_ratio - (double)1) * elapsed;
-
-	 nano_sleep(pause_time);
-
-	 sess->bw_transfer_start_sec = get_time_sec();
-	 sess->bw_transfer_start_usec = get_time_usec();
-}
-
-void    upload_common(session_t *sess,int is_append)
-{
-	if( get_transfer_fd(sess) == 0 )
+	if( fd == -1 )
 	{
+		// 续传只能接在保存下来的 .part 之后，没有或超出其大小时拒绝，
+		// 否则会在文件中留下空洞
+		int bad_restart = snapshot && offset != 0 && (errno == ENOENT || errno == EINVAL);
+		discard_transfer_fd(sess);
+		if( bad_restart )
+		{
+			ftp_relply(sess,FTP_BADRESTART,"No partial upload to resume at that offset.");
+		}
+		else
+		{
+			ftp_relply(sess,FTP_UPLOADFAIL,"Create file failed1.");
+		}
 		return;
 	}
 
-	long long offset = sess->restart_pos;
-	sess->restart_pos = 0;
+	// add write lock
+	// STOR会截断文件，锁定整个文件；APPE锁定从文件末尾开始的部分；
+	// REST+STOR锁定ALLO声明的范围，超出部分(或结束位置未知时)写入时逐块锁定，
+	// 多个分段上传可以并行
+	int ret = 0;
+	long long lock_end = offset;
+	if( !is_append && offset == 0 )
+	{
+		ret = lock_file_write(fd,0,0);
+		lock_end = LLONG_MAX;
+	}
+	else if( is_append )
+	{
+		ret = lock_file_write(fd,lseek(fd,0,SEEK_END),0);
+		lock_end = LLONG_MAX;
+	}
+	else if( alloc_size > 0 )
+	{
+		ret = lock_file_write(fd,offset,alloc_size);
+		lock_end = offset + alloc_size;
+	}
 
-	int fd = open(sess->cmd_arg,O_CREAT | O_WRONLY,0666);
-	if( fd == -1 )
+	if( ret == -1 )
 	{
-		ftp_relply(sess,FTP_UPLOADFAIL,"Create file failed1.");
+		if( snapshot )
+		{
+			abandon_private_file(fd,is_tmpfile,tmp_name,part_name,offset != 0);
+		}
+		else if( created )
+		{
+			remove_created_file(fd,sess->cmd_arg);
+		}
+		close(fd);
+		discard_transfer_fd(sess);
+		if( lock_busy(ret) )
+		{
+			ftp_relply(sess,FTP_FILEBUSY,"File is being transferred, try again later.");
+		}
+		else
+		{
+			ftp_relply(sess,FTP_UPLOADFAIL,"Create file faild2.");
+		}
 		return;
 	}
 
-	// add read lock
-	int ret;
-	ret = lock_file_write(fd);
-
-	if( ret == -1 )
+	if( get_transfer_fd(sess) == 0 )
 	{
-		ftp_relply(sess,FTP_UPLOADFAIL,"Create file faild2.");
+		if( snapshot )
+		{
+			abandon_private_file(fd,is_tmpfile,tmp_name,part_name,offset != 0);
+		}
+		else if( created )
+		{
+			remove_created_file(fd,sess->cmd_arg);
+		}
+		close(fd);
 		return;
 	}
 
@@ -923,6 +1653,12 @@ void    upload_common(session_t *sess,int is_append)
 		ftruncate(fd,0);
 		if( lseek(fd,0,SEEK_SET) < 0 )
 		{
+			if( snapshot )
+			{
+				abandon_private_file(fd,is_tmpfile,tmp_name,part_name,offset != 0);
+			}
+			close(fd);
+			close_data_fd(sess,0);
 			ftp_relply(sess,FTP_UPLOADFAIL,"Create file failed3.");
 			return;
 		}
@@ -931,6 +1667,12 @@ void    upload_common(session_t *sess,int is_append)
 	{
 		if( lseek(fd,offset,SEEK_SET) < 0 )
 		{
+			if( snapshot )
+			{
+				abandon_private_file(fd,is_tmpfile,tmp_name,part_name,offset != 0);
+			}
+			close(fd);
+			close_data_fd(sess,0);
 			ftp_relply(sess,FTP_UPLOADFAIL,"Create file failed4.");
 			return;
 		}
@@ -939,12 +1681,38 @@ void    upload_common(session_t *sess,int is_append)
 	{
 		if( lseek(fd,0,SEEK_END) < 0 )
 		{
+			close(fd);
+			close_data_fd(sess,0);
 			ftp_relply(sess,FTP_UPLOADFAIL,"Create file failed5.");
 			return;
 		}
 		
 	}
 	
+	long long write_pos = lseek(fd,0,SEEK_CUR);
+
+	// 一次性预分配磁盘空间(不改变文件大小)，避免逐块增长产生碎片
+	long long alloc_end = 0;
+	if( alloc_size > 0 )
+	{
+		ret = fallocate(fd,FALLOC_FL_KEEP_SIZE,write_pos,alloc_size);
+		if( ret == 0 )
+		{
+			alloc_end = write_pos + alloc_size;
+		}
+		else if( errno == ENOSPC && tunable_allo_check_space )
+		{
+			if( snapshot )
+			{
+				abandon_private_file(fd,is_tmpfile,tmp_name,part_name,offset != 0);
+			}
+			close(fd);
+			close_data_fd(sess,0);
+			ftp_relply(sess,FTP_NOSPACE,"Insufficient storage space.");
+			return;
+		}
+	}
+
 	struct stat sbuf;
 	ret = fstat(fd,&sbuf);
 
@@ -968,13 +1736,76 @@ void    upload_common(session_t *sess,int is_append)
 	
 	char buf[MAX_LINE];
 
-	// 睡眠时间 = （当前传输速度 / 最大传输速度 - 1) * 当前传输时间
-	sess->bw_transfer_start_sec = get_time_sec();
-	sess->bw_transfer_start_usec = get_time_usec();
+	bwclass_transfer_begin(sess,1);
 
-	while(1)
+	cache_cursor_t cc;
+	cache_write_begin(&cc,fd,write_pos,alloc_size);
+
+	upload_sink_ctx_t sink;
+	sink.fd = fd;
+	sink.write_pos = write_pos;
+	sink.lock_end = lock_end;
+	sink.p_cc = &cc;
+	sink.expected_end = alloc_size > 0 ? write_pos + alloc_size : 0;
+
+	// STOR从头写入整个文件时同时计算摘要，在写盘线程中与接收并行
+	int hash_algo = !is_append && offset == 0 ? transfer_hash_algo() : -1;
+	char hash_hex[CKSUM_HEX_LEN] = {0};
+	checksum_ctx_t hash_ctx;
+	sink.p_hash = NULL;
+	if( hash_algo != -1 )
+	{
+		checksum_init(&hash_ctx,hash_algo);
+		sink.p_hash = &hash_ctx;
+	}
+	// O_DIRECT需要流水线提供的对齐缓冲区
+	sink.direct = tunable_odirect_threshold > 0 && tunable_upload_buffer_max > 0 &&
+		directio_writer_begin(&sink.dw,fd) == 0;
+
+	// 流水线模式下数据先填满缓冲区再交给写盘线程，否则每次读取后直接写盘
+	upload_pipe_t pipe;
+	int piped = upload_pipe_start(&pipe,upload_sink,&sink) == 0;
+	char *p_buf = buf;
+	int buf_size = sizeof(buf);
+	int filled = 0;
+	if( !piped && sink.direct )
+	{
+		directio_writer_end(&sink.dw);
+		sink.direct = 0;
+	}
+	if( piped )
+	{
+		p_buf = upload_pipe_get(&pipe,&buf_size);
+		// REST位置不对齐时第一个缓冲区只接收到对齐位置为止，之后的缓冲区都从对齐位置开始
+		if( p_buf != NULL && sink.direct && write_pos % DIRECT_ALIGN != 0 )
+		{
+			buf_size = DIRECT_ALIGN - write_pos % DIRECT_ALIGN;
+		}
+	}
+
+	// 块模式下去掉块头，EOF块表示文件结束；recv_pos是已经收到的数据对应的文件位置
+	block_reader_t br;
+	block_reader_init(&br,sess->data_fd);
+	long long recv_pos = write_pos;
+
+	while( p_buf != NULL )
 	{
-		ret = read(sess->data_fd,buf,sizeof(buf));
+		if( sess->block_mode )
+		{
+			ret = block_read(&br,p_buf + filled,buf_size - filled);
+		}
+		else
+		{
+			ret = read(sess->data_fd,p_buf + filled,buf_size - filled);
+		}
+		if( ret == BLOCK_GOT_MARK )
+		{
+			// 110 MARK <客户端标记> = <文件位置>，之后可以用REST <文件位置>续传
+			char text[MAX_LINE] = {0};
+			snprintf(text,sizeof(text),"MARK %s = %lld",br.mark,recv_pos);
+			ftp_relply(sess,FTP_MARK,text);
+			continue;
+		}
 		if( ret == -1 )
 		{
 			if( errno == EINTR )
@@ -999,14 +1830,101 @@ void    upload_common(session_t *sess,int is_append)
 			flag = 2;
 			break;
 		}
+		recv_pos += ret;
+
+		if( !piped )
+		{
+			struct iovec iov;
+			iov.iov_base = buf;
+			iov.iov_len = ret;
+			flag = upload_sink(&sink,&iov,1);
+			if( flag != 0 )
+			{
+				break;
+			}
+			continue;
+		}
+
+		filled += ret;
+		if( filled == buf_size )
+		{
+			upload_pipe_put(&pipe,filled);
+			filled = 0;
+			p_buf = upload_pipe_get(&pipe,&buf_size);
+		}
+	}
+
+	if( piped )
+	{
+		// 提交最后一个未填满的缓冲区，等待写盘完成
+		if( p_buf != NULL && filled > 0 )
+		{
+			upload_pipe_put(&pipe,filled);
+		}
+		ret = upload_pipe_finish(&pipe);
+		if( ret != 0 && flag != 2 )
+		{
+			flag = ret;
+		}
+	}
+	if( sink.direct )
+	{
+		directio_writer_end(&sink.dw);
+	}
+	write_pos = sink.write_pos;
+	cache_write_end(&cc,write_pos);
+
+	bwclass_transfer_end(sess);
+
+	// 释放文件末尾之后未用完的预分配空间(传输完成或ABOR)，
+	// 截断到原大小即可释放；文件末尾之后有其他分段正在写入时不处理
+	if( alloc_end > 0 )
+	{
+		struct stat end_buf;
+		if( fstat(fd,&end_buf) == 0 && alloc_end > end_buf.st_size &&
+			lock_file_trywrite(fd,end_buf.st_size,0) == 0 )
+		{
+			ftruncate(fd,end_buf.st_size);
+		}
+	}
+
+	// 数据落盘后才回复226，快照模式下也要在rename之前完成
+	if( flag == 0 && !sess->abor_received && durability_sync(fd) == -1 )
+	{
+		flag = 1;
+	}
+
+	// 摘要以最终的mtime和大小缓存，必须在截断之后
+	if( hash_algo != -1 && flag == 0 && !sess->abor_received )
+	{
+		struct stat hash_buf;
+		checksum_final(&hash_ctx,hash_hex);
+		if( fstat(fd,&hash_buf) == 0 )
+		{
+			checksum_cache_put(fd,hash_algo,&hash_buf,hash_hex);
+		}
+	}
 
-		if( writen(fd,buf,ret) != ret )
+	if( snapshot )
+	{
+		if( flag == 0 && !sess->abor_received &&
+			publish_private_file(fd,is_tmpfile,tmp_name,sess->cmd_arg) == -1 )
 		{
 			flag = 1;
-			break;
+		}
+		if( flag != 0 || sess->abor_received )
+		{
+			// 传输中断，保留已收到的部分以便REST+STOR续传
+			abandon_private_file(fd,is_tmpfile,tmp_name,part_name,1);
 		}
 	}
-	
+
+	// 新建或替换后的目录项也要落盘，否则掉电后可能恢复为旧版本或丢失文件名
+	if( flag == 0 && !sess->abor_received && (snapshot || created) &&
+		durability_sync_dir(sess->cmd_arg) == -1 )
+	{
+		flag = 1;
+	}
 
 	/*
 	long long bytes_to_send = sbuf.st_size;
@@ -1035,13 +1953,14 @@ void    upload_common(session_t *sess,int is_append)
 	}
 	*/
 
-	close(sess->data_fd);
-	sess->data_fd = -1;
+	close_data_fd(sess,flag == 0 && !sess->abor_received);
 	close(fd);
 
 	if( flag == 0 && !sess->abor_received )
 	{
-		ftp_relply(sess,FTP_TRANSFEROK,"Transfer complete.");
+		char text[MAX_LINE] = {0};
+		get_transfer_ok_text(hash_algo,hash_hex,text,sizeof(text));
+		ftp_relply(sess,sess->block_fd != -1 ? FTP_TRANSFERDONE : FTP_TRANSFEROK,text);
 	}
 	else if( flag == 1 )
 	{
@@ -1051,6 +1970,10 @@ void    upload_common(session_t *sess,int is_append)
 	{
 		ftp_relply(sess,FTP_BADSENDNET,"Failure reading from network stream.");
 	}
+	else if( flag == 3 )
+	{
+		ftp_relply(sess,FTP_FILEBUSY,"Range is being written by another transfer.");
+	}
 
 	check_abor(sess);
 
@@ -1058,64 +1981,306 @@ void    upload_common(session_t *sess,int is_append)
 	start_cmdio_alarm();
 }
 
-int    get_transfer_fd(session_t *sess)
+// 写入上传的数据，超出已锁定范围的部分先加锁
+// 返回0表示成功，1表示写文件失败，3表示范围被其他传输锁定
+int   upload_sink(void *arg,const struct iovec *iov,int count)
 {
-	// 检测是否收到port或者pasv命令	
-	if( !port_active(sess) && !pasv_active(sess) )
+	upload_sink_ctx_t *sink = (upload_sink_ctx_t*)arg;
+
+	long long len = 0;
+	int i;
+	for( i = 0; i < count; ++i )
 	{
-		ftp_relply(sess,FTP_BADSENDCONN,"Use PORT or PASV first.");
-		return 0;
+		len += iov[i].iov_len;
 	}
-	int ret = 1;
-	// port model
-	if( port_active(sess) )
+
+	if( sink->write_pos + len > sink->lock_end )
 	{
-		//tcp_client(DATA_PORT);
-		/*
-		int data_fd = tcp_client(0);
-		printf("data_fd: %d\n", data_fd);
-		printf("tunable_connect_timeout: %d\n",tunable_connect_timeout);
-		if( connect_timeout(data_fd,sess->port_addr,tunable_connect_timeout) < 0 )
-		{
-			printf("bbbbbbbbb\n");
-			close(data_fd);
-			return 0;
-		}
-		sess->data_fd = data_fd;
-		*/
-		// send to nobody
-		if( get_port_fd(sess) == 0 )
+		// 加锁失败(包括ENOLCK等非占用的错误)时不能不加锁写入
+		int ret = lock_file_write(sink->fd,sink->lock_end,sink->write_pos + len - sink->lock_end);
+		if( ret == -1 )
 		{
-			printf("get port fd ret: %d\n", ret);
-			ret = 0;
+			return lock_busy(ret) ? 3 : 1;
 		}
-		 
+		sink->lock_end = sink->write_pos + len;
 	}
 
-	if( pasv_active(sess) )
+	if( sink->p_hash != NULL )
 	{
-		if( get_pasv_fd(sess) == 0 )
+		for( i = 0; i < count; ++i )
 		{
-			printf("get pasv fd ret: %d\n", ret);
-			ret = 0;
+			checksum_update(sink->p_hash,iov[i].iov_base,iov[i].iov_len);
 		}
 	}
 
-	if( sess->port_addr )
+	// 文件(预计)超过odirect_threshold之后绕过页缓存
+	if( sink->direct && (sink->expected_end >= tunable_odirect_threshold ||
+		sink->write_pos + len >= tunable_odirect_threshold) )
 	{
-		free(sess->port_addr);
-		sess->port_addr = NULL;
+		if( directio_writev(&sink->dw,sink->write_pos,iov,count) == -1 )
+		{
+			return 1;
+		}
+		sink->write_pos += len;
+		return 0;
 	}
 
-	// start data link alarm
-	if( ret )
+	for( i = 0; i < count; ++i )
 	{
-		start_data_alarm();
+		if( writen(sink->fd,iov[i].iov_base,iov[i].iov_len) != iov[i].iov_len )
+		{
+			return 1;
+		}
+		sink->write_pos += iov[i].iov_len;
+		cache_write_advance(sink->p_cc,sink->write_pos);
+	}
+
+	return 0;
+}
+
+// 计算path在[*p_start,*p_end)范围的摘要，*p_end为-1表示到文件末尾；
+// 整个文件的摘要优先从扩展属性读取，计算后写回。失败时已经回复客户端，返回-1
+int   hash_common(session_t *sess,const char *path,int algo,long long *p_start,long long *p_end,char *hex)
+{
+	int fd = open(path,O_RDONLY);
+	if( fd == -1 )
+	{
+		ftp_relply(sess,FTP_FILEFAIL,"Open file failed.");
+		return -1;
+	}
+
+	struct stat sbuf;
+	if( fstat(fd,&sbuf) == -1 || !S_ISREG(sbuf.st_mode) )
+	{
+		close(fd);
+		ftp_relply(sess,FTP_FILEFAIL,"Not a plain file.");
+		return -1;
+	}
+
+	if( *p_end == -1 || *p_end > sbuf.st_size )
+	{
+		*p_end = sbuf.st_size;
+	}
+	if( *p_start < 0 || *p_start > *p_end )
+	{
+		close(fd);
+		ftp_relply(sess,FTP_BADOPTS,"Invalid byte range.");
+		return -1;
+	}
+
+	// 正在写入的范围不计算
+	if( *p_end > *p_start )
+	{
+		int ret = lock_file_read(fd,*p_start,*p_end - *p_start);
+		if( ret == -1 )
+		{
+			close(fd);
+			ftp_relply(sess,lock_busy(ret) ? FTP_FILEBUSY : FTP_FILEFAIL,"File is being written, try again later.");
+			return -1;
+		}
+	}
+
+	int whole = *p_start == 0 && *p_end == sbuf.st_size;
+	if( whole && checksum_cache_get(fd,algo,&sbuf,hex) == 0 )
+	{
+		close(fd);
+		return 0;
+	}
+
+	if( checksum_file(fd,algo,*p_start,*p_end,hex) == -1 )
+	{
+		close(fd);
+		ftp_relply(sess,FTP_BADSENDFILE,"Failure reading local file.");
+		return -1;
+	}
+
+	// 计算期间文件被修改则不缓存
+	struct stat end_buf;
+	if( whole && fstat(fd,&end_buf) == 0 && end_buf.st_mtim.tv_sec == sbuf.st_mtim.tv_sec &&
+		end_buf.st_mtim.tv_nsec == sbuf.st_mtim.tv_nsec && end_buf.st_size == sbuf.st_size )
+	{
+		checksum_cache_put(fd,algo,&sbuf,hex);
+	}
+	close(fd);
+
+	return 0;
+}
+
+// XCRC/XMD5/XSHA1/XSHA256 <path> [<start> [<end>]]，end为结束位置(不含)，
+// 文件名含空格时可以用双引号括起来，回复250 <摘要>
+void  xhash_common(session_t *sess,int algo)
+{
+	char path[MAX_ARG] = {0};
+	long long start = 0;
+	long long end = -1;
+	parse_xhash_arg(sess->cmd_arg,path,&start,&end);
+
+	char hex[CKSUM_HEX_LEN];
+	if( hash_common(sess,path,algo,&start,&end,hex) == -1 )
+	{
+		return;
+	}
+
+	str_upper(hex);
+	ftp_relply(sess,FTP_XHASHOK,hex);
+}
+
+void  parse_xhash_arg(const char *arg,char *path,long long *p_start,long long *p_end)
+{
+	long long range[2];
+	int count = 0;
+	if( arg[0] == '"' )
+	{
+		const char *p_quote = strchr(arg + 1,'"');
+		if( p_quote == NULL )
+		{
+			strcpy(path,arg + 1);
+			return;
+		}
+		strncpy(path,arg + 1,p_quote - arg - 1);
+		count = sscanf(p_quote + 1,"%lld %lld",&range[0],&range[1]);
+	}
+	else
+	{
+		// 没有引号时，整个参数是已存在的文件名则不解析范围，
+		// 否则末尾最多两个数字作为范围(从后往前取出)
+		long long tail[2];
+		strcpy(path,arg);
+		struct stat sbuf;
+		while( count < 2 && stat(path,&sbuf) == -1 )
+		{
+			char *p_space = strrchr(path,' ');
+			if( p_space == NULL || !str_is_number(p_space + 1) )
+			{
+				break;
+			}
+			tail[count++] = str_to_longlong(p_space + 1);
+			*p_space = '\0';
+		}
+		int i;
+		for( i = 0; i < count; ++i )
+		{
+			range[i] = tail[count - 1 - i];
+		}
+	}
+
+	if( count >= 1 )
+	{
+		*p_start = range[0];
+	}
+	if( count == 2 )
+	{
+		*p_end = range[1];
+	}
+}
+
+// transfer_hash设置的算法，未设置或者不支持返回-1
+int   transfer_hash_algo()
+{
+	if( tunable_transfer_hash == NULL )
+	{
+		return -1;
+	}
+
+	return checksum_lookup(tunable_transfer_hash);
+}
+
+// 226 Transfer complete. SHA-256 <摘要>
+void  get_transfer_ok_text(int algo,const char *hex,char *text,unsigned int len)
+{
+	if( algo != -1 && hex[0] != '\0' )
+	{
+		snprintf(text,len,"Transfer complete. %s %s",checksum_name(algo),hex);
+	}
+	else
+	{
+		snprintf(text,len,"Transfer complete.");
+	}
+}
+
+int    get_transfer_fd(session_t *sess)
+{
+	// 块模式下复用上一次传输保留的数据连接，客户端重新发送PORT/PASV时改用新连接
+	if( sess->block_fd != -1 )
+	{
+		struct pollfd pfd;
+		pfd.fd = sess->block_fd;
+		pfd.events = POLLRDHUP;
+		if( !port_active(sess) && !pasv_active(sess) &&
+			!(poll(&pfd,1,0) == 1 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR))) )
+		{
+			sess->data_fd = sess->block_fd;
+			sess->block_fd = -1;
+			start_data_alarm();
+			return 1;
+		}
+		close(sess->block_fd);
+		sess->block_fd = -1;
+	}
+
+	// 检测是否收到port或者pasv命令	
+	if( !port_active(sess) && !pasv_active(sess) )
+	{
+		ftp_relply(sess,FTP_BADSENDCONN,"Use PORT or PASV first.");
+		return 0;
+	}
+	int ret = 1;
+	// port model
+	if( port_active(sess) )
+	{
+		// send to nobody
+		// 不要求源端口为20时由会话进程自己连接，不经过nobody进程
+		if( tunable_connect_from_port_20 && get_port_fd(sess) == 0 )
+		{
+			ret = 0;
+		}
+		else if( !tunable_connect_from_port_20 && connect_port_fd(sess) == 0 )
+		{
+			ret = 0;
+		}
+		 
+	}
+
+	if( pasv_active(sess) )
+	{
+		if( get_pasv_fd(sess) == 0 )
+		{
+			ret = 0;
+		}
+	}
+
+	if( sess->port_addr )
+	{
+		free(sess->port_addr);
+		sess->port_addr = NULL;
+	}
+
+	// start data link alarm
+	if( ret )
+	{
+		start_data_alarm();
+	}
+	else
+	{
+		// 连接失败也要回复，否则客户端一直等待
+		ftp_relply(sess,FTP_BADSENDCONN,"Failed to establish connection.");
 	}
 
 	return ret;
 }
 
+// 命令在建立数据连接之前失败：丢弃PORT地址并关闭PASV监听套接字，
+// 客户端已经发起的数据连接立即被拒绝，不会留到下一次传输。块模式保留的连接不受影响
+void   discard_transfer_fd(session_t *sess)
+{
+	if( sess->port_addr )
+	{
+		free(sess->port_addr);
+		sess->port_addr = NULL;
+	}
+	priv_sock_send_cmd(sess->child_fd,PRIV_SOCK_PASV_CLOSE);
+}
+
 int    port_active(session_t *sess)
 {
 	if( sess->port_addr )
@@ -1145,26 +2310,16 @@ int    pasv_active(session_t *sess)
 	*/
 	priv_sock_send_cmd(sess->child_fd,PRIV_SOCK_PASV_ACTIVE);
 	// pasv listen fd save in nobody process
+	// PORT/EPRT与PASV/EPSV互相清除，两者不会同时有效，由port_active检查
 	int active = priv_sock_get_int(sess->child_fd);
-	if( active )
-	{
-		if( port_active(sess) )
-		{
-			fprintf(stderr, "both port and pasv are active");
-			return 0;
-		}
-		return 1;
-	}
-	return 0;
+	return active ? 1 : 0;
 }
 
 int get_port_fd(session_t *sess)
 {
 	priv_sock_send_cmd(sess->child_fd,PRIV_SOCK_GET_DATA_SOCK);
-	unsigned short port = ntohs(sess->port_addr->sin_port);
-	char *conn_ip = inet_ntoa(sess->port_addr->sin_addr);
-	priv_sock_send_int(sess->child_fd,(int)port);
-	priv_sock_send_buf(sess->child_fd,conn_ip,strlen(conn_ip));
+	// 整个地址结构体，IPv4和IPv6相同
+	priv_sock_send_buf(sess->child_fd,(const char*)sess->port_addr,sizeof(struct sockaddr_storage));
 
 	// would block
 	char result = priv_sock_get_result(sess->child_fd);
@@ -1181,103 +2336,540 @@ int get_port_fd(session_t *sess)
 	return 0;
 }
 
-int    get_pasv_fd(session_t *sess)
+// 从控制连接的本地地址、任意端口非阻塞地连接客户端，
+// 客户端和防火墙看到的数据连接与控制连接来自同一地址
+// PORT/EPRT只能连接控制连接的客户端自己，不能把服务器当作跳板连接其他主机(FTP bounce)
+int    port_addr_allowed(session_t *sess,const struct sockaddr_storage *addr)
 {
-	priv_sock_send_cmd(sess->child_fd,PRIV_SOCK_PASV_ACCEPT);
-	char result = priv_sock_get_result(sess->child_fd);
-	if( result == PRIV_SOCK_RESULT_BAD )
+	struct sockaddr_storage peer;
+	socklen_t peer_len = sizeof(peer);
+	if( getpeername(sess->ctrl_fd,(struct sockaddr*)&peer,&peer_len) == -1 )
 	{
 		return 0;
 	}
-	else if( result == PRIV_SOCK_RESULT_OK )
+	return sockaddr_same_host(addr,&peer);
+}
+
+int    connect_port_fd(session_t *sess)
+{
+	int fd = tcp_client(sess->local_ip,0);
+	if( connect_timeout(fd,sess->port_addr,tunable_connect_timeout) < 0 )
 	{
-		sess->data_fd = priv_sock_recv_fd(sess->child_fd);
-		return 1;
+		close(fd);
+		return 0;
 	}
-	return 0;
+	sess->data_fd = fd;
+	return 1;
 }
 
-int    lock_file_read(int fd)
+// EPSV ALL之后只允许EPSV建立数据连接
+int    reject_after_epsv_all(session_t *sess)
 {
-	return lock_internal(fd,F_RDLCK);
+	if( sess->epsv_all )
+	{
+		ftp_relply(sess,FTP_BADCMD,"Only EPSV is allowed after EPSV ALL.");
+		return 1;
+	}
+	return 0;
 }
 
-int    lock_file_write(int fd)
+// 由nobody进程在控制连接的本地地址上监听(或者从端口池取出)，PORT地址不再使用。
+// 返回端口，没有可用端口返回0
+unsigned short pasv_listen(session_t *sess)
 {
-	return lock_internal(fd,F_WRLCK);
+	if( sess->port_addr )
+	{
+		free(sess->port_addr);
+		sess->port_addr = NULL;
+	}
+	priv_sock_send_cmd(sess->child_fd,PRIV_SOCK_PASV_LISTEN);
+	return (unsigned short)priv_sock_get_int(sess->child_fd);
 }
 
-int   lock_internal(int fd,int lock_type)
+int    get_pasv_fd(session_t *sess)
 {
-	int ret;
-	struct flock the_lock;
-	memset(&the_lock,0,sizeof(the_lock));
-	the_lock.l_type = lock_type;
-	the_lock.l_whence = SEEK_SET;
-	the_lock.l_start = 0;
-	the_lock.l_len = 0;
-	do
+	priv_sock_send_cmd(sess->child_fd,PRIV_SOCK_PASV_ACCEPT);
+	char result = priv_sock_get_result(sess->child_fd);
+	if( result == PRIV_SOCK_RESULT_BAD )
 	{
-		// would interupt by signal
-		ret = fcntl(fd,F_SETLKW,&the_lock);
-	} while(ret < 0 && errno == EINTR);
-
-	return ret;
+		return 0;
+	}
+	else if( result == PRIV_SOCK_RESULT_OK )
+	{
+		sess->data_fd = priv_sock_recv_fd(sess->child_fd);
+		return 1;
+	}
+	return 0;
 }
 
-int   unlock_file(int fd)
+// 传输结束，块模式下文件已经以EOF块结束，keep为1时连接留给下一次传输
+void   close_data_fd(session_t *sess,int keep)
 {
-	int ret;
-	struct flock the_lock;
-	memset(&the_lock,0,sizeof(the_lock));
-
-	the_lock.l_type = F_UNLCK;
-	the_lock.l_whence = SEEK_SET;
-	the_lock.l_start = 0;
-	the_lock.l_len = 0;
-
-	ret = fcntl(fd,F_SETLK,&the_lock);
-
-	return ret;
+	if( keep && sess->block_mode )
+	{
+		sess->block_fd = sess->data_fd;
+	}
+	else
+	{
+		close(sess->data_fd);
+	}
+	sess->data_fd = -1;
 }
 
-void start_cmdio_alarm()
+// 发送目录列表等数据，块模式下作为一个块
+int    send_data(session_t *sess,const char *buf,int len)
 {
-	if( tunable_idle_session_timeout > 0 )
+	if( sess->block_mode && block_send_header(sess->data_fd,0,len) == -1 )
 	{
-		signal(SIGALRM, handle_alarm_timeout);
-		alarm(tunable_idle_session_timeout);
+		return -1;
 	}
+	return writen(sess->data_fd,buf,len);
 }
 
-void handle_alarm_timeout(int sig)
+// 从fd的当前位置发送len字节(块模式下分块)并限速；文件变短时用0补足，
+// 保证与已经发送的tar头部一致。fd为-1时发送len个0
+int    send_file_data(session_t *sess,int fd,long long len)
 {
-	shutdown(p_sess->ctrl_fd,SHUT_RD);
-	ftp_relply(p_sess,FTP_IDLE_TIMEOUT,"Timeout.");
-	shutdown(p_sess->ctrl_fd,SHUT_WR);
-	exit(EXIT_FAILURE);
+	static const char zeros[8*TAR_BLOCK_SIZE];
+	while( len > 0 )
+	{
+		int n = len > BLOCK_MAX_DATA ? BLOCK_MAX_DATA : len;
+		if( sess->block_mode && block_send_header(sess->data_fd,0,n) == -1 )
+		{
+			return -1;
+		}
+		int left = n;
+		while( left > 0 )
+		{
+			int ret = fd == -1 ? 0 : sendfile(sess->data_fd,fd,NULL,left);
+			if( ret == -1 && errno == EINTR && !sess->abor_received )
+			{
+				continue;
+			}
+			if( ret == 0 )
+			{
+				fd = -1;
+				ret = writen(sess->data_fd,zeros,left > (int)sizeof(zeros) ? (int)sizeof(zeros) : left);
+			}
+			if( ret <= 0 )
+			{
+				return -1;
+			}
+			left -= ret;
+			limit_rate(sess,ret,0);
+			if( sess->abor_received )
+			{
+				return -1;
+			}
+		}
+		len -= n;
+	}
+	return 0;
 }
 
-void start_data_alarm()
+// RETR <目录>.tar：目录存在而同名的.tar文件不存在时，即时生成整个目录树的tar流。
+// 不是这种请求返回0，由调用者按普通文件处理
+int    retr_archive(session_t *sess,long long offset)
 {
-	if( tunable_data_connection_timeout > 0 )
+	char dir[MAX_ARG] = {0};
+	int len = strlen(sess->cmd_arg);
+	int compressed = len > 8 && strcmp(sess->cmd_arg + len - 8,".tar.zst") == 0;
+	if( compressed )
 	{
-		signal(SIGALRM,handle_siglarm);
-		alarm(tunable_data_connection_timeout);
+		len -= 8;
 	}
-	else if( tunable_idle_session_timeout > 0 )
+	else if( len > 4 && strcmp(sess->cmd_arg + len - 4,".tar") == 0 )
 	{
-		// close pre ctrl alarm
-		alarm(0);
+		len -= 4;
 	}
-}
-
-void handle_siglarm(int sig)
-{
-	if( p_sess->data_process == 0 )
+	else
 	{
-		ftp_relply(p_sess,FTP_DATA_TIMEOUT,"Data timeout. Reconnect. Sorry.");
-		exit(EXIT_FAILURE);
+		return 0;
+	}
+	memcpy(dir,sess->cmd_arg,len);
+
+	struct stat sbuf;
+	if( stat(dir,&sbuf) == -1 || !S_ISDIR(sbuf.st_mode) )
+	{
+		return 0;
+	}
+	if( compressed )
+	{
+		discard_transfer_fd(sess);
+		ftp_relply(sess,FTP_FILEFAIL,"Compressed directory archives are not supported, use .tar.");
+		return 1;
+	}
+	if( offset != 0 )
+	{
+		discard_transfer_fd(sess);
+		ftp_relply(sess,FTP_FILEFAIL,"Restart is not supported for directory archives.");
+		return 1;
+	}
+
+	// 遍历线程先开始读取目录，同时建立数据连接
+	tar_walker_t tw;
+	if( tar_walker_start(&tw,dir) == -1 )
+	{
+		discard_transfer_fd(sess);
+		ftp_relply(sess,FTP_BADSENDFILE,"Failure reading local directory.");
+		return 1;
+	}
+	if( get_transfer_fd(sess) == 0 )
+	{
+		tar_walker_stop(&tw);
+		return 1;
+	}
+
+	char text[MAX_LINE] = {0};
+	snprintf(text,sizeof(text),"Opening BINARY mode data connection for archive of %.900s",dir);
+	ftp_relply(sess,FTP_DATACONN,text);
+
+	bwclass_transfer_begin(sess,0);
+	// 头部和小文件的内容合并为完整的报文段发送
+	set_tcp_cork(sess->data_fd,1);
+
+	char *header = (char*)malloc(TAR_HEADER_MAX);
+	tar_entry_t entry;
+	int flag = header == NULL ? 1 : 0;
+	while( flag == 0 && tar_walker_next(&tw,&entry) )
+	{
+		char link[PATH_MAX + 1] = {0};
+		int fd = -1;
+		if( S_ISLNK(entry.sbuf.st_mode) )
+		{
+			int link_len = readlink(entry.path,link,PATH_MAX);
+			if( link_len == -1 )
+			{
+				continue;
+			}
+			link[link_len] = '\0';
+		}
+		else if( S_ISREG(entry.sbuf.st_mode) )
+		{
+			// 遍历线程的lstat可能比这里早很多，期间路径可能被替换(如换成符号链接)：
+			// 不跟随符号链接，并确认打开的仍是同一个文件。与RETR一样加读锁，
+			// 加锁后再取大小，头部与发送的内容一致。打不开、已被替换的文件跳过
+			struct stat fd_buf;
+			fd = open(entry.path,O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+			if( fd == -1 )
+			{
+				continue;
+			}
+			if( lock_file_read(fd,0,0) == -1 || fstat(fd,&fd_buf) == -1 || !S_ISREG(fd_buf.st_mode) ||
+				fd_buf.st_dev != entry.sbuf.st_dev || fd_buf.st_ino != entry.sbuf.st_ino )
+			{
+				close(fd);
+				continue;
+			}
+			entry.sbuf = fd_buf;
+			posix_fadvise(fd,0,entry.sbuf.st_size,POSIX_FADV_SEQUENTIAL);
+		}
+
+		int header_len = tar_header(entry.path + tw.name_off,&entry.sbuf,
+			S_ISLNK(entry.sbuf.st_mode) ? link : NULL,header);
+		if( send_data(sess,header,header_len) != header_len )
+		{
+			flag = 2;
+		}
+		else if( fd != -1 )
+		{
+			// 文件内容，按块大小补齐
+			long long size = entry.sbuf.st_size;
+			long long pad = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+			if( send_file_data(sess,fd,size) == -1 || send_file_data(sess,-1,pad) == -1 )
+			{
+				flag = 2;
+			}
+		}
+		if( fd != -1 )
+		{
+			close(fd);
+		}
+		limit_rate(sess,header_len,0);
+		if( sess->abor_received )
+		{
+			flag = 2;
+		}
+	}
+
+	// 归档以两个全0的块结束
+	if( flag == 0 && send_file_data(sess,-1,2 * TAR_BLOCK_SIZE) == -1 )
+	{
+		flag = 2;
+	}
+	tar_walker_stop(&tw);
+	free(header);
+	set_tcp_cork(sess->data_fd,0);
+	if( flag == 0 && sess->block_mode && block_send_eof(sess->data_fd) == -1 )
+	{
+		flag = 2;
+	}
+	bwclass_transfer_end(sess);
+
+	int transfer_ok = flag == 0 && !sess->abor_received;
+	close_data_fd(sess,transfer_ok);
+	if( transfer_ok )
+	{
+		ftp_relply(sess,sess->block_fd != -1 ? FTP_TRANSFERDONE : FTP_TRANSFEROK,"Transfer complete.");
+	}
+	else if( flag == 1 )
+	{
+		ftp_relply(sess,FTP_BADSENDFILE,"Failure reading local directory.");
+	}
+	else
+	{
+		ftp_relply(sess,FTP_BADSENDNET,"Failure writting to network stream.");
+	}
+
+	check_abor(sess);
+	start_cmdio_alarm();
+	return 1;
+}
+
+// 未完成的快照上传保存为同目录下的隐藏文件 .<文件名>.part
+void   get_partial_name(const char *path,char *part_name,unsigned int len)
+{
+	const char *base = strrchr(path,'/');
+	if( base == NULL )
+	{
+		snprintf(part_name,len,".%s.part",path);
+	}
+	else
+	{
+		snprintf(part_name,len,"%.*s/.%s.part",(int)(base - path),path,base + 1);
+	}
+}
+
+// 快照写入使用的私有文件名 .<文件名>.<pid>.<序号>.tmp，同时写同一目标文件的
+// 多个会话互不影响， .part 只用来保存等待续传的部分
+void   get_private_name(const char *path,char *tmp_name,unsigned int len)
+{
+	static unsigned int s_seq = 0;
+	++s_seq;
+	const char *base = strrchr(path,'/');
+	if( base == NULL )
+	{
+		snprintf(tmp_name,len,".%s.%d.%u.tmp",path,(int)getpid(),s_seq);
+	}
+	else
+	{
+		snprintf(tmp_name,len,"%.*s/.%s.%d.%u.tmp",(int)(base - path),path,base + 1,(int)getpid(),s_seq);
+	}
+}
+
+// 优先使用O_TMPFILE(完成前在目录中不可见)，不支持时创建私有文件，
+// tmp_name返回发布时使用的私有文件名
+int    open_private_file(const char *path,char *tmp_name,unsigned int len,int *is_tmpfile)
+{
+	*is_tmpfile = 0;
+	get_private_name(path,tmp_name,len);
+
+#ifdef O_TMPFILE
+	char dir[MAX_LINE] = {0};
+	const char *base = strrchr(path,'/');
+	if( base == NULL )
+	{
+		strcpy(dir,".");
+	}
+	else if( base == path )
+	{
+		strcpy(dir,"/");
+	}
+	else
+	{
+		snprintf(dir,sizeof(dir),"%.*s",(int)(base - path),path);
+	}
+
+	int fd = open(dir,O_TMPFILE | O_WRONLY,0666);
+	if( fd != -1 )
+	{
+		*is_tmpfile = 1;
+		return fd;
+	}
+#endif
+
+	return open(tmp_name,O_CREAT | O_EXCL | O_WRONLY,0666);
+}
+
+// REST+STOR续传：先把 .part 改名为私有文件名，同一时间只有一个会话能续写。
+// .part不存在时返回-1(errno为ENOENT)，offset超过其大小时放回原处并返回-1(errno为EINVAL)
+int    claim_partial_file(const char *path,const char *part_name,char *tmp_name,unsigned int len,long long offset)
+{
+	get_private_name(path,tmp_name,len);
+	if( rename(part_name,tmp_name) == -1 )
+	{
+		return -1;
+	}
+
+	struct stat sbuf;
+	int fd = open(tmp_name,O_WRONLY);
+	if( fd != -1 && fstat(fd,&sbuf) == 0 && S_ISREG(sbuf.st_mode) && offset <= sbuf.st_size )
+	{
+		return fd;
+	}
+
+	if( fd != -1 )
+	{
+		close(fd);
+	}
+	rename(tmp_name,part_name);
+	errno = EINVAL;
+	return -1;
+}
+
+// O_TMPFILE先链接为私有文件名，再原子地改名为dest(目标文件或 .part)。
+// 失败时O_TMPFILE的链接被撤销，可以再次发布
+int    publish_private_file(int fd,int is_tmpfile,const char *tmp_name,const char *dest)
+{
+	if( is_tmpfile )
+	{
+		char proc_path[64] = {0};
+		sprintf(proc_path,"/proc/self/fd/%d",fd);
+		if( linkat(AT_FDCWD,proc_path,AT_FDCWD,tmp_name,AT_SYMLINK_FOLLOW) == -1 )
+		{
+			return -1;
+		}
+	}
+
+	if( rename(tmp_name,dest) == -1 )
+	{
+		int saved_errno = errno;
+		if( is_tmpfile )
+		{
+			unlink(tmp_name);
+		}
+		errno = saved_errno;
+		return -1;
+	}
+	return 0;
+}
+
+// 快照写入没有完成：keep为1时保存为 .part 以便续传，否则丢弃
+void   abandon_private_file(int fd,int is_tmpfile,const char *tmp_name,const char *part_name,int keep)
+{
+	if( keep && publish_private_file(fd,is_tmpfile,tmp_name,part_name) == 0 )
+	{
+		return;
+	}
+	if( !is_tmpfile )
+	{
+		unlink(tmp_name);
+	}
+}
+
+// 删除本次上传新建、还没有写入数据的文件，路径已经指向其他文件时不删除
+void   remove_created_file(int fd,const char *path)
+{
+	struct stat fd_buf;
+	struct stat path_buf;
+	if( fstat(fd,&fd_buf) == 0 && stat(path,&path_buf) == 0 &&
+		fd_buf.st_dev == path_buf.st_dev && fd_buf.st_ino == path_buf.st_ino )
+	{
+		unlink(path);
+	}
+}
+
+int    lock_file_read(int fd,long long start,long long len)
+{
+	return lock_internal(fd,F_RDLCK,start,len);
+}
+
+int    lock_file_write(int fd,long long start,long long len)
+{
+	return lock_internal(fd,F_WRLCK,start,len);
+}
+
+// 锁定[start,start+len)范围，len为0表示一直到文件末尾(包括以后追加的部分)
+// 配置lock_nonblock时范围被占用立即返回-1
+int   lock_internal(int fd,int lock_type,long long start,long long len)
+{
+	int ret;
+	struct flock the_lock;
+	memset(&the_lock,0,sizeof(the_lock));
+	the_lock.l_type = lock_type;
+	the_lock.l_whence = SEEK_SET;
+	the_lock.l_start = start;
+	the_lock.l_len = len;
+	do
+	{
+		// would interupt by signal
+		ret = fcntl(fd,tunable_lock_nonblock ? F_SETLK : F_SETLKW,&the_lock);
+	} while(ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+int   lock_file_trywrite(int fd,long long start,long long len)
+{
+	struct flock the_lock;
+	memset(&the_lock,0,sizeof(the_lock));
+	the_lock.l_type = F_WRLCK;
+	the_lock.l_whence = SEEK_SET;
+	the_lock.l_start = start;
+	the_lock.l_len = len;
+
+	return fcntl(fd,F_SETLK,&the_lock);
+}
+
+// 加锁失败是否因为范围被其他传输占用
+int   lock_busy(int ret)
+{
+	return ret == -1 && ( errno == EAGAIN || errno == EACCES || errno == EDEADLK );
+}
+
+int   unlock_file(int fd)
+{
+	int ret;
+	struct flock the_lock;
+	memset(&the_lock,0,sizeof(the_lock));
+
+	the_lock.l_type = F_UNLCK;
+	the_lock.l_whence = SEEK_SET;
+	the_lock.l_start = 0;
+	the_lock.l_len = 0;
+
+	ret = fcntl(fd,F_SETLK,&the_lock);
+
+	return ret;
+}
+
+void start_cmdio_alarm()
+{
+	if( tunable_idle_session_timeout > 0 )
+	{
+		signal(SIGALRM, handle_alarm_timeout);
+		alarm(tunable_idle_session_timeout);
+	}
+}
+
+void handle_alarm_timeout(int sig)
+{
+	shutdown(p_sess->ctrl_fd,SHUT_RD);
+	ftp_relply(p_sess,FTP_IDLE_TIMEOUT,"Timeout.");
+	shutdown(p_sess->ctrl_fd,SHUT_WR);
+	exit(EXIT_FAILURE);
+}
+
+void start_data_alarm()
+{
+	if( tunable_data_connection_timeout > 0 )
+	{
+		signal(SIGALRM,handle_siglarm);
+		alarm(tunable_data_connection_timeout);
+	}
+	else if( tunable_idle_session_timeout > 0 )
+	{
+		// close pre ctrl alarm
+		alarm(0);
+	}
+}
+
+void handle_siglarm(int sig)
+{
+	if( p_sess->data_process == 0 )
+	{
+		ftp_relply(p_sess,FTP_DATA_TIMEOUT,"Data timeout. Reconnect. Sorry.");
+		exit(EXIT_FAILURE);
 	}
 
 	p_sess->data_process = 0;
@@ -1286,6 +2878,8 @@ void handle_siglarm(int sig)
 
 void handle_sigurg(int sig)
 {
+	// 没有数据连接时(包括SITE TREEHASH等长时间操作期间)不在这里读取，
+	// 命令留在控制连接中，由主循环或者poll_ctrl处理
 	if( p_sess->data_fd == -1 )
 	{
 		return;
@@ -1312,6 +2906,52 @@ void handle_sigurg(int sig)
 	}
 }
 
+// 长时间操作(不使用数据连接)期间检查控制连接：STAT回复进度，ABOR要求取消操作，
+// 其他命令回复繁忙。timeout_ms内没有命令返回0，收到ABOR返回1
+int   poll_ctrl(session_t *sess,int timeout_ms)
+{
+	struct pollfd pfd;
+	pfd.fd = sess->ctrl_fd;
+	pfd.events = POLLIN;
+	if( poll(&pfd,1,timeout_ms) <= 0 )
+	{
+		return 0;
+	}
+
+	char cmdline[MAX_COMMAND_LINE] = {0};
+	int ret = readline(sess->ctrl_fd,cmdline,MAX_COMMAND_LINE);
+	if( ret == -1 )
+		ERR_EXIT("readline");
+	else if( ret == 0 )
+		exit(EXIT_SUCCESS);
+
+	str_trim_crlf(cmdline);
+	char cmd[MAX_COMMAND_LINE] = {0};
+	char arg[MAX_COMMAND_LINE] = {0};
+	str_split(cmdline,cmd,arg,' ');
+	str_upper(cmd);
+
+	if( strcmp(cmd,"ABOR") == 0 || strcmp(cmd,"\377\364\377\362ABOR") == 0 )
+	{
+		sess->abor_received = 1;
+		return 1;
+	}
+	else if( strcmp(cmd,"STAT") == 0 && arg[0] == '\0' )
+	{
+		char text[MAX_LINE] = {0};
+		int percent = sess->op_total > 0 ? (int)(sess->op_done * 100 / sess->op_total) : 0;
+		sprintf(text,"%s in progress: %lld of %lld bytes (%d%%).",sess->op_name,
+			sess->op_done,sess->op_total,percent);
+		ftp_relply(sess,FTP_STATOK,text);
+	}
+	else
+	{
+		ftp_relply(sess,FTP_OPBUSY,"Operation in progress, use STAT or ABOR.");
+	}
+
+	return 0;
+}
+
 void check_abor(session_t *sess)
 {
 	if( sess->abor_received )
@@ -1351,6 +2991,704 @@ void do_site_chmod(session_t *sess,char *chmod_arg)
 }
 
 
+// 工作线程计算树形摘要，会话线程等待期间处理STAT和ABOR
+void do_site_treehash(session_t *sess,char *path)
+{
+	int fd = open(path,O_RDONLY);
+	if( fd == -1 )
+	{
+		ftp_relply(sess,FTP_FILEFAIL,"Open file failed.");
+		return;
+	}
+
+	struct stat sbuf;
+	if( fstat(fd,&sbuf) == -1 || !S_ISREG(sbuf.st_mode) )
+	{
+		close(fd);
+		ftp_relply(sess,FTP_FILEFAIL,"Not a plain file.");
+		return;
+	}
+
+	if( sbuf.st_size > 0 )
+	{
+		int ret = lock_file_read(fd,0,sbuf.st_size);
+		if( ret == -1 )
+		{
+			close(fd);
+			ftp_relply(sess,lock_busy(ret) ? FTP_FILEBUSY : FTP_FILEFAIL,"File is being written, try again later.");
+			return;
+		}
+	}
+
+	tree_hash_t th;
+	if( tree_hash_start(&th,fd,sbuf.st_size,tunable_tree_hash_threads) == -1 )
+	{
+		close(fd);
+		ftp_relply(sess,FTP_BADSENDFILE,"Failure reading local file.");
+		return;
+	}
+
+	// 操作可能超过空闲超时，期间不计时，下一条命令开始时重新计时
+	alarm(0);
+	sess->op_name = "TREEHASH";
+	sess->op_total = sbuf.st_size;
+	int cancel = 0;
+	while( !tree_hash_done(&th) )
+	{
+		sess->op_done = tree_hash_progress(&th);
+		if( poll_ctrl(sess,TREE_HASH_POLL_MS) )
+		{
+			cancel = 1;
+			break;
+		}
+	}
+	sess->op_name = NULL;
+
+	char hex[CKSUM_HEX_LEN];
+	int ret = tree_hash_finish(&th,cancel,hex);
+	close(fd);
+
+	if( cancel )
+	{
+		ftp_relply(sess,FTP_BADSENDNET,"Tree hash aborted.");
+		check_abor(sess);
+		return;
+	}
+	else if( ret == -1 )
+	{
+		ftp_relply(sess,FTP_BADSENDFILE,"Failure reading local file.");
+		return;
+	}
+
+	// 213 SHA-256-TREE <块大小> <摘要> <文件名>
+	char text[MAX_LINE] = {0};
+	snprintf(text,sizeof(text),"SHA-256-TREE %d %s %.900s",TREE_HASH_CHUNK,hex,path);
+	ftp_relply(sess,FTP_HASHOK,text);
+}
+
+// 服务器端复制的源文件，与RNFR/RNTO一样分两步给出
+void do_site_cpfr(session_t *sess,char *path)
+{
+	struct stat sbuf;
+	if( stat(path,&sbuf) == -1 || !S_ISREG(sbuf.st_mode) )
+	{
+		ftp_relply(sess,FTP_FILEFAIL,"Not a plain file.");
+		return;
+	}
+
+	if( sess->cpfr_name )
+	{
+		free(sess->cpfr_name);
+	}
+	sess->cpfr_name = strdup(path);
+	ftp_relply(sess,FTP_RNFROK,"File exists, ready for destination name.");
+}
+
+// 复制到临时文件，完成后原子地替换目标文件，中途取消或失败不留下半个文件
+void do_site_cpto(session_t *sess,char *path)
+{
+	if( sess->cpfr_name == NULL )
+	{
+		ftp_relply(sess,FTP_NEEDRNFR,"SITE CPFR required first.");
+		return;
+	}
+
+	int src_fd = open(sess->cpfr_name,O_RDONLY);
+	free(sess->cpfr_name);
+	sess->cpfr_name = NULL;
+	if( src_fd == -1 )
+	{
+		ftp_relply(sess,FTP_FILEFAIL,"Open file failed.");
+		return;
+	}
+
+	struct stat sbuf;
+	if( fstat(src_fd,&sbuf) == -1 || !S_ISREG(sbuf.st_mode) )
+	{
+		close(src_fd);
+		ftp_relply(sess,FTP_FILEFAIL,"Not a plain file.");
+		return;
+	}
+
+	if( sbuf.st_size > 0 )
+	{
+		int ret = lock_file_read(src_fd,0,sbuf.st_size);
+		if( ret == -1 )
+		{
+			close(src_fd);
+			ftp_relply(sess,lock_busy(ret) ? FTP_FILEBUSY : FTP_FILEFAIL,"File is being written, try again later.");
+			return;
+		}
+	}
+
+	// 使用私有临时文件，不影响其他会话等待续传的 .part
+	char tmp_name[MAX_LINE] = {0};
+	int is_tmpfile;
+	int dst_fd = open_private_file(path,tmp_name,sizeof(tmp_name),&is_tmpfile);
+	if( dst_fd == -1 )
+	{
+		close(src_fd);
+		ftp_relply(sess,FTP_FILEFAIL,"Could not create file.");
+		return;
+	}
+
+	// 操作可能超过空闲超时，期间不计时，下一条命令开始时重新计时
+	alarm(0);
+	sess->op_name = "COPY";
+	sess->op_total = sbuf.st_size;
+	sess->op_done = 0;
+	int cancel = 0;
+	int ret = 0;
+	if( sbuf.st_size > 0 && file_clone(src_fd,dst_fd) == 0 )
+	{
+		sess->op_done = sbuf.st_size;
+	}
+	else
+	{
+		ret = copy_file_data(sess,src_fd,dst_fd,0,sbuf.st_size);
+		if( ret == 1 )
+		{
+			cancel = 1;
+			ret = 0;
+		}
+	}
+	sess->op_name = NULL;
+	close(src_fd);
+
+	// 与上传一样按upload_durability刷盘后才回复
+	if( !cancel && ret == 0 )
+	{
+		ret = durability_sync(dst_fd);
+	}
+	if( !cancel && ret == 0 )
+	{
+		ret = publish_private_file(dst_fd,is_tmpfile,tmp_name,path);
+	}
+	if( !cancel && ret == 0 )
+	{
+		ret = durability_sync_dir(path);
+	}
+	int no_space = (ret == -1 && errno == ENOSPC);
+	if( cancel || ret == -1 )
+	{
+		abandon_private_file(dst_fd,is_tmpfile,tmp_name,NULL,0);
+	}
+	close(dst_fd);
+
+	if( cancel )
+	{
+		ftp_relply(sess,FTP_BADSENDNET,"Copy aborted.");
+		check_abor(sess);
+	}
+	else if( ret == -1 )
+	{
+		ftp_relply(sess,no_space ? FTP_NOSPACE : FTP_FILEFAIL,"Copy operation failed.");
+	}
+	else
+	{
+		ftp_relply(sess,FTP_RENAMEOK,"Copy successful.");
+	}
+}
+
+// 按顺序把各部分拼接为目标文件，成功后删除各部分。
+// 并行上传的各部分通常按块大小对齐，文件系统支持时用FICLONERANGE共享数据块
+void do_site_concat(session_t *sess,char *arg)
+{
+	char names[MAX_ARG] = {0};
+	char *parts[CONCAT_MAX_PARTS + 1];
+	int count = 0;
+	char *p_name = names;
+	const char *p_arg = arg;
+	while( count <= CONCAT_MAX_PARTS
+		&& (p_arg = str_next_word(p_arg,p_name,names + sizeof(names) - p_name)) != NULL )
+	{
+		parts[count++] = p_name;
+		p_name += strlen(p_name) + 1;
+	}
+	if( count < 2 || count > CONCAT_MAX_PARTS )
+	{
+		char text[MAX_LINE] = {0};
+		sprintf(text,"SITE CONCAT needs a target and 1 to %d parts.",CONCAT_MAX_PARTS - 1);
+		ftp_relply(sess,FTP_BADCMD,text);
+		return;
+	}
+
+	// 第一个是目标文件，先打开并锁定所有部分，确认都可以读取
+	const char *path = parts[0];
+	int fds[CONCAT_MAX_PARTS];
+	long long sizes[CONCAT_MAX_PARTS];
+	long long total = 0;
+	int i;
+	for( i = 1; i < count; ++i )
+	{
+		struct stat sbuf;
+		int ret = -1;
+		fds[i] = open(parts[i],O_RDONLY);
+		if( fds[i] != -1 && fstat(fds[i],&sbuf) == 0 && S_ISREG(sbuf.st_mode) )
+		{
+			ret = sbuf.st_size > 0 ? lock_file_read(fds[i],0,sbuf.st_size) : 0;
+		}
+		if( ret == -1 )
+		{
+			int busy = lock_busy(ret);
+			if( fds[i] != -1 )
+			{
+				close(fds[i]);
+			}
+			while( --i > 0 )
+			{
+				close(fds[i]);
+			}
+			ftp_relply(sess,busy ? FTP_FILEBUSY : FTP_FILEFAIL,"Could not open part file.");
+			return;
+		}
+		sizes[i] = sbuf.st_size;
+		total += sbuf.st_size;
+	}
+
+	// 使用私有临时文件，不影响其他会话等待续传的 .part
+	char tmp_name[MAX_LINE] = {0};
+	int is_tmpfile;
+	int dst_fd = open_private_file(path,tmp_name,sizeof(tmp_name),&is_tmpfile);
+	if( dst_fd == -1 )
+	{
+		for( i = 1; i < count; ++i )
+		{
+			close(fds[i]);
+		}
+		ftp_relply(sess,FTP_FILEFAIL,"Could not create file.");
+		return;
+	}
+
+	// 操作可能超过空闲超时，期间不计时，下一条命令开始时重新计时
+	alarm(0);
+	sess->op_name = "CONCAT";
+	sess->op_total = total;
+	sess->op_done = 0;
+	int cancel = 0;
+	int ret = 0;
+	long long dst_off = 0;
+	for( i = 1; i < count && ret == 0; ++i )
+	{
+		if( sizes[i] > 0 && file_clone_range(fds[i],0,sizes[i],dst_fd,dst_off) == 0 )
+		{
+			sess->op_done += sizes[i];
+			if( poll_ctrl(sess,0) )
+			{
+				ret = 1;
+			}
+		}
+		else
+		{
+			ret = copy_file_data(sess,fds[i],dst_fd,dst_off,sizes[i]);
+		}
+		dst_off += sizes[i];
+	}
+	sess->op_name = NULL;
+	for( i = 1; i < count; ++i )
+	{
+		close(fds[i]);
+	}
+	if( ret == 1 )
+	{
+		cancel = 1;
+		ret = 0;
+	}
+
+	if( !cancel && ret == 0 )
+	{
+		ret = durability_sync(dst_fd);
+	}
+	if( !cancel && ret == 0 )
+	{
+		ret = publish_private_file(dst_fd,is_tmpfile,tmp_name,path);
+	}
+	if( !cancel && ret == 0 )
+	{
+		ret = durability_sync_dir(path);
+	}
+	int no_space = (ret == -1 && errno == ENOSPC);
+	if( cancel || ret == -1 )
+	{
+		abandon_private_file(dst_fd,is_tmpfile,tmp_name,NULL,0);
+	}
+	close(dst_fd);
+
+	if( cancel )
+	{
+		ftp_relply(sess,FTP_BADSENDNET,"Concatenation aborted.");
+		check_abor(sess);
+		return;
+	}
+	else if( ret == -1 )
+	{
+		ftp_relply(sess,no_space ? FTP_NOSPACE : FTP_FILEFAIL,"Concatenation failed.");
+		return;
+	}
+
+	// 目标文件也可以作为第一部分(追加)，这时不能删除
+	for( i = 1; i < count; ++i )
+	{
+		if( strcmp(parts[i],path) != 0 )
+		{
+			unlink(parts[i]);
+		}
+	}
+	ftp_relply(sess,FTP_RENAMEOK,"Concatenation successful.");
+}
+
+// 在内核中把src_fd的[0,len)复制到dst_fd的dst_off处，每块之间处理STAT/ABOR并更新进度
+// 成功返回0，失败返回-1，收到ABOR返回1
+int   copy_file_data(session_t *sess,int src_fd,int dst_fd,long long dst_off,long long len)
+{
+	long long src_off = 0;
+	while( src_off < len )
+	{
+		long long n = len - src_off;
+		if( n > FILE_COPY_CHUNK )
+		{
+			n = FILE_COPY_CHUNK;
+		}
+		n = file_copy_chunk(src_fd,&src_off,dst_fd,&dst_off,n);
+		if( n <= 0 )
+		{
+			return -1;
+		}
+		sess->op_done += n;
+		if( poll_ctrl(sess,0) )
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// 增量同步第一步：计算(或者从边车文件取得)块签名，然后通过数据连接发送。
+// 计算可能很慢，在建立数据连接之前进行，期间处理STAT和ABOR
+void do_site_sigs(session_t *sess,char *arg)
+{
+	char size_str[MAX_ARG] = {0};
+	char path[MAX_ARG] = {0};
+	str_split(arg,size_str,path,' ');
+	int block_size = str_is_number(size_str) && strlen(size_str) < 10 ? atoi(size_str) : 0;
+	if( path[0] == '\0' || block_size < DELTA_MIN_BLOCK || block_size > DELTA_MAX_BLOCK )
+	{
+		char text[MAX_LINE] = {0};
+		sprintf(text,"SITE SIGS needs a block size (%d-%d) and a file.",DELTA_MIN_BLOCK,DELTA_MAX_BLOCK);
+		ftp_relply(sess,FTP_BADOPTS,text);
+		return;
+	}
+
+	int fd = open(path,O_RDONLY);
+	if( fd == -1 )
+	{
+		ftp_relply(sess,FTP_FILEFAIL,"Open file failed.");
+		return;
+	}
+	struct stat sbuf;
+	if( fstat(fd,&sbuf) == -1 || !S_ISREG(sbuf.st_mode) )
+	{
+		close(fd);
+		ftp_relply(sess,FTP_FILEFAIL,"Not a plain file.");
+		return;
+	}
+	if( sbuf.st_size > 0 )
+	{
+		int ret = lock_file_read(fd,0,sbuf.st_size);
+		if( ret == -1 )
+		{
+			close(fd);
+			ftp_relply(sess,lock_busy(ret) ? FTP_FILEBUSY : FTP_FILEFAIL,"File is being written, try again later.");
+			return;
+		}
+	}
+
+	// 操作可能超过空闲超时，期间不计时
+	alarm(0);
+	sess->op_name = "SIGS";
+	sess->op_total = sbuf.st_size;
+	sess->op_done = 0;
+	long long sig_off;
+	int sig_fd = delta_sig_open(fd,path,&sbuf,block_size,sigs_progress,sess,&sig_off);
+	sess->op_name = NULL;
+	close(fd);
+	if( sig_fd == -1 )
+	{
+		if( sess->abor_received )
+		{
+			ftp_relply(sess,FTP_BADSENDNET,"Signature computation aborted.");
+			check_abor(sess);
+		}
+		else
+		{
+			ftp_relply(sess,FTP_BADSENDFILE,"Failure computing signatures.");
+		}
+		start_cmdio_alarm();
+		return;
+	}
+
+	if( get_transfer_fd(sess) == 0 )
+	{
+		close(sig_fd);
+		return;
+	}
+
+	long long blocks = (sbuf.st_size + block_size - 1) / block_size;
+	char text[MAX_LINE] = {0};
+	snprintf(text,sizeof(text),"Opening BINARY mode data connection for signatures of %.900s (%lld blocks of %d bytes)",
+		path,blocks,block_size);
+	ftp_relply(sess,FTP_DATACONN,text);
+
+	int flag = 0;
+	if( lseek(sig_fd,sig_off,SEEK_SET) == -1 )
+	{
+		flag = 1;
+	}
+	else if( send_file_data(sess,sig_fd,blocks * DELTA_SIG_LEN) == -1 ||
+		(sess->block_mode && block_send_eof(sess->data_fd) == -1) )
+	{
+		flag = 2;
+	}
+	close(sig_fd);
+
+	int transfer_ok = flag == 0 && !sess->abor_received;
+	close_data_fd(sess,transfer_ok);
+	if( transfer_ok )
+	{
+		ftp_relply(sess,sess->block_fd != -1 ? FTP_TRANSFERDONE : FTP_TRANSFEROK,"Transfer complete.");
+	}
+	else if( flag == 1 )
+	{
+		ftp_relply(sess,FTP_BADSENDFILE,"Failure reading signatures.");
+	}
+	else
+	{
+		ftp_relply(sess,FTP_BADSENDNET,"Failure writting to network stream.");
+	}
+	check_abor(sess);
+	start_cmdio_alarm();
+}
+
+// 签名计算的进度，收到ABOR时取消
+int   sigs_progress(void *arg,long long done)
+{
+	session_t *sess = (session_t*)arg;
+	sess->op_done = done;
+	return poll_ctrl(sess,0);
+}
+
+// 增量同步第二步：接收指令流，未改变的部分在内核中从旧文件复制(支持时共享数据块)，
+// 新文件写入临时文件，完成后原子地替换旧文件
+void do_site_delta(session_t *sess,char *path)
+{
+	int basis_fd = open(path,O_RDONLY);
+	if( basis_fd == -1 )
+	{
+		ftp_relply(sess,FTP_FILEFAIL,"Open file failed.");
+		return;
+	}
+	struct stat sbuf;
+	if( fstat(basis_fd,&sbuf) == -1 || !S_ISREG(sbuf.st_mode) )
+	{
+		close(basis_fd);
+		ftp_relply(sess,FTP_FILEFAIL,"Not a plain file.");
+		return;
+	}
+	if( sbuf.st_size > 0 )
+	{
+		int ret = lock_file_read(basis_fd,0,sbuf.st_size);
+		if( ret == -1 )
+		{
+			close(basis_fd);
+			ftp_relply(sess,lock_busy(ret) ? FTP_FILEBUSY : FTP_FILEFAIL,"File is being written, try again later.");
+			return;
+		}
+	}
+
+	// 使用私有临时文件，不影响其他会话等待续传的 .part
+	char tmp_name[MAX_LINE] = {0};
+	int is_tmpfile;
+	int fd = open_private_file(path,tmp_name,sizeof(tmp_name),&is_tmpfile);
+	if( fd == -1 )
+	{
+		close(basis_fd);
+		ftp_relply(sess,FTP_UPLOADFAIL,"Could not create file.");
+		return;
+	}
+	fchmod(fd,sbuf.st_mode & 07777);
+
+	if( get_transfer_fd(sess) == 0 )
+	{
+		abandon_private_file(fd,is_tmpfile,tmp_name,NULL,0);
+		close(fd);
+		close(basis_fd);
+		return;
+	}
+
+	char text[MAX_LINE] = {0};
+	snprintf(text,sizeof(text),"Opening BINARY mode data connection for delta of %.900s",path);
+	ftp_relply(sess,FTP_DATACONN,text);
+
+	// flag: 1 写盘失败，2 网络失败，3 指令流无效
+	int flag = 0;
+	long long write_pos = 0;
+	long long copied = 0;
+	long long literal = 0;
+	char buf[BLOCK_MAX_DATA];
+	block_reader_t br;
+	block_reader_init(&br,sess->data_fd);
+	while( flag == 0 )
+	{
+		unsigned char op;
+		if( recv_full(sess,&br,&op,1) == -1 )
+		{
+			flag = 2;
+			break;
+		}
+
+		if( op == DELTA_OP_COPY )
+		{
+			uint64_t args[2];
+			if( recv_full(sess,&br,args,sizeof(args)) == -1 )
+			{
+				flag = 2;
+				break;
+			}
+			long long off = be64toh(args[0]);
+			long long len = be64toh(args[1]);
+			if( off < 0 || len < 0 || off > sbuf.st_size || len > sbuf.st_size - off )
+			{
+				flag = 3;
+				break;
+			}
+			// 新旧位置都按块对齐时共享数据块，否则在内核中复制
+			if( len > 0 && file_clone_range(basis_fd,off,len,fd,write_pos) == 0 )
+			{
+				write_pos += len;
+			}
+			else
+			{
+				long long end = write_pos + len;
+				while( write_pos < end )
+				{
+					long long n = end - write_pos > FILE_COPY_CHUNK ? FILE_COPY_CHUNK : end - write_pos;
+					if( file_copy_chunk(basis_fd,&off,fd,&write_pos,n) <= 0 )
+					{
+						flag = 1;
+						break;
+					}
+				}
+			}
+			copied += len;
+		}
+		else if( op == DELTA_OP_LITERAL )
+		{
+			uint32_t arg;
+			if( recv_full(sess,&br,&arg,sizeof(arg)) == -1 )
+			{
+				flag = 2;
+				break;
+			}
+			long long len = ntohl(arg);
+			while( len > 0 && flag == 0 )
+			{
+				int n = len > (long long)sizeof(buf) ? (int)sizeof(buf) : len;
+				if( recv_full(sess,&br,buf,n) == -1 )
+				{
+					flag = 2;
+				}
+				else if( pwrite(fd,buf,n,write_pos) != n )
+				{
+					flag = 1;
+				}
+				write_pos += n;
+				literal += n;
+				len -= n;
+			}
+		}
+		else if( op == DELTA_OP_END )
+		{
+			// 块模式下读到EOF块，连接才能用于下一次传输
+			if( sess->block_mode && recv_full(sess,&br,buf,1) != -1 )
+			{
+				flag = 3;
+			}
+			break;
+		}
+		else
+		{
+			flag = 3;
+		}
+	}
+	int no_space = (flag == 1 && errno == ENOSPC);
+	close(basis_fd);
+
+	if( flag == 0 && !sess->abor_received )
+	{
+		if( durability_sync(fd) == -1 || publish_private_file(fd,is_tmpfile,tmp_name,path) == -1 )
+		{
+			flag = 1;
+		}
+	}
+	if( flag != 0 || sess->abor_received )
+	{
+		abandon_private_file(fd,is_tmpfile,tmp_name,NULL,0);
+	}
+	else if( durability_sync_dir(path) == -1 )
+	{
+		flag = 1;
+	}
+	close(fd);
+
+	int transfer_ok = flag == 0 && !sess->abor_received;
+	close_data_fd(sess,transfer_ok);
+	if( transfer_ok )
+	{
+		snprintf(text,sizeof(text),"Delta applied: %lld bytes copied, %lld bytes received.",copied,literal);
+		ftp_relply(sess,sess->block_fd != -1 ? FTP_TRANSFERDONE : FTP_TRANSFEROK,text);
+	}
+	else if( flag == 1 )
+	{
+		ftp_relply(sess,no_space ? FTP_NOSPACE : FTP_BADSENDFILE,"Failure writing to local file.");
+	}
+	else if( flag == 3 )
+	{
+		ftp_relply(sess,FTP_BADSENDFILE,"Invalid delta stream.");
+	}
+	else
+	{
+		ftp_relply(sess,FTP_BADSENDNET,"Failure reading network stream.");
+	}
+	check_abor(sess);
+	start_cmdio_alarm();
+}
+
+// 从数据连接读取len字节，块模式下去掉块头并忽略重启标记；连接提前结束或者出错返回-1
+int   recv_full(session_t *sess,block_reader_t *br,void *buf,int len)
+{
+	char *p = (char*)buf;
+	while( len > 0 )
+	{
+		int ret = sess->block_mode ? block_read(br,p,len) : read(sess->data_fd,p,len);
+		if( ret == BLOCK_GOT_MARK || (ret == -1 && errno == EINTR && !sess->abor_received) )
+		{
+			continue;
+		}
+		if( ret <= 0 )
+		{
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+		limit_rate(sess,ret,1);
+		if( sess->abor_received )
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
 void do_site_umask(session_t *sess,char *umask_arg)
 {
 	// umask <param>
@@ -10,7 +10,7 @@ typedef struct ftpcmd
 } ftpcmd_t ;
 
 void handle_child(session_t *sess);
-int    list_common(session_t *sess,int detail);
+int    list_common(session_t *sess,DIR *dir,int detail);
 void upload_common(session_t *sess,int is_append);
 
 void ftp_relply(session_t *sess,int status,const char *text);
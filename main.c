@@ -7,6 +7,11 @@
 #include "ftpcodes.h"
 #include "ftpproto.h"
 #include "hash.h"
+#include "ratelimit.h"
+#include "bwclass.h"
+#include "prefetch.h"
+#include "durability.h"
+#include "pasvpool.h"
 
 extern session_t *p_sess;
 static unsigned int s_children;
@@ -14,11 +19,12 @@ static unsigned int s_children;
 static hash_t *s_ip_count_hash;
 static hash_t *s_pid_ip_hash;
 
-void check_limits(session_t *sess);
+int check_limits(session_t *sess,int fd);
 void handle_sigchld(int sig);
 unsigned int hash_func(unsigned int,void *);
-unsigned int handle_ip_count(unsigned int *ip);
-void drop_ip_count(unsigned int *ip);
+unsigned int ip_hash_func(unsigned int,void *);
+unsigned int handle_ip_count(struct in6_addr *ip);
+void drop_ip_count(struct in6_addr *ip);
 
 int main(int argc,char *argv[])
 {
@@ -99,39 +105,101 @@ int main(int argc,char *argv[])
 	daemon(0,0);
 
 	s_children = 0;
-	s_ip_count_hash =  hash_alloc(IP_COUNT_BUCKETS,hash_func);
+	s_ip_count_hash =  hash_alloc(IP_COUNT_BUCKETS,ip_hash_func);
 	s_pid_ip_hash = hash_alloc(PID_IP_COUNT,hash_func);
 	signal(SIGCHLD,handle_sigchld);
+
+	// 共享令牌桶需在fork之前分配
+	ratelimit_init();
+	bwclass_init();
+	prefetch_init();
+	durability_init();
 	
 	int listenfd = tcp_server(tunable_listen_adress,tunable_listen_port);
+	// 客户端可以在SYN中携带数据(如USER命令)，省去一个往返。
+	// FTP由服务器先发送欢迎信息，TCP_DEFER_ACCEPT会让连接一直等待客户端，不使用
+	if( tunable_tcp_fastopen > 0 )
+	{
+		int qlen = tunable_tcp_fastopen;
+		setsockopt(listenfd,IPPROTO_TCP,TCP_FASTOPEN,&qlen,sizeof(qlen));
+	}
+	// 被动模式端口池由所有会话继承
+	pasv_pool_init();
 	
 	session_t sess = {-1,-1,"","","",-1,-1,0,NULL,-1,
-		-1,0,0,NULL,0,0,0,0,0,0,0};
+		-1,0,0,NULL,0,0,0,0,0};
 	
 	p_sess = &sess;
 	
 	sess.bw_upload_rate_max = tunable_upload_max_rate;
 	sess.bw_download_rate_max = tunable_download_max_rate;
+	sess.bw_transfer_slot = -1;
+	sess.prefetch_fd = -1;
+	sess.block_fd = -1;
+
+	// 监听套接字设为非阻塞，每次唤醒后一直accept到没有等待的连接为止。
+	// SIGCHLD平时阻塞，只在ppoll等待期间处理，信号处理函数对连接计数和
+	// 哈希表的修改不会与下面的修改交错
+	activate_nonblock(listenfd);
+	sigset_t chld_mask;
+	sigset_t orig_mask;
+	sigemptyset(&chld_mask);
+	sigaddset(&chld_mask,SIGCHLD);
+	sigprocmask(SIG_BLOCK,&chld_mask,&orig_mask);
 
 	pid_t pid;
+	// 连续accept到的连接数，0表示等待队列已经取空
+	unsigned int batch = 0;
 	for( ; ; )
 	{
-		struct sockaddr_in client_addr;
-		bzero(&client_addr,sizeof(struct sockaddr_in));
-
-		// 时间设置为0,阻塞接收连接
-		int connfd = accept_timeout(listenfd,&client_addr,0);
-		
-		unsigned int client_ip = client_addr.sin_addr.s_addr;
+		// 队列取空后阻塞等待；连续accept了ACCEPT_BATCH个连接后不等待，
+		// 只让挂起的SIGCHLD得到处理，持续的连接风暴中计数也能及时减少
+		if( batch == 0 || batch >= ACCEPT_BATCH )
+		{
+			struct timespec zero = {0,0};
+			struct pollfd pfd;
+			pfd.fd = listenfd;
+			pfd.events = POLLIN;
+			int ret = ppoll(&pfd,1,batch == 0 ? NULL : &zero,&orig_mask);
+			batch = 0;
+			if( ret <= 0 )
+				continue;
+		}
 
-		 sess.num_this_ip = handle_ip_count(&client_ip);
+		struct sockaddr_storage client_addr;
+		socklen_t addrlen = sizeof(client_addr);
+		// 接受的连接不继承监听套接字的O_NONBLOCK
+		int connfd = accept(listenfd,(struct sockaddr*)&client_addr,&addrlen);
 
 		if( connfd == -1 )
+		{
+			// 描述符用尽时稍后再试，避免ppoll立即返回而空转
+			if( errno == EMFILE || errno == ENFILE )
+				nano_sleep(0.01);
+			batch = 0;
 			continue;
+		}
+		++batch;
+
+		// 按来源地址计数，IPv4客户端(双栈监听时为映射地址)按地址，IPv6客户端按/64前缀
+		struct in6_addr client_ip;
+		unsigned int rl_ip = sockaddr_client_key(&client_addr,&client_ip);
+		sess.ipv6 = sockaddr_is_v6(&client_addr);
+
+		 sess.num_this_ip = handle_ip_count(&client_ip);
 
 		++s_children;
 		sess.num_clients = s_children;
 
+		// 超过限制的连接在主进程中直接回复421并关闭，不需要fork
+		if( check_limits(&sess,connfd) )
+		{
+			drop_ip_count(&client_ip);
+			--s_children;
+			close(connfd);
+			continue;
+		}
+
 		// 创建子进程
 		pid = fork();
 		switch(pid)
@@ -139,8 +207,10 @@ int main(int argc,char *argv[])
 			case 0:
 				// 子进程关闭listenfd，避免出现“惊群效应”
 				close(listenfd);
+				sigprocmask(SIG_SETMASK,&orig_mask,NULL);
 				sess.ctrl_fd = connfd;
-				check_limits(&sess);
+				ratelimit_attach_ip(&sess,rl_ip);
+				bwclass_classify(&sess,NULL);
 				signal(SIGCHLD,SIG_IGN);
 				begin_session(&sess);
 				break;
@@ -159,21 +229,26 @@ int main(int argc,char *argv[])
 	return EXIT_SUCCESS;
 }
 
-void check_limits(session_t *sess)
+// 在主进程中调用，超过限制时回复421并返回1。发送不阻塞，
+// 不读取数据的客户端不会卡住accept循环，对方已经关闭时也不会产生SIGPIPE
+int check_limits(session_t *sess,int fd)
 {
+	char buf[MAX_LINE] = {0};
 	if( tunable_max_clients > 0 && sess->num_clients > tunable_max_clients )
 	{	
-		ftp_relply(sess,FTP_TOO_MANY_USERS,"There are too many connected users,please try later.");
-
-		exit(EXIT_FAILURE);
+		sprintf(buf,"%d There are too many connected users,please try later.\r\n",FTP_TOO_MANY_USERS);
 	}
-
-	if( tunable_max_per_ip > 0 && sess->num_this_ip > tunable_max_per_ip )
+	else if( tunable_max_per_ip > 0 && sess->num_this_ip > tunable_max_per_ip )
 	{
-		ftp_relply(sess,FTP_IP_LIMIT,"There are too many connections,from your internet address");
+		sprintf(buf,"%d There are too many connections,from your internet address\r\n",FTP_IP_LIMIT);
+	}
 
-		exit(EXIT_FAILURE);
+	if( buf[0] == '\0' )
+	{
+		return 0;
 	}
+	send(fd,buf,strlen(buf),MSG_DONTWAIT | MSG_NOSIGNAL);
+	return 1;
 }
 
 void handle_sigchld(int sig)
@@ -181,15 +256,18 @@ void handle_sigchld(int sig)
 	pid_t pid;
 	while( (pid = waitpid(-1,NULL,WNOHANG)) > 0 )
 	{
-		unsigned int *ip = hash_lookup_entry(s_pid_ip_hash,&pid,sizeof(pid));
+		// 会话的nobody进程是主进程的子进程，异常退出时没有归还的被动端口在这里归还
+		pasv_pool_reap(pid);
+
+		struct in6_addr *ip = hash_lookup_entry(s_pid_ip_hash,&pid,sizeof(pid));
 		if( ip == NULL )
 			continue;
 
 		drop_ip_count(ip);
 		hash_free_entry(s_pid_ip_hash,&pid,sizeof(pid))	;
+		// 多个子进程退出时SIGCHLD可能只递送一次，按回收的会话计数
+		--s_children;
 	}	
-
-	--s_children;
 }
 
 unsigned int hash_func(unsigned int buckets,void *key)
@@ -199,18 +277,26 @@ unsigned int hash_func(unsigned int buckets,void *key)
 	return (*number) % buckets;
 }
 
-unsigned int handle_ip_count(unsigned int *ip)
+// 16字节的地址，各个32位字异或后取模
+unsigned int ip_hash_func(unsigned int buckets,void *key)
+{
+	struct in6_addr *ip = (struct in6_addr *)key;
+
+	return (ip->s6_addr32[0] ^ ip->s6_addr32[1] ^ ip->s6_addr32[2] ^ ip->s6_addr32[3]) % buckets;
+}
+
+unsigned int handle_ip_count(struct in6_addr *ip)
 {
 	// 当一个客户登录时，先在s_ip_count_hash更新这个表中的对应的
 	// 表项，即该ip对应的连接数+1,如果这个表项不存在，则在表中添加
 	// 一条记录，并且将ip对应的连接数置为1
 	unsigned int count;
-	unsigned int *p_count = (unsigned int *)hash_lookup_entry(s_ip_count_hash,ip,sizeof(unsigned int));
+	unsigned int *p_count = (unsigned int *)hash_lookup_entry(s_ip_count_hash,ip,sizeof(struct in6_addr));
 
 	if( p_count == NULL )
 	{
 		count = 1;
-		hash_add_entry(s_ip_count_hash,ip,sizeof(unsigned int),&count,sizeof(unsigned int));
+		hash_add_entry(s_ip_count_hash,ip,sizeof(struct in6_addr),&count,sizeof(unsigned int));
 	}
 	else
 	{
@@ -221,10 +307,10 @@ unsigned int handle_ip_count(unsigned int *ip)
 	return count;
 }
 
-void drop_ip_count(unsigned int *ip)
+void drop_ip_count(struct in6_addr *ip)
 {
 	unsigned int count;
-	unsigned int *p_count = (unsigned int *)hash_lookup_entry(s_ip_count_hash,ip,sizeof(unsigned int));
+	unsigned int *p_count = (unsigned int *)hash_lookup_entry(s_ip_count_hash,ip,sizeof(struct in6_addr));
 
 	if( p_count == NULL )
 	{
@@ -240,6 +326,6 @@ void drop_ip_count(unsigned int *ip)
 	
 	if( count == 0 )
 	{
-		hash_free_entry(s_ip_count_hash,ip,sizeof(unsigned int));
+		hash_free_entry(s_ip_count_hash,ip,sizeof(struct in6_addr));
 	}
 }
\ No newline at end of file
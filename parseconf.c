@@ -2,11 +2,17 @@
 #include "common.h"
 #include "tunable.h"
 #include "str.h"
+#include "bwclass.h"
 
 static struct parseconf_bool_setting parseconf_bool_array[] = 
 {
 	{ "pasv_enable",	&tunable_pasv_enable },
 	{ "port_enable",		&tunable_port_enable },
+	{ "pacing_enable",	&tunable_pacing_enable },
+	{ "lock_nonblock",	&tunable_lock_nonblock },
+	{ "upload_snapshot",	&tunable_upload_snapshot },
+	{ "allo_check_space",	&tunable_allo_check_space },
+	{ "connect_from_port_20",&tunable_connect_from_port_20 },
 	{  NULL,		NULL }
 };
 
@@ -22,12 +28,40 @@ static struct parseconf_uint_setting parseconf_uint_array[] =
 	{ "local_umask",	&tunable_local_umask },
 	{ "upload_max_rate",	&tunable_upload_max_rate},
 	{ "download_max_rate",&tunable_download_max_rate},
+	{ "user_upload_max_rate",	&tunable_user_upload_max_rate},
+	{ "user_download_max_rate",&tunable_user_download_max_rate},
+	{ "ip_upload_max_rate",	&tunable_ip_upload_max_rate},
+	{ "ip_download_max_rate",	&tunable_ip_download_max_rate},
+	{ "global_upload_max_rate",&tunable_global_upload_max_rate},
+	{ "global_download_max_rate",&tunable_global_download_max_rate},
+	{ "readahead_window",	&tunable_readahead_window},
+	{ "cache_drop_threshold",&tunable_cache_drop_threshold},
+	{ "writebehind_window",	&tunable_writebehind_window},
+	{ "prefetch_window",	&tunable_prefetch_window},
+	{ "prefetch_global_rate",&tunable_prefetch_global_rate},
+	{ "group_commit_usec",&tunable_group_commit_usec},
+	{ "upload_buffer_max",&tunable_upload_buffer_max},
+	{ "odirect_threshold",&tunable_odirect_threshold},
+	{ "tree_hash_threads",&tunable_tree_hash_threads},
+	{ "pasv_min_port",	&tunable_pasv_min_port},
+	{ "pasv_max_port",	&tunable_pasv_max_port},
+	{ "tcp_fastopen",	&tunable_tcp_fastopen},
 	{ NULL,			NULL }
 };
 
 static struct parseconf_str_setting parseconf_str_array[] = 
 {
 	{ "listen_adress",	&tunable_listen_adress},
+	{ "upload_durability",&tunable_upload_durability},
+	{ "transfer_hash",	&tunable_transfer_hash},
+	{ "pasv_address",	&tunable_pasv_address},
+	{ NULL,			NULL }
+};
+
+static struct parseconf_func_setting parseconf_func_array[] =
+{
+	{ "bw_class",		bwclass_parse_class },
+	{ "bw_class_match",	bwclass_parse_match },
 	{ NULL,			NULL }
 };
 
@@ -66,6 +100,17 @@ void parseconf_load_setting(const char *setting)
 		exit(EXIT_FAILURE);
 	}
 
+	struct parseconf_func_setting *p_func_setting = parseconf_func_array;
+	while( p_func_setting->p_setting_name != NULL )
+	{
+		if( strcmp(setting_name,p_func_setting->p_setting_name) == 0 )
+		{
+			p_func_setting->p_handler(setting_value);
+			return;
+		}
+		++p_func_setting;
+	}
+
 	struct parseconf_str_setting *p_str_setting = parseconf_str_array;
 	while( p_str_setting->p_setting_name != NULL )
 	{
@@ -19,6 +19,13 @@ struct parseconf_str_setting
 	const char **p_variable;
 };
 
+// 可以重复出现的配置项，每一行交给处理函数解析
+struct parseconf_func_setting
+{
+	const char *p_setting_name;
+	void (*p_handler)(const char *value);
+};
+
 void parseconf_load_file(const char *path);
 
 void parseconf_load_setting(const char *setting);
@@ -0,0 +1,247 @@
+#include "pasvpool.h"
+#include "sysutil.h"
+#include "tunable.h"
+
+typedef struct pasv_pool_shm
+{
+	pthread_mutex_t lock;
+	// 下一次开始查找的位置
+	unsigned int next;
+	// 占用端口的nobody进程，0表示空闲
+	pid_t owner[PASV_POOL_MAX];
+} pasv_pool_shm_t;
+
+static pasv_pool_shm_t *s_pool;
+// 监听套接字和端口在fork之前创建，各进程相同
+static int s_pool_fd[PASV_POOL_MAX];
+static unsigned short s_pool_port[PASV_POOL_MAX];
+static unsigned int s_pool_count;
+
+static int pasv_pool_index(int fd);
+static void pasv_pool_drain(int fd);
+
+void pasv_pool_init()
+{
+	if( tunable_pasv_min_port == 0 || tunable_pasv_max_port < tunable_pasv_min_port ||
+		tunable_pasv_max_port > 65535 )
+	{
+		return;
+	}
+
+	// 与控制连接一样，没有指定listen_adress时双栈监听
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int dual = tunable_listen_adress == NULL || sockaddr_from_ip(tunable_listen_adress,0,&ss,&len) == -1;
+	if( dual )
+	{
+		sockaddr_from_ip("::",0,&ss,&len);
+	}
+
+	// 每个会话的nobody进程都持有全部套接字，数量受描述符上限约束
+	unsigned int port;
+	for( port = tunable_pasv_min_port; port <= tunable_pasv_max_port && s_pool_count < PASV_POOL_MAX; ++port )
+	{
+		int fd = socket(ss.ss_family,SOCK_STREAM,0);
+		if( fd == -1 && dual )
+		{
+			// 内核不支持IPv6
+			sockaddr_from_ip("0.0.0.0",0,&ss,&len);
+			dual = 0;
+			fd = socket(AF_INET,SOCK_STREAM,0);
+		}
+		if( fd == -1 )
+		{
+			break;
+		}
+		int opt = 1;
+		setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof(opt));
+		if( dual )
+		{
+			int off = 0;
+			setsockopt(fd,IPPROTO_IPV6,IPV6_V6ONLY,&off,sizeof(off));
+		}
+		// IPv4和IPv6的端口在结构体中的位置相同
+		((struct sockaddr_in*)&ss)->sin_port = htons(port);
+		// 被其他程序占用的端口跳过
+		if( bind(fd,(struct sockaddr*)&ss,len) == -1 || listen(fd,LISTENQ) == -1 )
+		{
+			close(fd);
+			continue;
+		}
+		s_pool_fd[s_pool_count] = fd;
+		s_pool_port[s_pool_count] = port;
+		++s_pool_count;
+	}
+
+	if( s_pool_count == 0 )
+	{
+		fprintf(stderr, "no passive port available in %u-%u\n", tunable_pasv_min_port, tunable_pasv_max_port);
+		exit(EXIT_FAILURE);
+	}
+
+	s_pool = (pasv_pool_shm_t *)shm_alloc(sizeof(pasv_pool_shm_t));
+	shm_mutex_init(&s_pool->lock);
+}
+
+int pasv_pool_enabled()
+{
+	return s_pool != NULL;
+}
+
+int pasv_pool_acquire(unsigned short *port)
+{
+	pid_t self = getpid();
+	int fd = -1;
+	unsigned int i;
+
+	shm_mutex_lock(&s_pool->lock);
+	for( i = 0; i < s_pool_count; ++i )
+	{
+		unsigned int idx = (s_pool->next + i) % s_pool_count;
+		if( s_pool->owner[idx] == 0 )
+		{
+			s_pool->owner[idx] = self;
+			s_pool->next = idx + 1;
+			fd = s_pool_fd[idx];
+			*port = s_pool_port[idx];
+			break;
+		}
+	}
+	shm_mutex_unlock(&s_pool->lock);
+
+	// 上一个持有者可能没有归还就退出了
+	if( fd != -1 )
+	{
+		pasv_pool_drain(fd);
+	}
+	return fd;
+}
+
+void pasv_pool_reap(pid_t pid)
+{
+	if( s_pool == NULL )
+	{
+		return;
+	}
+
+	unsigned int i;
+	shm_mutex_lock(&s_pool->lock);
+	for( i = 0; i < s_pool_count; ++i )
+	{
+		if( s_pool->owner[i] == pid )
+		{
+			s_pool->owner[i] = 0;
+		}
+	}
+	shm_mutex_unlock(&s_pool->lock);
+}
+
+void pasv_pool_release(int fd)
+{
+	int idx = pasv_pool_index(fd);
+	if( idx == -1 )
+	{
+		return;
+	}
+
+	pasv_pool_drain(fd);
+
+	shm_mutex_lock(&s_pool->lock);
+	if( s_pool->owner[idx] == getpid() )
+	{
+		s_pool->owner[idx] = 0;
+	}
+	shm_mutex_unlock(&s_pool->lock);
+}
+
+int pasv_pool_accept(int fd,const struct sockaddr_storage *peer,unsigned int wait_seconds)
+{
+	// 描述符编号可能超过FD_SETSIZE，使用poll等待
+	struct timeval deadline;
+	gettimeofday(&deadline,NULL);
+	deadline.tv_sec += wait_seconds;
+
+	for( ; ; )
+	{
+		struct timeval now;
+		gettimeofday(&now,NULL);
+		long long left_ms = (deadline.tv_sec - now.tv_sec) * 1000LL + (deadline.tv_usec - now.tv_usec) / 1000;
+		if( left_ms <= 0 )
+		{
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		int ret = poll(&pfd,1,(int)left_ms);
+		if( ret == -1 && errno == EINTR )
+		{
+			continue;
+		}
+		if( ret <= 0 )
+		{
+			return -1;
+		}
+
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof(addr);
+		int conn = accept(fd,(struct sockaddr*)&addr,&addrlen);
+		if( conn == -1 )
+		{
+			if( errno == EINTR || errno == ECONNABORTED )
+			{
+				continue;
+			}
+			return -1;
+		}
+		// 端口可以被预测，拒绝其他地址抢先发起的连接
+		if( peer != NULL && !sockaddr_same_host(&addr,peer) )
+		{
+			close(conn);
+			continue;
+		}
+		return conn;
+	}
+}
+
+void pasv_pool_detach()
+{
+	unsigned int i;
+	for( i = 0; i < s_pool_count; ++i )
+	{
+		close(s_pool_fd[i]);
+	}
+	s_pool_count = 0;
+}
+
+static int pasv_pool_index(int fd)
+{
+	unsigned int i;
+	for( i = 0; i < s_pool_count; ++i )
+	{
+		if( s_pool_fd[i] == fd )
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// 关闭已经排队但没有被accept的连接，避免留给下一个持有者
+static void pasv_pool_drain(int fd)
+{
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while( poll(&pfd,1,0) == 1 && (pfd.revents & POLLIN) )
+	{
+		int conn = accept(fd,NULL,NULL);
+		if( conn == -1 )
+		{
+			break;
+		}
+		close(conn);
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef __PASVPOOL_H__
+#define __PASVPOOL_H__
+
+#include "common.h"
+
+// 被动模式端口池
+// 配置pasv_min_port/pasv_max_port后，主进程启动时预先绑定并监听范围内的端口，
+// 会话的nobody进程继承这些套接字。PASV时从共享内存的占用表中按轮转顺序取出
+// 一个空闲端口，不需要每次创建、绑定和关闭套接字；accept之后或者PASV被取消时归还。
+// 持有者(会话的nobody进程)异常退出后，主进程回收它时归还它占用的端口，
+// 在回收之前进程号不会被重用
+
+/**
+ * pasv_pool_init - 绑定端口范围并分配占用表，必须在fork会话进程之前调用
+ */
+void pasv_pool_init();
+
+/**
+ * pasv_pool_enabled - 是否配置了端口范围
+ */
+int pasv_pool_enabled();
+
+/**
+ * pasv_pool_acquire - 取出一个空闲的监听套接字
+ * @port - 输出端口号
+ * return value - 成功返回监听套接字，端口全部被占用返回-1
+ */
+int pasv_pool_acquire(unsigned short *port);
+
+/**
+ * pasv_pool_release - 归还监听套接字，丢弃其中还没有accept的连接
+ * @fd - pasv_pool_acquire返回的套接字
+ */
+void pasv_pool_release(int fd);
+
+/**
+ * pasv_pool_reap - 归还已退出的进程占用的端口，由主进程回收子进程时调用
+ * @pid - 已经回收的子进程
+ */
+void pasv_pool_reap(pid_t pid);
+
+/**
+ * pasv_pool_accept - 在取出的套接字上等待数据连接，只接受来自控制连接对端地址的连接
+ * @fd - 监听套接字
+ * @peer - 控制连接的对端地址
+ * @wait_seconds - 超时时间(秒)
+ * return value - 成功返回数据连接，超时或失败返回-1
+ */
+int pasv_pool_accept(int fd,const struct sockaddr_storage *peer,unsigned int wait_seconds);
+
+/**
+ * pasv_pool_detach - 不处理PASV的进程(FTP服务进程)关闭继承的套接字
+ */
+void pasv_pool_detach();
+
+#endif /* __PASVPOOL_H__ */
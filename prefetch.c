@@ -0,0 +1,134 @@
+#include "prefetch.h"
+#include "common.h"
+#include "session.h"
+#include "ratelimit.h"
+#include "sysutil.h"
+#include "tunable.h"
+
+typedef struct prefetch_shm
+{
+	pthread_mutex_t lock;
+	token_bucket_t budget;
+} prefetch_shm_t;
+
+static prefetch_shm_t *s_pf;
+
+static int prefetch_allowed(long long bytes);
+
+void prefetch_init()
+{
+	if( tunable_prefetch_window == 0 )
+	{
+		return;
+	}
+
+	s_pf = (prefetch_shm_t *)shm_alloc(sizeof(prefetch_shm_t));
+	shm_mutex_init(&s_pf->lock);
+	ratelimit_bucket_init(&s_pf->budget,tunable_prefetch_global_rate);
+}
+
+void prefetch_hint(session_t *sess,const char *path,long long offset)
+{
+	if( s_pf == NULL )
+	{
+		return;
+	}
+
+	if( path == NULL )
+	{
+		// REST：文件沿用上一次SIZE/MDTM打开的，只移动预读位置
+		if( sess->prefetch_fd == -1 || offset == sess->prefetch_off )
+		{
+			return;
+		}
+	}
+	else if( sess->prefetch_fd == -1 || strcmp(path,sess->prefetch_name) != 0 )
+	{
+		prefetch_drop(sess);
+
+		int fd = open(path,O_RDONLY | O_NONBLOCK);
+		if( fd == -1 )
+		{
+			return;
+		}
+		struct stat sbuf;
+		if( fstat(fd,&sbuf) == -1 || !S_ISREG(sbuf.st_mode) )
+		{
+			close(fd);
+			return;
+		}
+		deactivate_nonblock(fd);
+
+		sess->prefetch_fd = fd;
+		sess->prefetch_name = strdup(path);
+		sess->prefetch_off = -1;
+	}
+	else if( offset == sess->prefetch_off )
+	{
+		return;
+	}
+
+	sess->prefetch_off = offset;
+	if( prefetch_allowed(tunable_prefetch_window) )
+	{
+		// WILLNEED只提交读请求，不等待数据读入
+		posix_fadvise(sess->prefetch_fd,offset,tunable_prefetch_window,POSIX_FADV_WILLNEED);
+	}
+}
+
+int prefetch_take(session_t *sess,const char *path)
+{
+	if( sess->prefetch_fd == -1 )
+	{
+		return -1;
+	}
+
+	// 文件可能在两条命令之间被替换，按inode确认仍是同一个文件
+	int fd = -1;
+	struct stat path_buf;
+	struct stat fd_buf;
+	if( strcmp(path,sess->prefetch_name) == 0 &&
+		stat(path,&path_buf) == 0 && fstat(sess->prefetch_fd,&fd_buf) == 0 &&
+		path_buf.st_dev == fd_buf.st_dev && path_buf.st_ino == fd_buf.st_ino )
+	{
+		fd = sess->prefetch_fd;
+		sess->prefetch_fd = -1;
+	}
+	prefetch_drop(sess);
+
+	return fd;
+}
+
+void prefetch_drop(session_t *sess)
+{
+	if( sess->prefetch_fd != -1 )
+	{
+		close(sess->prefetch_fd);
+		sess->prefetch_fd = -1;
+	}
+	if( sess->prefetch_name )
+	{
+		free(sess->prefetch_name);
+		sess->prefetch_name = NULL;
+	}
+}
+
+// 配额没有欠账时允许预读(可以透支一个窗口)，否则放弃这次投机预读
+static int prefetch_allowed(long long bytes)
+{
+	if( tunable_prefetch_global_rate == 0 )
+	{
+		return 1;
+	}
+
+	shm_mutex_lock(&s_pf->lock);
+	ratelimit_bucket_take(&s_pf->budget,bytes,get_time_ns_coarse());
+	int allowed = s_pf->budget.tokens + bytes >= 0;
+	if( !allowed )
+	{
+		s_pf->budget.tokens += bytes;
+	}
+	shm_mutex_unlock(&s_pf->lock);
+
+	return allowed;
+}
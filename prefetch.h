@@ -0,0 +1,39 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+// 投机预读
+// 客户端通常在RETR之前对同一文件发送SIZE/MDTM(以及REST)，
+// 收到这些命令时提前打开文件并异步预读第一个窗口，RETR直接使用缓存的fd，
+// 从已经预热的页缓存开始发送。每个会话只缓存一个文件，
+// 所有会话的投机预读总量由共享的令牌桶限制。
+
+struct session;
+
+/**
+ * prefetch_init - 分配共享的预读配额，必须在fork会话进程之前调用
+ */
+void prefetch_init();
+
+/**
+ * prefetch_hint - 收到SIZE/MDTM/REST时调用，打开文件并预读
+ * @sess - 会话
+ * @path - 文件路径，为NULL时表示沿用已缓存的文件(REST)
+ * @offset - 预读开始位置
+ */
+void prefetch_hint(struct session *sess,const char *path,long long offset);
+
+/**
+ * prefetch_take - RETR时取出缓存的fd
+ * @sess - 会话
+ * @path - 要下载的文件
+ * return value - 缓存的是同一文件时返回fd(所有权交给调用者)，否则返回-1
+ */
+int prefetch_take(struct session *sess,const char *path);
+
+/**
+ * prefetch_drop - 关闭缓存的fd
+ * @sess - 会话
+ */
+void prefetch_drop(struct session *sess);
+
+#endif /* __PREFETCH_H__ */
@@ -3,11 +3,13 @@
 #include "privsock.h"
 #include "tunable.h"
 #include "sysutil.h"
+#include "pasvpool.h"
 
 void privop_pasv_get_data_sock(session_t *sess);
 void privop_pasv_active(session_t *sess);
 void privop_pasv_listen(session_t *sess);
 void privop_pasv_accept(session_t *sess);
+void privop_pasv_close(session_t *sess);
 
 int capset(cap_user_header_t hdrp, const cap_user_data_t datap)
 {
@@ -17,20 +19,21 @@ int capset(cap_user_header_t hdrp, const cap_user_data_t datap)
 void minimize_privilege()
 {
 	struct __user_cap_header_struct cap_header;
-	struct __user_cap_data_struct cap_data;
+	// 版本2的能力集是64位，内核读取两个结构体
+	struct __user_cap_data_struct cap_data[2];
 	
 	memset(&cap_header,0,sizeof(cap_header));
-	memset(&cap_data,0,sizeof(cap_data));
+	memset(cap_data,0,sizeof(cap_data));
 
 	cap_header.version = _LINUX_CAPABILITY_VERSION_2;
 	cap_header.pid = 0;
 
 	__u32 cap_mask = 0;
 	cap_mask |= (1 << CAP_NET_BIND_SERVICE );
-	cap_data.effective = cap_data.permitted = cap_mask;
-	cap_data.inheritable = 0;
+	cap_data[0].effective = cap_data[0].permitted = cap_mask;
+	cap_data[0].inheritable = 0;
 
-	capset(&cap_header,&cap_data);
+	capset(&cap_header,cap_data);
 }
 
 void handle_parent(session_t *sess)
@@ -73,6 +76,9 @@ void handle_parent(session_t *sess)
 			case PRIV_SOCK_PASV_ACCEPT:
 				privop_pasv_accept(sess);
 				break;
+			case PRIV_SOCK_PASV_CLOSE:
+				privop_pasv_close(sess);
+				break;
 		}
 		
 	}
@@ -80,21 +86,13 @@ void handle_parent(session_t *sess)
 
 void privop_pasv_get_data_sock(session_t *sess)
 {
-	// recv short,then ip
-	unsigned short port = (unsigned short)priv_sock_get_int(sess->parent_fd);
-	
-	char ip[16] = {0};
-	priv_sock_recv_buf(sess->parent_fd,ip,sizeof(ip));
-
-	struct sockaddr_in addr;
+	// recv address(IPv4或IPv6)
+	struct sockaddr_storage addr;
 	memset(&addr,0,sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(port);
-	addr.sin_addr.s_addr = inet_addr(ip);
+	priv_sock_recv_buf(sess->parent_fd,(char*)&addr,sizeof(addr));
 	
-	//printf("address ip: %s\n", ip);
-
-	int data_fd = tcp_client(20);
+	// 从控制连接的本地地址的20端口连接
+	int data_fd = tcp_client(sess->local_ip,20);
 	if( data_fd == -1 )
 	{
 		printf("tcp_client error data fd: %d\n", data_fd);
@@ -130,27 +128,47 @@ void privop_pasv_active(session_t *sess)
 
 void privop_pasv_listen(session_t *sess)
 {
-	char local_ip[16] = {0};
-	getlocalip(local_ip);
+	// 重复的PASV替换之前没有使用的监听套接字
+	privop_pasv_close(sess);
+
+	// 配置了端口范围时从预先绑定的端口池中取出，端口全部被占用时回复0
+	unsigned short port = 0;
+	if( pasv_pool_enabled() )
+	{
+		sess->pasv_listen_fd = pasv_pool_acquire(&port);
+		priv_sock_send_int(sess->parent_fd,(int)port);
+		return;
+	}
 
-	sess->pasv_listen_fd = tcp_server(local_ip,0);
-	struct sockaddr_in sa_in;
-	socklen_t sa_in_len = sizeof(sa_in);
-	if( getsockname(sess->pasv_listen_fd,(struct sockaddr*)&sa_in,&sa_in_len) < 0 )
+	sess->pasv_listen_fd = tcp_server(sess->local_ip,0);
+	struct sockaddr_storage sa;
+	socklen_t sa_len = sizeof(sa);
+	if( getsockname(sess->pasv_listen_fd,(struct sockaddr*)&sa,&sa_len) < 0 )
 	{
 		ERR_EXIT("getsockname");
 	}
 
-	unsigned short port = ntohs(sa_in.sin_port);
+	// IPv4和IPv6的端口在结构体中的位置相同
+	port = ntohs(((struct sockaddr_in*)&sa)->sin_port);
 
 	priv_sock_send_int(sess->parent_fd,(int)port);
 }
 
 void privop_pasv_accept(session_t *sess)
 {
-	int fd = accept_timeout(sess->pasv_listen_fd,NULL,tunable_accept_timeout);
-	close(sess->pasv_listen_fd);
-	sess->pasv_listen_fd = -1;
+	int fd;
+	if( pasv_pool_enabled() )
+	{
+		struct sockaddr_storage peer;
+		socklen_t peer_len = sizeof(peer);
+		int has_peer = getpeername(sess->ctrl_fd,(struct sockaddr*)&peer,&peer_len) == 0;
+		fd = pasv_pool_accept(sess->pasv_listen_fd,has_peer ? &peer : NULL,tunable_accept_timeout);
+	}
+	else
+	{
+		fd = accept_timeout(sess->pasv_listen_fd,NULL,tunable_accept_timeout);
+	}
+	privop_pasv_close(sess);
 	if( fd == -1 )
 	{
 		priv_sock_send_result(sess->parent_fd,PRIV_SOCK_RESULT_BAD);
@@ -161,4 +179,22 @@ void privop_pasv_accept(session_t *sess)
 		priv_sock_send_fd(sess->parent_fd,fd);
 		close(fd);
 	}
-}
\ No newline at end of file
+}
+
+// 不需要应答
+void privop_pasv_close(session_t *sess)
+{
+	if( sess->pasv_listen_fd != -1 )
+	{
+		// 端口池的套接字归还，不关闭
+		if( pasv_pool_enabled() )
+		{
+			pasv_pool_release(sess->pasv_listen_fd);
+		}
+		else
+		{
+			close(sess->pasv_listen_fd);
+		}
+		sess->pasv_listen_fd = -1;
+	}
+}
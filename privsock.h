@@ -11,6 +11,7 @@
 #define PRIV_SOCK_PASV_ACTIVE	2
 #define PRIV_SOCK_PASV_LISTEN	3
 #define PRIV_SOCK_PASV_ACCEPT	4
+#define PRIV_SOCK_PASV_CLOSE	5
 
 // nobody进程对FTP服务进程的应答
 #define PRIV_SOCK_RESULT_OK	1
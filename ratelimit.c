@@ -0,0 +1,281 @@
+#include "ratelimit.h"
+#include "common.h"
+#include "session.h"
+#include "sysutil.h"
+#include "tunable.h"
+#include "bwclass.h"
+
+#define RATELIMIT_SLOTS		256
+
+// 超过该时间未使用的共享桶可以被其他用户/IP复用
+#define RATELIMIT_IDLE_NS	(60 * 1000000000LL)
+
+// 令牌桶最多积攒100ms的令牌，避免空闲后出现突发
+#define RATELIMIT_BURST_DIV	10
+#define RATELIMIT_BURST_MIN	(4 * MAX_LINE)
+
+typedef struct shared_bucket
+{
+	int in_use;
+	unsigned int key;
+	token_bucket_t tb[2];
+} shared_bucket_t;
+
+typedef struct ratelimit_shm
+{
+	pthread_mutex_t lock;
+	token_bucket_t global[2];
+	shared_bucket_t users[RATELIMIT_SLOTS];
+	shared_bucket_t ips[RATELIMIT_SLOTS];
+} ratelimit_shm_t;
+
+static ratelimit_shm_t *s_rl;
+
+static int slot_attach(shared_bucket_t *slots,unsigned int key,
+	unsigned int download_rate,unsigned int upload_rate);
+static shared_bucket_t* slot_get(shared_bucket_t *slots,int index,unsigned int key);
+
+void ratelimit_init()
+{
+	s_rl = (ratelimit_shm_t *)shm_alloc(sizeof(ratelimit_shm_t));
+	shm_mutex_init(&s_rl->lock);
+
+	ratelimit_bucket_init(&s_rl->global[RATE_DOWNLOAD],tunable_global_download_max_rate);
+	ratelimit_bucket_init(&s_rl->global[RATE_UPLOAD],tunable_global_upload_max_rate);
+}
+
+void ratelimit_attach_ip(session_t *sess,unsigned int ip)
+{
+	ratelimit_bucket_init(&sess->bw_bucket[RATE_DOWNLOAD],sess->bw_download_rate_max);
+	ratelimit_bucket_init(&sess->bw_bucket[RATE_UPLOAD],sess->bw_upload_rate_max);
+
+	sess->rl_ip = ip;
+	sess->rl_ip_slot = -1;
+	sess->rl_user_slot = -1;
+	if( tunable_ip_download_max_rate == 0 && tunable_ip_upload_max_rate == 0 )
+	{
+		return;
+	}
+
+	shm_mutex_lock(&s_rl->lock);
+	sess->rl_ip_slot = slot_attach(s_rl->ips,ip,
+		tunable_ip_download_max_rate,tunable_ip_upload_max_rate);
+	shm_mutex_unlock(&s_rl->lock);
+}
+
+void ratelimit_attach_user(session_t *sess,unsigned int uid)
+{
+	sess->rl_uid = uid;
+	sess->rl_user_slot = -1;
+	if( tunable_user_download_max_rate == 0 && tunable_user_upload_max_rate == 0 )
+	{
+		return;
+	}
+
+	shm_mutex_lock(&s_rl->lock);
+	sess->rl_user_slot = slot_attach(s_rl->users,uid,
+		tunable_user_download_max_rate,tunable_user_upload_max_rate);
+	shm_mutex_unlock(&s_rl->lock);
+}
+
+void ratelimit_charge(session_t *sess,int bytes,int is_upload)
+{
+	if( bytes <= 0 )
+	{
+		return;
+	}
+
+	int dir = is_upload ? RATE_UPLOAD : RATE_DOWNLOAD;
+	long long now = get_time_ns_coarse();
+	long long wait_ns = 0;
+	long long ns;
+
+	if( !(sess->bw_paced && dir == RATE_DOWNLOAD) )
+	{
+		wait_ns = ratelimit_bucket_take(&sess->bw_bucket[dir],bytes,now);
+	}
+
+	// 带宽类别按权重分配全局带宽
+	ns = bwclass_charge(sess,dir,bytes,now);
+	if( ns > wait_ns )
+		wait_ns = ns;
+
+	if( s_rl->global[dir].rate > 0 || sess->rl_ip_slot != -1 || sess->rl_user_slot != -1 )
+	{
+		shm_mutex_lock(&s_rl->lock);
+
+		ns = ratelimit_bucket_take(&s_rl->global[dir],bytes,now);
+		if( ns > wait_ns )
+			wait_ns = ns;
+
+		shared_bucket_t *sb;
+		if( sess->rl_ip_slot != -1 )
+		{
+			sb = slot_get(s_rl->ips,sess->rl_ip_slot,sess->rl_ip);
+			if( sb == NULL )
+			{
+				sess->rl_ip_slot = slot_attach(s_rl->ips,sess->rl_ip,
+					tunable_ip_download_max_rate,tunable_ip_upload_max_rate);
+				sb = &s_rl->ips[sess->rl_ip_slot];
+			}
+			ns = ratelimit_bucket_take(&sb->tb[dir],bytes,now);
+			if( ns > wait_ns )
+				wait_ns = ns;
+		}
+
+		if( sess->rl_user_slot != -1 )
+		{
+			sb = slot_get(s_rl->users,sess->rl_user_slot,sess->rl_uid);
+			if( sb == NULL )
+			{
+				sess->rl_user_slot = slot_attach(s_rl->users,sess->rl_uid,
+					tunable_user_download_max_rate,tunable_user_upload_max_rate);
+				sb = &s_rl->users[sess->rl_user_slot];
+			}
+			ns = ratelimit_bucket_take(&sb->tb[dir],bytes,now);
+			if( ns > wait_ns )
+				wait_ns = ns;
+		}
+
+		shm_mutex_unlock(&s_rl->lock);
+	}
+
+	if( wait_ns > 0 )
+	{
+		nano_sleep((double)wait_ns / (double)1000000000);
+	}
+}
+
+int ratelimit_start_pacing(session_t *sess,int fd)
+{
+	sess->bw_paced = 0;
+	if( !tunable_pacing_enable )
+	{
+		return 0;
+	}
+
+	// 单个连接的速率不可能超过用户/IP/全局的上限，取最小值作为内核速率
+	unsigned int rate = sess->bw_download_rate_max;
+	if( sess->rl_user_slot != -1 && tunable_user_download_max_rate > 0 &&
+		( rate == 0 || tunable_user_download_max_rate < rate ) )
+	{
+		rate = tunable_user_download_max_rate;
+	}
+	if( sess->rl_ip_slot != -1 && tunable_ip_download_max_rate > 0 &&
+		( rate == 0 || tunable_ip_download_max_rate < rate ) )
+	{
+		rate = tunable_ip_download_max_rate;
+	}
+	if( tunable_global_download_max_rate > 0 &&
+		( rate == 0 || tunable_global_download_max_rate < rate ) )
+	{
+		rate = tunable_global_download_max_rate;
+	}
+
+	if( rate == 0 || set_pacing_rate(fd,rate) < 0 )
+	{
+		return 0;
+	}
+
+	sess->bw_paced = 1;
+	return 1;
+}
+
+void ratelimit_stop_pacing(session_t *sess)
+{
+	sess->bw_paced = 0;
+}
+
+void ratelimit_bucket_init(token_bucket_t *tb,unsigned int rate)
+{
+	tb->rate = rate;
+	tb->tokens = 0;
+	tb->last_ns = get_time_ns_coarse();
+}
+
+long long ratelimit_bucket_take(token_bucket_t *tb,int bytes,long long now)
+{
+	if( tb->rate == 0 )
+	{
+		return 0;
+	}
+
+	long long burst = tb->rate / RATELIMIT_BURST_DIV;
+	if( burst < RATELIMIT_BURST_MIN )
+	{
+		burst = RATELIMIT_BURST_MIN;
+	}
+
+	// 补充令牌，间隔超过1秒时桶必然已满，截断以免溢出
+	long long elapsed = now - tb->last_ns;
+	if( elapsed > 1000000000LL )
+	{
+		elapsed = 1000000000LL;
+	}
+	if( elapsed > 0 )
+	{
+		tb->tokens += elapsed * tb->rate / 1000000000LL;
+		tb->last_ns = now;
+	}
+	if( tb->tokens > burst )
+	{
+		tb->tokens = burst;
+	}
+
+	tb->tokens -= bytes;
+	if( tb->tokens >= 0 )
+	{
+		return 0;
+	}
+	return -tb->tokens * 1000000000LL / tb->rate;
+}
+
+// 查找key对应的共享桶，不存在则占用一个空闲(或长时间未使用)的桶，调用者需持锁
+static int slot_attach(shared_bucket_t *slots,unsigned int key,
+	unsigned int download_rate,unsigned int upload_rate)
+{
+	long long now = get_time_ns_coarse();
+	int start = key % RATELIMIT_SLOTS;
+	int victim = -1;
+	int i;
+	for( i = 0; i < RATELIMIT_SLOTS; ++i )
+	{
+		int index = (start + i) % RATELIMIT_SLOTS;
+		shared_bucket_t *sb = &slots[index];
+		if( sb->in_use && sb->key == key )
+		{
+			return index;
+		}
+		if( victim == -1 && ( !sb->in_use ||
+			( now - sb->tb[RATE_DOWNLOAD].last_ns > RATELIMIT_IDLE_NS &&
+			  now - sb->tb[RATE_UPLOAD].last_ns > RATELIMIT_IDLE_NS ) ) )
+		{
+			victim = index;
+		}
+	}
+
+	// 全部被占用时与同槽位的key共享限速
+	if( victim == -1 )
+	{
+		return start;
+	}
+
+	shared_bucket_t *sb = &slots[victim];
+	sb->in_use = 1;
+	sb->key = key;
+	ratelimit_bucket_init(&sb->tb[RATE_DOWNLOAD],download_rate);
+	ratelimit_bucket_init(&sb->tb[RATE_UPLOAD],upload_rate);
+
+	return victim;
+}
+
+// 共享桶可能已被其他key复用，此时返回NULL
+static shared_bucket_t* slot_get(shared_bucket_t *slots,int index,unsigned int key)
+{
+	shared_bucket_t *sb = &slots[index];
+	if( !sb->in_use || sb->key != key )
+	{
+		return NULL;
+	}
+	return sb;
+}
@@ -0,0 +1,81 @@
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+// 令牌桶限速
+// 限速分为四级：会话 < 用户 < 来源IP < 整个服务器，
+// 后三级保存在共享内存中，多个会话进程共同消耗同一个桶
+
+#define RATE_DOWNLOAD	0
+#define RATE_UPLOAD	1
+
+typedef struct token_bucket
+{
+	// 速率(字节/秒)，0表示不限速
+	unsigned int rate;
+	// 当前令牌数，允许为负(表示欠下的字节数)
+	long long tokens;
+	// 上一次补充令牌的时间(纳秒)
+	long long last_ns;
+} token_bucket_t;
+
+struct session;
+
+/**
+ * ratelimit_bucket_init - 初始化令牌桶
+ * @tb - 令牌桶
+ * @rate - 速率(字节/秒)，0表示不限速
+ */
+void ratelimit_bucket_init(token_bucket_t *tb,unsigned int rate);
+
+/**
+ * ratelimit_bucket_take - 消耗bytes个令牌
+ * @tb - 令牌桶
+ * @bytes - 消耗的令牌数
+ * @now - 当前时间(纳秒)
+ * return value - 令牌不足时需要等待的纳秒数
+ */
+long long ratelimit_bucket_take(token_bucket_t *tb,int bytes,long long now);
+
+/**
+ * ratelimit_init - 分配共享的令牌桶，必须在fork会话进程之前调用
+ */
+void ratelimit_init();
+
+/**
+ * ratelimit_attach_ip - 会话关联来源IP对应的共享令牌桶
+ * @sess - 会话
+ * @ip - 客户端IP(网络字节序)，IPv6客户端为/64前缀折叠成的32位值
+ */
+void ratelimit_attach_ip(struct session *sess,unsigned int ip);
+
+/**
+ * ratelimit_attach_user - 登录成功后，会话关联用户对应的共享令牌桶
+ * @sess - 会话
+ * @uid - 用户id
+ */
+void ratelimit_attach_user(struct session *sess,unsigned int uid);
+
+/**
+ * ratelimit_charge - 传输bytes字节后消耗各级令牌，令牌不足时睡眠
+ * @sess - 会话
+ * @bytes - 本次传输的字节数
+ * @is_upload - 1为上传，0为下载
+ */
+void ratelimit_charge(struct session *sess,int bytes,int is_upload);
+
+/**
+ * ratelimit_start_pacing - 下载时尝试由内核按速率发送(SO_MAX_PACING_RATE)，
+ * 成功后会话级限速不再在用户态睡眠，共享的用户/IP/全局桶仍在用户态扣除
+ * @sess - 会话
+ * @fd - 数据连接
+ * return value - 成功开启内核限速返回1，不可用或无需限速返回0
+ */
+int ratelimit_start_pacing(struct session *sess,int fd);
+
+/**
+ * ratelimit_stop_pacing - 传输结束，恢复用户态限速
+ * @sess - 会话
+ */
+void ratelimit_stop_pacing(struct session *sess);
+
+#endif /* __RATELIMIT_H__ */
@@ -3,6 +3,8 @@
 #include "privparent.h"
 #include "privsock.h"
 #include "sysutil.h"
+#include "tunable.h"
+#include "pasvpool.h"
 
 void begin_session(session_t *sess)
 {
@@ -16,6 +18,29 @@ void begin_session(session_t *sess)
 	*/
 	
 	activate_oobinline(sess->ctrl_fd);
+	activate_nodelay(sess->ctrl_fd);
+
+	// PASV地址只在这里确定一次，FTP服务进程和nobody进程共用
+	struct sockaddr_storage local;
+	socklen_t local_len = sizeof(local);
+	if( getsockname(sess->ctrl_fd,(struct sockaddr*)&local,&local_len) == 0 )
+	{
+		sockaddr_ip(&local,sess->local_ip,sizeof(sess->local_ip));
+	}
+	else
+	{
+		getlocalip(sess->local_ip);
+	}
+	// pasv_address只能是IPv4地址(227回复的格式)，主机名或IPv6地址时使用本地地址
+	struct in_addr pasv_addr;
+	if( tunable_pasv_address != NULL && inet_pton(AF_INET,tunable_pasv_address,&pasv_addr) == 1 )
+	{
+		inet_ntop(AF_INET,&pasv_addr,sess->pasv_ip,sizeof(sess->pasv_ip));
+	}
+	else
+	{
+		strcpy(sess->pasv_ip,sess->local_ip);
+	}
 
 	priv_sock_init(sess);
 
@@ -35,6 +60,7 @@ void begin_session(session_t *sess)
 			sess->child_fd = sockfds[1];
 			*/
 			priv_sock_set_child_context(sess);
+			pasv_pool_detach();
 			handle_child(sess);		
 			break;
 		default:
@@ -2,6 +2,7 @@
 #define __SESSION_H__
 
 #include "common.h"
+#include "ratelimit.h"
 
 typedef struct session
 {
@@ -16,8 +17,8 @@ typedef struct session
 	int child_fd;
 	// 传输模式
 	int is_ascii;
-	// PORT地址
-	struct sockaddr_in *port_addr;
+	// PORT/EPRT地址
+	struct sockaddr_storage *port_addr;
 	// 数据传输fd
 	int data_fd;
 	int pasv_listen_fd;
@@ -32,8 +33,6 @@ typedef struct session
 	// 限速相关
 	unsigned int bw_upload_rate_max;
 	unsigned int bw_download_rate_max;
-	long bw_transfer_start_sec;
-	long bw_transfer_start_usec;
 
 	int abor_received;
 
@@ -41,6 +40,56 @@ typedef struct session
 	unsigned int num_clients;
 	unsigned int num_this_ip;
 
+	// 令牌桶限速：会话自身的桶，以及共享的用户/IP桶
+	token_bucket_t bw_bucket[2];
+	unsigned int rl_ip;
+	int rl_ip_slot;
+	unsigned int rl_uid;
+	int rl_user_slot;
+	// 当前下载由内核按速率发送
+	int bw_paced;
+	// 带宽类别及当前传输在共享调度表中的位置
+	int bw_class;
+	int bw_transfer_slot;
+
+	// ALLO声明的大小，以及SIZE命令留下的大小估计
+	long long alloc_size;
+	long long size_hint;
+	dev_t size_hint_dev;
+	ino_t size_hint_ino;
+
+	// SIZE/MDTM/REST时投机打开并预读的文件
+	int prefetch_fd;
+	char *prefetch_name;
+	long long prefetch_off;
+
+	// HASH使用的算法(默认0即SHA-256)，RANG设置的范围(结束位置含在范围内)
+	int hash_algo;
+	int rang_set;
+	long long rang_start;
+	long long rang_end;
+
+	// 正在进行的长时间操作(SITE TREEHASH等)，供STAT报告进度
+	const char *op_name;
+	long long op_done;
+	long long op_total;
+
+	// SITE CPFR给出的复制源文件
+	char *cpfr_name;
+
+	// MODE B，以及传输之间保持打开的数据连接
+	int block_mode;
+	int block_fd;
+
+	// 控制连接的本地地址(PASV监听地址)和PASV回复中通告的地址，会话开始时确定
+	char local_ip[INET6_ADDRSTRLEN];
+	char pasv_ip[16];
+
+	// 客户端通过IPv6连接(不包括IPv4映射地址)，只能使用EPSV/EPRT；
+	// EPSV ALL之后拒绝其他建立数据连接的命令
+	int ipv6;
+	int epsv_all;
+
 } session_t;
 
 void begin_session(session_t *sess);
@@ -36,6 +36,52 @@ int str_all_space(const char *str)
 	return 1;
 }
 
+int str_is_number(const char *str)
+{
+	const char *p = str;
+	if( *p == '\0' )
+	{
+		return 0;
+	}
+	while(*p)
+	{
+		if( isdigit(*p) == 0 )
+		{
+			return 0;
+		}
+		++p;
+	}
+	return 1;
+}
+
+const char* str_next_word(const char *str,char *word,unsigned int len)
+{
+	while( *str == ' ' )
+		++str;
+	if( *str == '\0' )
+		return NULL;
+
+	char end = ' ';
+	if( *str == '"' )
+	{
+		end = '"';
+		++str;
+	}
+
+	unsigned int n = 0;
+	while( *str != '\0' && *str != end )
+	{
+		if( n + 1 < len )
+			word[n++] = *str;
+		++str;
+	}
+	word[n] = '\0';
+
+	if( *str == '"' )
+		++str;
+	return str;
+}
+
 void str_upper(char *str)
 {
 	char *p = str;
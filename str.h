@@ -26,6 +26,22 @@ void str_split(const char *str,char *left,char *right,char c);
  */
 int str_all_space(const char *str);
 
+/**
+ * str_is_number - 判断字符串是否为非空的十进制数字串
+ * @str - 传入的字符串
+ * return value - 是返回1,否则为0
+ */
+int str_is_number(const char *str);
+
+/**
+ * str_next_word - 取出下一个以空格分隔的词，包含空格的词可以用双引号括起来
+ * @str - 传入的字符串
+ * @word - 取出的词
+ * @len - word的大小
+ * return value - 词之后的位置，没有更多的词返回NULL
+ */
+const char* str_next_word(const char *str,char *word,unsigned int len);
+
 /**
  * str_upper - 将字符串转化为大写
  * @str - 传入的字符串
@@ -21,7 +21,9 @@ int getlocalip(char *ip)
 
 	inet_sock = socket(AF_INET,SOCK_DGRAM,0);
 	strcpy(ifr.ifr_name,"eth1");
-	if( ioctl(inet_sock,SIOCGIFADDR,&ifr) < 0 )
+	int ret = ioctl(inet_sock,SIOCGIFADDR,&ifr);
+	close(inet_sock);
+	if( ret < 0 )
 		return -1;
 
 	strcpy( ip,inet_ntoa( ( (struct sockaddr_in *)&ifr.ifr_addr)->sin_addr) );
@@ -142,10 +144,10 @@ int write_timeout(int fd, unsigned int wait_seconds)
  * @wait_seconds: 等待超时秒数，如果为0表示正常模式
  * 成功（未超时）返回已连接套接字，超时返回-1并且errno = ETIMEDOUT
  */
-int accept_timeout(int fd, struct sockaddr_in *addr, unsigned int wait_seconds)
+int accept_timeout(int fd, struct sockaddr_storage *addr, unsigned int wait_seconds)
 {
 	int ret;
-	socklen_t addrlen = sizeof(struct sockaddr_in);
+	socklen_t addrlen = sizeof(struct sockaddr_storage);
 
 	if (wait_seconds > 0)
 	{
@@ -186,10 +188,10 @@ int accept_timeout(int fd, struct sockaddr_in *addr, unsigned int wait_seconds)
  * @wait_seconds: 等待超时秒数，如果为0表示正常模式
  * 成功（未超时）返回0，失败返回-1，超时返回-1并且errno = ETIMEDOUT
  */
-int connect_timeout(int fd, struct sockaddr_in *addr, unsigned int wait_seconds)
+int connect_timeout(int fd, struct sockaddr_storage *addr, unsigned int wait_seconds)
 {
 	int ret;
-	socklen_t addrlen = sizeof(struct sockaddr_in);
+	socklen_t addrlen = addr->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
 
 	if (wait_seconds > 0)
 		activate_nonblock(fd);
@@ -360,6 +362,8 @@ ssize_t readline(int sockfd, void *buf, size_t maxline)
 				if (ret != i+1)
 					exit(EXIT_FAILURE);
 
+				// 清除窥视到的后续命令(客户端连续发送多条命令时)
+				memset(bufp + i + 1, 0, nread - i - 1);
 				return ret;
 			}
 		}
@@ -448,6 +452,92 @@ int recv_fd(const int sock_fd)
 	return recv_fd;
 }
 
+/**
+ * send_fds:一次发送多个文件描述符，和send_fd不同，失败时返回-1而不退出
+ * @sock_fd: unix域套接字
+ * @fds: 要发送的描述符
+ * @count: 描述符个数，不超过MAX_PASS_FDS
+ * 返回值: 成功返回0，失败返回-1
+ */
+int send_fds(int sock_fd, const int *fds, int count)
+{
+	struct msghdr msg;
+	struct cmsghdr *p_cmsg;
+	struct iovec vec;
+	char cmsgbuf[CMSG_SPACE(sizeof(int) * MAX_PASS_FDS)];
+	char sendchar = 0;
+	if (count <= 0 || count > MAX_PASS_FDS)
+		return -1;
+
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+	p_cmsg = CMSG_FIRSTHDR(&msg);
+	p_cmsg->cmsg_level = SOL_SOCKET;
+	p_cmsg->cmsg_type = SCM_RIGHTS;
+	p_cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+	memcpy(CMSG_DATA(p_cmsg), fds, sizeof(int) * count);
+
+	msg.msg_name = NULL;
+	msg.msg_namelen = 0;
+	msg.msg_iov = &vec;
+	msg.msg_iovlen = 1;
+	msg.msg_flags = 0;
+
+	vec.iov_base = &sendchar;
+	vec.iov_len = sizeof(sendchar);
+	int ret;
+	do
+	{
+		ret = sendmsg(sock_fd, &msg, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret == 1 ? 0 : -1;
+}
+
+/**
+ * recv_fds:接收send_fds发送的多个文件描述符
+ * @sock_fd: unix域套接字
+ * @fds: 保存收到的描述符
+ * @count: fds的容量，不超过MAX_PASS_FDS
+ * 返回值: 成功返回收到的描述符个数，失败返回-1
+ */
+int recv_fds(int sock_fd, int *fds, int count)
+{
+	struct msghdr msg;
+	struct cmsghdr *p_cmsg;
+	struct iovec vec;
+	char cmsgbuf[CMSG_SPACE(sizeof(int) * MAX_PASS_FDS)];
+	char recvchar;
+	if (count <= 0 || count > MAX_PASS_FDS)
+		return -1;
+
+	vec.iov_base = &recvchar;
+	vec.iov_len = sizeof(recvchar);
+	msg.msg_name = NULL;
+	msg.msg_namelen = 0;
+	msg.msg_iov = &vec;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+	msg.msg_flags = 0;
+
+	int ret;
+	do
+	{
+		ret = recvmsg(sock_fd, &msg, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret != 1)
+		return -1;
+
+	p_cmsg = CMSG_FIRSTHDR(&msg);
+	if (p_cmsg == NULL || p_cmsg->cmsg_type != SCM_RIGHTS)
+		return -1;
+
+	int received = (p_cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	memcpy(fds, CMSG_DATA(p_cmsg), sizeof(int) * received);
+	return received;
+}
+
 /**
  * tcp_server:启动tcp服务器
  * @host: 服务器ip地址或者主机名称
@@ -457,19 +547,11 @@ int recv_fd(const int sock_fd)
 int tcp_server(const char *host,unsigned short port)
 {
 	int sockfd = -1;
-	sockfd = socket(AF_INET,SOCK_STREAM,0);
-	if( sockfd < 0 )
-	{
-		ERR_EXIT("init socket");
-	}
-
-	struct sockaddr_in sa_in;
-	bzero(&sa_in,sizeof(sa_in));
-	sa_in.sin_family = AF_INET;
-	sa_in.sin_port = htons(port);
+	struct sockaddr_storage ss;
+	socklen_t len;
 	if( host != NULL )
 	{
- 		if( inet_pton(AF_INET,host,&sa_in.sin_addr) == 0 )
+		if( sockaddr_from_ip(host,port,&ss,&len) == -1 )
 		{                                                	
 			//可能为主机地址
 			struct hostent *hp;
@@ -478,19 +560,41 @@ int tcp_server(const char *host,unsigned short port)
 			{
 				ERR_EXIT("get host name");
 			}
-			sa_in.sin_addr = *((struct in_addr*)hp->h_addr);
+			struct sockaddr_in *sa_in = (struct sockaddr_in*)&ss;
+			bzero(&ss,sizeof(ss));
+			sa_in->sin_family = AF_INET;
+			sa_in->sin_port = htons(port);
+			sa_in->sin_addr = *((struct in_addr*)hp->h_addr);
+			len = sizeof(struct sockaddr_in);
 		}
+		sockfd = socket(ss.ss_family,SOCK_STREAM,0);
 	}
 	else
 	{
-		sa_in.sin_addr.s_addr = htonl(INADDR_ANY);
+		// 没有指定地址时IPv6/IPv4双栈监听，IPv4客户端的地址为::ffff:a.b.c.d
+		sockaddr_from_ip("::",port,&ss,&len);
+		sockfd = socket(AF_INET6,SOCK_STREAM,0);
+		if( sockfd >= 0 )
+		{
+			int off = 0;
+			setsockopt(sockfd,IPPROTO_IPV6,IPV6_V6ONLY,&off,sizeof(off));
+		}
+		else
+		{
+			// 内核不支持IPv6
+			sockaddr_from_ip("0.0.0.0",port,&ss,&len);
+			sockfd = socket(AF_INET,SOCK_STREAM,0);
+		}
+	}
+	if( sockfd < 0 )
+	{
+		ERR_EXIT("init socket");
 	}
-
 
 	int opt = 1;
 	setsockopt(sockfd,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof(opt));
 
-	if( bind(sockfd,(struct sockaddr*)&sa_in,sizeof(sa_in)) == -1 )
+	if( bind(sockfd,(struct sockaddr*)&ss,len) == -1 )
 	{
 		close(sockfd);
 		ERR_EXIT("bind sockfd wit addr");
@@ -501,34 +605,134 @@ int tcp_server(const char *host,unsigned short port)
 	return sockfd;
 }
 
-int tcp_client(unsigned int port)
+/**
+ * tcp_client:创建客户端套接字
+ * @host: 绑定的本地地址，决定地址族；为NULL并且port不为0时使用getlocalip
+ * @port: 绑定的本地端口，为0时端口推迟到connect时按四元组分配
+ * 返回值: 成功返回套接字，绑定失败返回-1
+ */
+int tcp_client(const char *host,unsigned int port)
 {
+	char local_ip[16] = {0};
+	if( host == NULL && port > 0 )
+	{
+		getlocalip(local_ip);
+		host = local_ip;
+	}
+
+	struct sockaddr_storage ss;
+	socklen_t len;
+	if( host != NULL && sockaddr_from_ip(host,port,&ss,&len) == -1 )
+	{
+		host = NULL;
+	}
+
 	int sockfd;
-	if( ( sockfd = socket(AF_INET,SOCK_STREAM,0 )) < 0 )
+	if( ( sockfd = socket(host != NULL ? ss.ss_family : AF_INET,SOCK_STREAM,0 )) < 0 )
 	{
 		ERR_EXIT("socket");
 	}
-	if( port > 0 )
+	if( host != NULL )
 	{
 		int opt = 1;
-		setsockopt(sockfd,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof(opt));
-
-		char local_ip[16] = {0};
-		getlocalip(local_ip);
-
-		struct sockaddr_in sa_in;
-		bzero(&sa_in,sizeof(sa_in));
-		sa_in.sin_family = AF_INET;
-		sa_in.sin_port = port;
-		sa_in.sin_addr.s_addr = inet_addr(local_ip);
-		if( bind(sockfd,(struct sockaddr*)&sa_in,sizeof(sa_in)) < 0 )
+		if( port > 0 )
 		{
-			ERR_EXIT("bind");
+			setsockopt(sockfd,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof(opt));
+		}
+#ifdef IP_BIND_ADDRESS_NO_PORT
+		else
+		{
+			// 大量并发连接不会因为提前占用端口而耗尽临时端口
+			setsockopt(sockfd,IPPROTO_IP,IP_BIND_ADDRESS_NO_PORT,&opt,sizeof(opt));
+		}
+#endif
+		if( bind(sockfd,(struct sockaddr*)&ss,len) < 0 && port > 0 )
+		{
+			close(sockfd);
+			return -1;
 		}
 	}
 	return sockfd;
 }
 
+// ip为点分十进制或者IPv6文本地址，不是合法地址返回-1
+int sockaddr_from_ip(const char *ip,unsigned short port,struct sockaddr_storage *ss,socklen_t *len)
+{
+	bzero(ss,sizeof(*ss));
+	struct sockaddr_in *sa_in = (struct sockaddr_in*)ss;
+	struct sockaddr_in6 *sa_in6 = (struct sockaddr_in6*)ss;
+	if( inet_pton(AF_INET,ip,&sa_in->sin_addr) == 1 )
+	{
+		sa_in->sin_family = AF_INET;
+		sa_in->sin_port = htons(port);
+		*len = sizeof(struct sockaddr_in);
+		return 0;
+	}
+	if( inet_pton(AF_INET6,ip,&sa_in6->sin6_addr) == 1 )
+	{
+		sa_in6->sin6_family = AF_INET6;
+		sa_in6->sin6_port = htons(port);
+		*len = sizeof(struct sockaddr_in6);
+		return 0;
+	}
+	return -1;
+}
+
+// 统一为IPv6地址，IPv4地址转换为映射地址
+static void sockaddr_to_in6(const struct sockaddr_storage *ss,struct in6_addr *addr)
+{
+	if( ss->ss_family == AF_INET6 )
+	{
+		*addr = ((const struct sockaddr_in6*)ss)->sin6_addr;
+		return;
+	}
+	bzero(addr,sizeof(*addr));
+	addr->s6_addr[10] = 0xff;
+	addr->s6_addr[11] = 0xff;
+	memcpy(&addr->s6_addr[12],&((const struct sockaddr_in*)ss)->sin_addr,4);
+}
+
+void sockaddr_ip(const struct sockaddr_storage *ss,char *ip,unsigned int len)
+{
+	struct in6_addr addr;
+	sockaddr_to_in6(ss,&addr);
+	if( IN6_IS_ADDR_V4MAPPED(&addr) )
+	{
+		inet_ntop(AF_INET,&addr.s6_addr[12],ip,len);
+	}
+	else
+	{
+		inet_ntop(AF_INET6,&addr,ip,len);
+	}
+}
+
+int sockaddr_is_v6(const struct sockaddr_storage *ss)
+{
+	return ss->ss_family == AF_INET6 &&
+		!IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6*)ss)->sin6_addr);
+}
+
+int sockaddr_same_host(const struct sockaddr_storage *a,const struct sockaddr_storage *b)
+{
+	struct in6_addr addr_a;
+	struct in6_addr addr_b;
+	sockaddr_to_in6(a,&addr_a);
+	sockaddr_to_in6(b,&addr_b);
+	return memcmp(&addr_a,&addr_b,sizeof(addr_a)) == 0;
+}
+
+// 同一个IPv6客户通常分配到整个/64，按前缀计数和限速，更换接口标识不能绕过限制
+unsigned int sockaddr_client_key(const struct sockaddr_storage *ss,struct in6_addr *key)
+{
+	sockaddr_to_in6(ss,key);
+	if( IN6_IS_ADDR_V4MAPPED(key) )
+	{
+		return key->s6_addr32[3];
+	}
+	memset(&key->s6_addr[8],0,8);
+	return key->s6_addr32[0] ^ key->s6_addr32[1];
+}
+
 void get_file_mode(char perms[10],mode_t mode)
 {
 	perms[0] = '?';
@@ -644,6 +848,16 @@ long  get_time_usec()
 	return s_curr_time.tv_usec;
 }
 
+long long get_time_ns_coarse()
+{
+	struct timespec ts;
+	if( clock_gettime(CLOCK_MONOTONIC_COARSE,&ts) < 0 )
+	{
+		ERR_EXIT("clock_gettime");
+	}
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 void nano_sleep(double seconds)
 {
 	time_t secs = (time_t)seconds;
@@ -660,6 +874,55 @@ void nano_sleep(double seconds)
 	} while(ret == -1 && errno == EINTR );
 }
 
+void* shm_alloc(size_t size)
+{
+	void *p = mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_ANONYMOUS,-1,0);
+	if( p == MAP_FAILED )
+	{
+		ERR_EXIT("mmap");
+	}
+	memset(p,0,size);
+	return p;
+}
+
+void shm_mutex_init(pthread_mutex_t *mutex)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr,PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr,PTHREAD_MUTEX_ROBUST);
+	if( pthread_mutex_init(mutex,&attr) != 0 )
+	{
+		ERR_EXIT("pthread_mutex_init");
+	}
+	pthread_mutexattr_destroy(&attr);
+}
+
+void shm_mutex_lock(pthread_mutex_t *mutex)
+{
+	int ret = pthread_mutex_lock(mutex);
+	// 上一个持锁进程已退出,共享数据只是计数器,直接恢复即可
+	if( ret == EOWNERDEAD )
+	{
+		pthread_mutex_consistent(mutex);
+	}
+}
+
+void shm_mutex_unlock(pthread_mutex_t *mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
+
+int set_pacing_rate(int fd,unsigned int rate)
+{
+#ifdef SO_MAX_PACING_RATE
+	return setsockopt(fd,SOL_SOCKET,SO_MAX_PACING_RATE,&rate,sizeof(rate));
+#else
+	errno = ENOPROTOOPT;
+	return -1;
+#endif
+}
+
 void activate_oobinline(int fd)
 {
 	int oob_inline = 1;
@@ -672,6 +935,17 @@ void activate_oobinline(int fd)
 	}
 }
 
+int activate_nodelay(int fd)
+{
+	int nodelay = 1;
+	return setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&nodelay,sizeof(nodelay));
+}
+
+int set_tcp_cork(int fd,int on)
+{
+	return setsockopt(fd,IPPROTO_TCP,TCP_CORK,&on,sizeof(on));
+}
+
 void activate_sigurg(int fd)
 {
 	int ret;
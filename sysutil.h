@@ -12,8 +12,8 @@ void deactivate_nonblock(int fd);
 
 int read_timeout(int fd, unsigned int wait_seconds);
 int write_timeout(int fd, unsigned int wait_seconds);
-int accept_timeout(int fd, struct sockaddr_in *addr, unsigned int wait_seconds);
-int connect_timeout(int fd, struct sockaddr_in *addr, unsigned int wait_seconds);
+int accept_timeout(int fd, struct sockaddr_storage *addr, unsigned int wait_seconds);
+int connect_timeout(int fd, struct sockaddr_storage *addr, unsigned int wait_seconds);
 
 ssize_t readn(int fd, void *buf, size_t count);
 ssize_t writen(int fd, const void *buf, size_t count);
@@ -22,9 +22,19 @@ ssize_t readline(int sockfd, void *buf, size_t maxline);
 
 void send_fd(int sock_fd, int fd);
 int recv_fd(const int sock_fd);
+int send_fds(int sock_fd, const int *fds, int count);
+int recv_fds(int sock_fd, int *fds, int count);
 
 int tcp_server(const char *host,unsigned short port);
-int tcp_client(unsigned int port);
+int tcp_client(const char *host,unsigned int port);
+
+// IPv4/IPv6地址，IPv4映射的IPv6地址(::ffff:a.b.c.d)按IPv4处理
+int sockaddr_from_ip(const char *ip,unsigned short port,struct sockaddr_storage *ss,socklen_t *len);
+void sockaddr_ip(const struct sockaddr_storage *ss,char *ip,unsigned int len);
+int sockaddr_is_v6(const struct sockaddr_storage *ss);
+int sockaddr_same_host(const struct sockaddr_storage *a,const struct sockaddr_storage *b);
+// 连接计数使用的16字节键(IPv6取/64前缀)，返回按IP限速使用的32位键
+unsigned int sockaddr_client_key(const struct sockaddr_storage *ss,struct in6_addr *key);
 
 void get_file_mode(char str[10],mode_t mode);
 const char* get_stat_databuf(struct stat *sbuf);
@@ -32,11 +42,31 @@ const char* get_stat_databuf(struct stat *sbuf);
 long  get_time_sec();
 long  get_time_usec();
 
+// 单调时钟(CLOCK_MONOTONIC_COARSE),单位纳秒
+long long get_time_ns_coarse();
+
 void nano_sleep(double seconds);
 
+// 分配父子进程间共享的匿名内存
+void* shm_alloc(size_t size);
+
+// 共享内存中的进程间互斥锁(持锁进程异常退出时可恢复)
+void shm_mutex_init(pthread_mutex_t *mutex);
+void shm_mutex_lock(pthread_mutex_t *mutex);
+void shm_mutex_unlock(pthread_mutex_t *mutex);
+
+// 设置套接字的最大发送速率(字节/秒)，由fq队列或TCP内部pacing执行
+int set_pacing_rate(int fd,unsigned int rate);
+
 // 开启fd接受带外数据的功能
 void activate_oobinline(int fd);
 
+// 关闭Nagle算法，控制连接上连续的小应答(150之后的226等)不等待对方的ACK
+int activate_nodelay(int fd);
+
+// 开启时小的写入合并为完整的报文段，关闭时立即发出剩余数据
+int set_tcp_cork(int fd,int on);
+
 // 当fd上有带外数据的时候，将产生SIGURG信号
 // 该函数设定当前进程接收fd的带外数据
 void activate_sigurg(int fd);
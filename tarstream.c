@@ -0,0 +1,323 @@
+#include "tarstream.h"
+
+static void* tar_walker_routine(void *arg);
+static int tar_walker_push(tar_walker_t *tw,const char *path,const struct stat *sbuf);
+static int tar_long_name(char type,const char *name,char *buf);
+static void tar_fill_header(char *block,const char *name,const struct stat *sbuf,char type,
+	long long size,const char *link);
+static void tar_octal(char *field,int len,long long value);
+
+int tar_walker_start(tar_walker_t *tw,const char *dir)
+{
+	bzero(tw,sizeof(*tw));
+	if( strlen(dir) >= sizeof(tw->root) )
+	{
+		return -1;
+	}
+	strcpy(tw->root,dir);
+
+	// 去掉末尾的'/'，归档中的名称从目录自身的名称开始
+	int len = strlen(tw->root);
+	while( len > 1 && tw->root[len - 1] == '/' )
+	{
+		tw->root[--len] = '\0';
+	}
+	const char *base = strrchr(tw->root,'/');
+	tw->name_off = base == NULL ? 0 : base - tw->root + 1;
+
+	tw->queue = (tar_entry_t*)malloc(sizeof(tar_entry_t) * TAR_QUEUE_LEN);
+	if( tw->queue == NULL )
+	{
+		return -1;
+	}
+	pthread_mutex_init(&tw->lock,NULL);
+	pthread_cond_init(&tw->filled_cond,NULL);
+	pthread_cond_init(&tw->free_cond,NULL);
+
+	// 信号只交给会话线程处理
+	sigset_t all_set;
+	sigset_t old_set;
+	sigfillset(&all_set);
+	pthread_sigmask(SIG_BLOCK,&all_set,&old_set);
+	int ret = pthread_create(&tw->thread,NULL,tar_walker_routine,tw);
+	pthread_sigmask(SIG_SETMASK,&old_set,NULL);
+
+	if( ret != 0 )
+	{
+		pthread_cond_destroy(&tw->free_cond);
+		pthread_cond_destroy(&tw->filled_cond);
+		pthread_mutex_destroy(&tw->lock);
+		free(tw->queue);
+		return -1;
+	}
+	return 0;
+}
+
+int tar_walker_next(tar_walker_t *tw,tar_entry_t *entry)
+{
+	pthread_mutex_lock(&tw->lock);
+	while( tw->count == 0 && !tw->done )
+	{
+		pthread_cond_wait(&tw->filled_cond,&tw->lock);
+	}
+	if( tw->count == 0 )
+	{
+		pthread_mutex_unlock(&tw->lock);
+		return 0;
+	}
+	memcpy(entry,&tw->queue[tw->head],sizeof(*entry));
+	tw->head = (tw->head + 1) % TAR_QUEUE_LEN;
+	--tw->count;
+	pthread_cond_signal(&tw->free_cond);
+	pthread_mutex_unlock(&tw->lock);
+	return 1;
+}
+
+void tar_walker_stop(tar_walker_t *tw)
+{
+	pthread_mutex_lock(&tw->lock);
+	tw->cancel = 1;
+	pthread_cond_signal(&tw->free_cond);
+	pthread_mutex_unlock(&tw->lock);
+
+	pthread_join(tw->thread,NULL);
+	pthread_cond_destroy(&tw->free_cond);
+	pthread_cond_destroy(&tw->filled_cond);
+	pthread_mutex_destroy(&tw->lock);
+	free(tw->queue);
+}
+
+int tar_header(const char *name,const struct stat *sbuf,const char *link,char *buf)
+{
+	char type = '0';
+	long long size = 0;
+	char dir_name[PATH_MAX + 1];
+	if( S_ISDIR(sbuf->st_mode) )
+	{
+		// 目录的名称以'/'结尾
+		type = '5';
+		snprintf(dir_name,sizeof(dir_name),"%s/",name);
+		name = dir_name;
+	}
+	else if( S_ISLNK(sbuf->st_mode) )
+	{
+		type = '2';
+	}
+	else
+	{
+		size = sbuf->st_size;
+	}
+
+	int off = 0;
+	// 名称放不进name(100)+prefix(155)时使用GNU扩展，先发送一个保存完整名称的条目
+	int name_len = strlen(name);
+	const char *p_split = NULL;
+	if( name_len > 100 )
+	{
+		// 在'/'处分为prefix和name两部分
+		const char *p = name + name_len - 101;
+		if( p < name )
+		{
+			p = name;
+		}
+		for( ; *p != '\0'; ++p )
+		{
+			if( *p == '/' && p - name <= 155 && name + name_len - p - 1 <= 100 && p[1] != '\0' )
+			{
+				p_split = p;
+				break;
+			}
+		}
+		if( p_split == NULL )
+		{
+			off += tar_long_name('L',name,buf + off);
+		}
+	}
+	if( link != NULL && strlen(link) > 100 )
+	{
+		off += tar_long_name('K',link,buf + off);
+	}
+
+	char *block = buf + off;
+	bzero(block,TAR_BLOCK_SIZE);
+	if( p_split != NULL )
+	{
+		memcpy(block + 345,name,p_split - name);
+		tar_fill_header(block,p_split + 1,sbuf,type,size,link);
+	}
+	else
+	{
+		tar_fill_header(block,name,sbuf,type,size,link);
+	}
+
+	return off + TAR_BLOCK_SIZE;
+}
+
+static void* tar_walker_routine(void *arg)
+{
+	tar_walker_t *tw = (tar_walker_t*)arg;
+
+	// 深度优先遍历，每层保留打开的目录和路径长度，先输出目录再输出其中的内容
+	DIR *dirs[TAR_MAX_DEPTH];
+	int path_lens[TAR_MAX_DEPTH];
+	int depth = 0;
+	char path[PATH_MAX];
+	struct stat sbuf;
+
+	strcpy(path,tw->root);
+	if( lstat(path,&sbuf) == 0 && S_ISDIR(sbuf.st_mode) && tar_walker_push(tw,path,&sbuf) == 0 )
+	{
+		dirs[0] = opendir(path);
+		if( dirs[0] != NULL )
+		{
+			path_lens[0] = strlen(path);
+			depth = 1;
+		}
+	}
+
+	while( depth > 0 )
+	{
+		struct dirent *dt = readdir(dirs[depth - 1]);
+		if( dt == NULL )
+		{
+			closedir(dirs[--depth]);
+			continue;
+		}
+		if( dt->d_name[0] == '.' )
+		{
+			continue;
+		}
+
+		int len = path_lens[depth - 1];
+		if( len + 1 + strlen(dt->d_name) >= sizeof(path) )
+		{
+			continue;
+		}
+		sprintf(path + len,"/%s",dt->d_name);
+		if( lstat(path,&sbuf) == -1 )
+		{
+			continue;
+		}
+		if( !S_ISREG(sbuf.st_mode) && !S_ISDIR(sbuf.st_mode) && !S_ISLNK(sbuf.st_mode) )
+		{
+			continue;
+		}
+		if( S_ISDIR(sbuf.st_mode) && depth == TAR_MAX_DEPTH )
+		{
+			continue;
+		}
+		if( tar_walker_push(tw,path,&sbuf) == -1 )
+		{
+			break;
+		}
+
+		if( S_ISDIR(sbuf.st_mode) )
+		{
+			DIR *dir = opendir(path);
+			if( dir != NULL )
+			{
+				dirs[depth] = dir;
+				path_lens[depth] = strlen(path);
+				++depth;
+			}
+		}
+	}
+
+	while( depth > 0 )
+	{
+		closedir(dirs[--depth]);
+	}
+
+	pthread_mutex_lock(&tw->lock);
+	tw->done = 1;
+	pthread_cond_signal(&tw->filled_cond);
+	pthread_mutex_unlock(&tw->lock);
+	return NULL;
+}
+
+// 放入队列，队列满时等待；会话线程要求停止时返回-1
+static int tar_walker_push(tar_walker_t *tw,const char *path,const struct stat *sbuf)
+{
+	pthread_mutex_lock(&tw->lock);
+	while( tw->count == TAR_QUEUE_LEN && !tw->cancel )
+	{
+		pthread_cond_wait(&tw->free_cond,&tw->lock);
+	}
+	if( tw->cancel )
+	{
+		pthread_mutex_unlock(&tw->lock);
+		return -1;
+	}
+	tar_entry_t *entry = &tw->queue[(tw->head + tw->count) % TAR_QUEUE_LEN];
+	strcpy(entry->path,path);
+	memcpy(&entry->sbuf,sbuf,sizeof(*sbuf));
+	++tw->count;
+	pthread_cond_signal(&tw->filled_cond);
+	pthread_mutex_unlock(&tw->lock);
+	return 0;
+}
+
+// GNU长名称扩展：类型为L(文件名)或K(链接目标)的条目，内容是以'\0'结尾的完整名称
+static int tar_long_name(char type,const char *name,char *buf)
+{
+	struct stat sbuf;
+	bzero(&sbuf,sizeof(sbuf));
+	long long size = strlen(name) + 1;
+	bzero(buf,TAR_BLOCK_SIZE);
+	tar_fill_header(buf,"././@LongLink",&sbuf,type,size,NULL);
+
+	int data_len = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+	bzero(buf + TAR_BLOCK_SIZE,data_len);
+	memcpy(buf + TAR_BLOCK_SIZE,name,size);
+	return TAR_BLOCK_SIZE + data_len;
+}
+
+// 填写ustar头部，名称和链接目标过长时截断(完整内容已经在GNU扩展条目中)
+static void tar_fill_header(char *block,const char *name,const struct stat *sbuf,char type,
+	long long size,const char *link)
+{
+	strncpy(block,name,100);
+	tar_octal(block + 100,8,sbuf->st_mode & 07777);
+	tar_octal(block + 108,8,sbuf->st_uid);
+	tar_octal(block + 116,8,sbuf->st_gid);
+	tar_octal(block + 124,12,size);
+	tar_octal(block + 136,12,sbuf->st_mtime);
+	block[156] = type;
+	if( link != NULL )
+	{
+		strncpy(block + 157,link,100);
+	}
+	memcpy(block + 257,"ustar",6);
+	memcpy(block + 263,"00",2);
+
+	// 校验和：头部所有字节之和，计算时校验和字段按空格计算
+	memset(block + 148,' ',8);
+	unsigned int sum = 0;
+	int i;
+	for( i = 0; i < TAR_BLOCK_SIZE; ++i )
+	{
+		sum += (unsigned char)block[i];
+	}
+	sprintf(block + 148,"%06o",sum);
+	block[155] = ' ';
+}
+
+// 八进制数字段，以'\0'结尾；放不下时(8GB以上的文件)使用GNU的base-256编码
+static void tar_octal(char *field,int len,long long value)
+{
+	char tmp[32];
+	if( value >= 0 && snprintf(tmp,sizeof(tmp),"%0*llo",len - 1,value) == len - 1 )
+	{
+		memcpy(field,tmp,len);
+		return;
+	}
+
+	memset(field,0,len);
+	field[0] = (char)0x80;
+	int i;
+	for( i = len - 1; i > 0 && value > 0; --i )
+	{
+		field[i] = (char)(value & 0xff);
+		value >>= 8;
+	}
+}
@@ -0,0 +1,79 @@
+#ifndef __TARSTREAM_H__
+#define __TARSTREAM_H__
+
+#include "common.h"
+
+// 目录的虚拟归档下载：RETR <目录>.tar时即时生成整个目录树的tar(ustar)流。
+// 遍历线程在后台读取目录并lstat，结果放入固定长度的队列，
+// 会话线程从队列取出条目发送头部，文件内容用sendfile发送。
+// 内存占用只与队列长度和目录深度有关，与目录树的大小无关。
+// 与LIST一致，不包含以'.'开头的隐藏文件(包括未完成上传的.part文件)
+
+#define TAR_BLOCK_SIZE		512
+// 遍历线程最多领先会话线程的条目数
+#define TAR_QUEUE_LEN		256
+// 最大目录深度，更深的子目录被跳过
+#define TAR_MAX_DEPTH		128
+// 一个条目的头部最多占用的字节数(包括GNU长文件名和长链接名扩展)
+#define TAR_HEADER_MAX		(3*TAR_BLOCK_SIZE + 2*(PATH_MAX + TAR_BLOCK_SIZE))
+
+typedef struct tar_entry
+{
+	// 磁盘上的路径(相对于当前目录)
+	char path[PATH_MAX];
+	struct stat sbuf;
+} tar_entry_t;
+
+typedef struct tar_walker
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	// 队列中有新条目或者遍历结束时通知会话线程
+	pthread_cond_t filled_cond;
+	// 队列有空位时通知遍历线程
+	pthread_cond_t free_cond;
+
+	char root[PATH_MAX];
+	// 归档中的名称从path的这个位置开始(去掉目录的上级路径)
+	int name_off;
+
+	tar_entry_t *queue;
+	int head;
+	int count;
+	int done;
+	int cancel;
+} tar_walker_t;
+
+/**
+ * tar_walker_start - 启动遍历线程，第一个条目是目录本身
+ * @tw - 遍历状态
+ * @dir - 目录
+ * return value - 成功返回0，失败返回-1
+ */
+int tar_walker_start(tar_walker_t *tw,const char *dir);
+
+/**
+ * tar_walker_next - 取出下一个条目，队列为空时等待遍历线程
+ * @tw - 遍历状态
+ * @entry - 输出的条目
+ * return value - 取得条目返回1，遍历结束返回0
+ */
+int tar_walker_next(tar_walker_t *tw,tar_entry_t *entry);
+
+/**
+ * tar_walker_stop - 停止遍历线程并释放队列
+ * @tw - 遍历状态
+ */
+void tar_walker_stop(tar_walker_t *tw);
+
+/**
+ * tar_header - 生成条目的头部
+ * @name - 归档中的名称
+ * @sbuf - 文件状态，只支持普通文件、目录和符号链接
+ * @link - 符号链接的目标，其他类型为NULL
+ * @buf - 输出缓冲区，至少TAR_HEADER_MAX字节
+ * return value - 头部的字节数(TAR_BLOCK_SIZE的整数倍)
+ */
+int tar_header(const char *name,const struct stat *sbuf,const char *link,char *buf);
+
+#endif /* __TARSTREAM_H__ */
@@ -0,0 +1,208 @@
+#include "treehash.h"
+#include "checksum.h"
+
+#define TREE_DIGEST_LEN		32
+
+static void* tree_hash_worker(void *arg);
+static void hash_leaf(const char *buf,long long len,unsigned char *digest);
+static void hash_node(const unsigned char *left,const unsigned char *right,unsigned char *digest);
+
+int tree_hash_start(tree_hash_t *th,int fd,long long size,int nthreads)
+{
+	bzero(th,sizeof(*th));
+	th->fd = fd;
+	th->size = size;
+	// 空文件也有一个(空的)叶子
+	th->chunks = size > 0 ? (size + TREE_HASH_CHUNK - 1) / TREE_HASH_CHUNK : 1;
+	th->leaves = (unsigned char*)malloc(th->chunks * TREE_DIGEST_LEN);
+	if( th->leaves == NULL )
+	{
+		return -1;
+	}
+
+	if( nthreads <= 0 )
+	{
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if( nthreads > TREE_HASH_MAX_THREADS )
+	{
+		nthreads = TREE_HASH_MAX_THREADS;
+	}
+	if( nthreads > th->chunks )
+	{
+		nthreads = th->chunks;
+	}
+	if( nthreads < 1 )
+	{
+		nthreads = 1;
+	}
+
+	posix_fadvise(fd,0,size,POSIX_FADV_SEQUENTIAL);
+
+	// 信号只交给会话线程处理
+	sigset_t all_set;
+	sigset_t old_set;
+	sigfillset(&all_set);
+	pthread_sigmask(SIG_BLOCK,&all_set,&old_set);
+	th->planned = nthreads;
+	int i;
+	for( i = 0; i < nthreads; ++i )
+	{
+		if( pthread_create(&th->threads[i],NULL,tree_hash_worker,th) != 0 )
+		{
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK,&old_set,NULL);
+
+	th->nthreads = i;
+	if( th->nthreads == 0 )
+	{
+		free(th->leaves);
+		return -1;
+	}
+
+	return 0;
+}
+
+long long tree_hash_progress(tree_hash_t *th)
+{
+	return __atomic_load_n(&th->done_bytes,__ATOMIC_RELAXED);
+}
+
+int tree_hash_done(tree_hash_t *th)
+{
+	return __atomic_load_n(&th->finished,__ATOMIC_ACQUIRE) == th->nthreads;
+}
+
+int tree_hash_finish(tree_hash_t *th,int cancel,char *hex)
+{
+	if( cancel )
+	{
+		__atomic_store_n(&th->cancel,1,__ATOMIC_RELAXED);
+	}
+
+	int i;
+	for( i = 0; i < th->nthreads; ++i )
+	{
+		pthread_join(th->threads[i],NULL);
+	}
+
+	if( cancel || th->error )
+	{
+		free(th->leaves);
+		return -1;
+	}
+
+	// 逐层两两合并，原地覆盖
+	long long count = th->chunks;
+	while( count > 1 )
+	{
+		long long j;
+		for( j = 0; j + 1 < count; j += 2 )
+		{
+			hash_node(th->leaves + j * TREE_DIGEST_LEN,th->leaves + (j + 1) * TREE_DIGEST_LEN,
+				th->leaves + (j / 2) * TREE_DIGEST_LEN);
+		}
+		if( count % 2 == 1 )
+		{
+			memmove(th->leaves + (count / 2) * TREE_DIGEST_LEN,th->leaves + (count - 1) * TREE_DIGEST_LEN,
+				TREE_DIGEST_LEN);
+		}
+		count = (count + 1) / 2;
+	}
+
+	for( i = 0; i < TREE_DIGEST_LEN; ++i )
+	{
+		sprintf(hex + 2*i,"%02x",th->leaves[i]);
+	}
+	free(th->leaves);
+
+	return 0;
+}
+
+static void* tree_hash_worker(void *arg)
+{
+	tree_hash_t *th = (tree_hash_t*)arg;
+	char *buf = (char*)malloc(TREE_HASH_CHUNK);
+	if( buf == NULL )
+	{
+		__atomic_store_n(&th->error,1,__ATOMIC_RELAXED);
+		__atomic_add_fetch(&th->finished,1,__ATOMIC_RELEASE);
+		return NULL;
+	}
+
+	while( !__atomic_load_n(&th->cancel,__ATOMIC_RELAXED) && !__atomic_load_n(&th->error,__ATOMIC_RELAXED) )
+	{
+		long long index = __atomic_fetch_add(&th->next,1,__ATOMIC_RELAXED);
+		if( index >= th->chunks )
+		{
+			break;
+		}
+
+		// 每个线程领取下一块时，预读所有线程下一轮要读的位置
+		long long ra_start = (index + th->planned) * (long long)TREE_HASH_CHUNK;
+		if( ra_start < th->size )
+		{
+			posix_fadvise(th->fd,ra_start,TREE_HASH_CHUNK,POSIX_FADV_WILLNEED);
+		}
+
+		long long start = index * (long long)TREE_HASH_CHUNK;
+		long long len = th->size - start > TREE_HASH_CHUNK ? TREE_HASH_CHUNK : th->size - start;
+		if( len < 0 )
+		{
+			len = 0;
+		}
+		long long got = 0;
+		while( got < len )
+		{
+			ssize_t ret = pread(th->fd,buf + got,len - got,start + got);
+			if( ret == -1 && errno == EINTR )
+			{
+				continue;
+			}
+			else if( ret <= 0 )
+			{
+				break;
+			}
+			got += ret;
+		}
+		if( got < len )
+		{
+			__atomic_store_n(&th->error,1,__ATOMIC_RELAXED);
+			break;
+		}
+
+		hash_leaf(buf,len,th->leaves + index * TREE_DIGEST_LEN);
+		__atomic_add_fetch(&th->done_bytes,len,__ATOMIC_RELAXED);
+	}
+
+	free(buf);
+	__atomic_add_fetch(&th->finished,1,__ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static void hash_leaf(const char *buf,long long len,unsigned char *digest)
+{
+	unsigned char prefix = 0x00;
+	checksum_ctx_t ctx;
+	checksum_init(&ctx,CKSUM_SHA256);
+	checksum_update(&ctx,&prefix,1);
+	checksum_update(&ctx,buf,len);
+	checksum_digest(&ctx,digest);
+}
+
+static void hash_node(const unsigned char *left,const unsigned char *right,unsigned char *digest)
+{
+	unsigned char prefix = 0x01;
+	unsigned char both[2 * TREE_DIGEST_LEN];
+	memcpy(both,left,TREE_DIGEST_LEN);
+	memcpy(both + TREE_DIGEST_LEN,right,TREE_DIGEST_LEN);
+
+	checksum_ctx_t ctx;
+	checksum_init(&ctx,CKSUM_SHA256);
+	checksum_update(&ctx,&prefix,1);
+	checksum_update(&ctx,both,sizeof(both));
+	checksum_digest(&ctx,digest);
+}
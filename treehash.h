@@ -0,0 +1,68 @@
+#ifndef __TREEHASH_H__
+#define __TREEHASH_H__
+
+#include "common.h"
+
+// 大文件的树形摘要(SITE TREEHASH)
+// 文件按TREE_HASH_CHUNK分块，工作线程池并行计算每块的SHA-256作为叶子，
+// 再两两合并为Merkle树，结果是根节点的SHA-256。
+// 为了区分叶子和内部节点，叶子计算SHA-256(0x00||块数据)，
+// 内部节点计算SHA-256(0x01||左||右)，奇数个节点时最后一个直接进入上一层
+
+#define TREE_HASH_CHUNK		(1024*1024)
+#define TREE_HASH_MAX_THREADS	64
+
+typedef struct tree_hash
+{
+	int fd;
+	long long size;
+	long long chunks;
+	// 每块的摘要，chunks*32字节
+	unsigned char *leaves;
+
+	// 下一个待领取的块，已经计算的字节数，已经退出的线程数
+	long long next;
+	long long done_bytes;
+	int finished;
+	int cancel;
+	int error;
+
+	// 计划的线程数，创建线程之前确定，工作线程只读(用于计算预读位置)；
+	// 实际启动的线程数只由会话线程使用
+	int planned;
+	int nthreads;
+	pthread_t threads[TREE_HASH_MAX_THREADS];
+} tree_hash_t;
+
+/**
+ * tree_hash_start - 启动工作线程计算文件的树形摘要
+ * @th - 任务
+ * @fd - 文件
+ * @size - 文件大小
+ * @nthreads - 线程数，0表示与在线CPU数相同
+ * return value - 成功返回0，失败返回-1
+ */
+int tree_hash_start(tree_hash_t *th,int fd,long long size,int nthreads);
+
+/**
+ * tree_hash_progress - 已经计算的字节数
+ * @th - 任务
+ */
+long long tree_hash_progress(tree_hash_t *th);
+
+/**
+ * tree_hash_done - 所有工作线程是否已经退出
+ * @th - 任务
+ */
+int tree_hash_done(tree_hash_t *th);
+
+/**
+ * tree_hash_finish - 等待工作线程退出并合并出根摘要
+ * @th - 任务
+ * @cancel - 为1时让工作线程尽快退出，不需要结果
+ * @hex - 输出缓冲区，至少CKSUM_HEX_LEN字节
+ * return value - 成功返回0，失败或者取消返回-1
+ */
+int tree_hash_finish(tree_hash_t *th,int cancel,char *hex);
+
+#endif /* __TREEHASH_H__ */
@@ -2,6 +2,11 @@
 
 int tunable_pasv_enable=1;
 int tunable_port_enable=1;
+int tunable_pacing_enable=0;
+int tunable_lock_nonblock=0;
+int tunable_upload_snapshot=0;
+int tunable_allo_check_space=0;
+int tunable_connect_from_port_20=1;
 unsigned int tunable_listen_port=21;
 unsigned int tunable_max_clients=2000;
 unsigned int tunable_max_per_ip=50;
@@ -12,4 +17,25 @@ unsigned int tunable_data_connection_timeout=300;
 unsigned int tunable_local_umask=077;
 unsigned int tunable_upload_max_rate=0;
 unsigned int tunable_download_max_rate=0;
-const char *tunable_listen_adress;
\ No newline at end of file
+unsigned int tunable_user_upload_max_rate=0;
+unsigned int tunable_user_download_max_rate=0;
+unsigned int tunable_ip_upload_max_rate=0;
+unsigned int tunable_ip_download_max_rate=0;
+unsigned int tunable_global_upload_max_rate=0;
+unsigned int tunable_global_download_max_rate=0;
+unsigned int tunable_readahead_window=0;
+unsigned int tunable_cache_drop_threshold=0;
+unsigned int tunable_writebehind_window=0;
+unsigned int tunable_prefetch_window=0;
+unsigned int tunable_prefetch_global_rate=0;
+unsigned int tunable_group_commit_usec=2000;
+unsigned int tunable_upload_buffer_max=4194304;
+unsigned int tunable_odirect_threshold=0;
+unsigned int tunable_tree_hash_threads=0;
+unsigned int tunable_pasv_min_port=0;
+unsigned int tunable_pasv_max_port=0;
+unsigned int tunable_tcp_fastopen=0;
+const char *tunable_listen_adress;
+const char *tunable_upload_durability;
+const char *tunable_transfer_hash;
+const char *tunable_pasv_address;
\ No newline at end of file
@@ -5,6 +5,11 @@
 
 extern int tunable_pasv_enable;
 extern int tunable_port_enable;
+extern int tunable_pacing_enable;
+extern int tunable_lock_nonblock;
+extern int tunable_upload_snapshot;
+extern int tunable_allo_check_space;
+extern int tunable_connect_from_port_20;
 extern unsigned int tunable_listen_port;
 extern unsigned int tunable_max_clients;
 extern unsigned int tunable_max_per_ip;
@@ -15,7 +20,28 @@ extern unsigned int tunable_data_connection_timeout;
 extern unsigned int tunable_local_umask;
 extern unsigned int tunable_upload_max_rate;
 extern unsigned int tunable_download_max_rate;
+extern unsigned int tunable_user_upload_max_rate;
+extern unsigned int tunable_user_download_max_rate;
+extern unsigned int tunable_ip_upload_max_rate;
+extern unsigned int tunable_ip_download_max_rate;
+extern unsigned int tunable_global_upload_max_rate;
+extern unsigned int tunable_global_download_max_rate;
+extern unsigned int tunable_readahead_window;
+extern unsigned int tunable_cache_drop_threshold;
+extern unsigned int tunable_writebehind_window;
+extern unsigned int tunable_prefetch_window;
+extern unsigned int tunable_prefetch_global_rate;
+extern unsigned int tunable_group_commit_usec;
+extern unsigned int tunable_upload_buffer_max;
+extern unsigned int tunable_odirect_threshold;
+extern unsigned int tunable_tree_hash_threads;
+extern unsigned int tunable_pasv_min_port;
+extern unsigned int tunable_pasv_max_port;
+extern unsigned int tunable_tcp_fastopen;
 extern const char *tunable_listen_adress;
+extern const char *tunable_upload_durability;
+extern const char *tunable_transfer_hash;
+extern const char *tunable_pasv_address;
 
 
 #endif /* __TUNABLE_H__ */
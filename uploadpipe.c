@@ -0,0 +1,171 @@
+#include "uploadpipe.h"
+#include "tunable.h"
+
+// 单个缓冲区的大小，缓冲区越大写盘线程的系统调用越少
+#define UPLOAD_SLOT_SIZE	(256*1024)
+
+static void* upload_writer(void *arg);
+
+int upload_pipe_start(upload_pipe_t *pipe,upload_sink_t p_sink,void *arg)
+{
+	if( tunable_upload_buffer_max == 0 )
+	{
+		return -1;
+	}
+
+	// 至少两个缓冲区才能让接收和写盘同时进行，总大小较小时缩小单个缓冲区
+	long page_size = sysconf(_SC_PAGESIZE);
+	long long slot_size = UPLOAD_SLOT_SIZE;
+	long long slot_count = tunable_upload_buffer_max / slot_size;
+	if( slot_count < 2 )
+	{
+		slot_count = 2;
+		slot_size = (tunable_upload_buffer_max / 2) & ~(page_size - 1);
+		if( slot_size < page_size )
+		{
+			return -1;
+		}
+	}
+
+	bzero(pipe,sizeof(*pipe));
+	pipe->slot_size = slot_size;
+	pipe->slot_count = slot_count;
+	pipe->p_sink = p_sink;
+	pipe->sink_arg = arg;
+
+	if( posix_memalign((void**)&pipe->mem,page_size,slot_size * slot_count) != 0 )
+	{
+		return -1;
+	}
+	pipe->slot_len = (int*)calloc(slot_count,sizeof(int));
+	pipe->iov = (struct iovec*)calloc(slot_count,sizeof(struct iovec));
+	if( pipe->slot_len == NULL || pipe->iov == NULL )
+	{
+		free(pipe->iov);
+		free(pipe->slot_len);
+		free(pipe->mem);
+		return -1;
+	}
+
+	pthread_mutex_init(&pipe->lock,NULL);
+	pthread_cond_init(&pipe->filled_cond,NULL);
+	pthread_cond_init(&pipe->free_cond,NULL);
+
+	// 信号(SIGURG、SIGALRM)只交给会话线程处理
+	sigset_t all_set;
+	sigset_t old_set;
+	sigfillset(&all_set);
+	pthread_sigmask(SIG_BLOCK,&all_set,&old_set);
+	int ret = pthread_create(&pipe->writer,NULL,upload_writer,pipe);
+	pthread_sigmask(SIG_SETMASK,&old_set,NULL);
+
+	if( ret != 0 )
+	{
+		pthread_cond_destroy(&pipe->free_cond);
+		pthread_cond_destroy(&pipe->filled_cond);
+		pthread_mutex_destroy(&pipe->lock);
+		free(pipe->iov);
+		free(pipe->slot_len);
+		free(pipe->mem);
+		return -1;
+	}
+
+	return 0;
+}
+
+char* upload_pipe_get(upload_pipe_t *pipe,int *p_size)
+{
+	pthread_mutex_lock(&pipe->lock);
+	while( pipe->pending == pipe->slot_count && pipe->error == 0 )
+	{
+		pthread_cond_wait(&pipe->free_cond,&pipe->lock);
+	}
+	int error = pipe->error;
+	int slot = pipe->tail;
+	pthread_mutex_unlock(&pipe->lock);
+
+	if( error != 0 )
+	{
+		return NULL;
+	}
+
+	*p_size = pipe->slot_size;
+	return pipe->mem + (long long)slot * pipe->slot_size;
+}
+
+void upload_pipe_put(upload_pipe_t *pipe,int len)
+{
+	pthread_mutex_lock(&pipe->lock);
+	pipe->slot_len[pipe->tail] = len;
+	pipe->tail = (pipe->tail + 1) % pipe->slot_count;
+	++pipe->pending;
+	pthread_cond_signal(&pipe->filled_cond);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+int upload_pipe_finish(upload_pipe_t *pipe)
+{
+	pthread_mutex_lock(&pipe->lock);
+	pipe->closed = 1;
+	pthread_cond_signal(&pipe->filled_cond);
+	pthread_mutex_unlock(&pipe->lock);
+
+	pthread_join(pipe->writer,NULL);
+
+	pthread_cond_destroy(&pipe->free_cond);
+	pthread_cond_destroy(&pipe->filled_cond);
+	pthread_mutex_destroy(&pipe->lock);
+	free(pipe->iov);
+	free(pipe->slot_len);
+	free(pipe->mem);
+
+	return pipe->error;
+}
+
+static void* upload_writer(void *arg)
+{
+	upload_pipe_t *pipe = (upload_pipe_t*)arg;
+
+	pthread_mutex_lock(&pipe->lock);
+	while(1)
+	{
+		while( pipe->pending == 0 && !pipe->closed )
+		{
+			pthread_cond_wait(&pipe->filled_cond,&pipe->lock);
+		}
+		if( pipe->pending == 0 )
+		{
+			break;
+		}
+
+		// 取出全部等待写盘的缓冲区，一次交给回调，便于批量提交
+		int count = pipe->pending;
+		int i;
+		for( i = 0; i < count; ++i )
+		{
+			int slot = (pipe->head + i) % pipe->slot_count;
+			pipe->iov[i].iov_base = pipe->mem + (long long)slot * pipe->slot_size;
+			pipe->iov[i].iov_len = pipe->slot_len[slot];
+		}
+		int error = pipe->error;
+		pthread_mutex_unlock(&pipe->lock);
+
+		// 写盘时不持有锁，会话线程可以继续填充其他缓冲区
+		if( error == 0 )
+		{
+			error = pipe->p_sink(pipe->sink_arg,pipe->iov,count);
+		}
+
+		pthread_mutex_lock(&pipe->lock);
+		if( pipe->error == 0 )
+		{
+			pipe->error = error;
+		}
+		pipe->head = (pipe->head + count) % pipe->slot_count;
+		pipe->pending -= count;
+		pthread_cond_signal(&pipe->free_cond);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+
+	return NULL;
+}
@@ -0,0 +1,73 @@
+#ifndef __UPLOADPIPE_H__
+#define __UPLOADPIPE_H__
+
+#include "common.h"
+#include <sys/uio.h>
+
+// 上传流水线：会话线程从数据连接读取数据填入缓冲区，写盘线程把填满的缓冲区写入文件，
+// 磁盘暂时阻塞(回写、日志提交)时会话线程仍然可以继续接收，不会让TCP接收窗口收缩。
+// 缓冲区按页对齐，总大小不超过upload_buffer_max，全部缓冲区都在等待写盘时会话线程阻塞(背压)
+
+// 写盘线程的回调，一次交给它所有等待写盘的缓冲区(按文件顺序)，
+// 返回0表示成功，其他值作为错误码由upload_pipe_finish返回
+typedef int (*upload_sink_t)(void *arg,const struct iovec *iov,int count);
+
+typedef struct upload_pipe
+{
+	pthread_t writer;
+	pthread_mutex_t lock;
+	// 有缓冲区被填满或者结束时通知写盘线程
+	pthread_cond_t filled_cond;
+	// 有缓冲区写完时通知会话线程
+	pthread_cond_t free_cond;
+
+	char *mem;
+	int slot_size;
+	int slot_count;
+	int *slot_len;
+	struct iovec *iov;
+
+	// 环形队列：[head,tail)是等待写盘的缓冲区，tail是会话线程正在填充的缓冲区
+	int head;
+	int tail;
+	int pending;
+	int closed;
+	// 第一次写盘失败的错误码，之后收到的数据直接丢弃
+	int error;
+
+	upload_sink_t p_sink;
+	void *sink_arg;
+} upload_pipe_t;
+
+/**
+ * upload_pipe_start - 分配缓冲区并启动写盘线程
+ * @pipe - 流水线
+ * @p_sink - 写盘回调
+ * @arg - 回调参数
+ * return value - 成功返回0；未开启(upload_buffer_max为0)或者失败返回-1，调用者直接写盘
+ */
+int upload_pipe_start(upload_pipe_t *pipe,upload_sink_t p_sink,void *arg);
+
+/**
+ * upload_pipe_get - 取得一个空闲的缓冲区，没有空闲缓冲区时等待写盘线程
+ * @pipe - 流水线
+ * @p_size - 返回缓冲区大小
+ * return value - 缓冲区；写盘已经失败返回NULL
+ */
+char* upload_pipe_get(upload_pipe_t *pipe,int *p_size);
+
+/**
+ * upload_pipe_put - 提交upload_pipe_get取得的缓冲区
+ * @pipe - 流水线
+ * @len - 缓冲区中数据的长度
+ */
+void upload_pipe_put(upload_pipe_t *pipe,int len);
+
+/**
+ * upload_pipe_finish - 等待已提交的数据写完，结束写盘线程并释放缓冲区
+ * @pipe - 流水线
+ * return value - 写盘回调返回的错误码，成功为0
+ */
+int upload_pipe_finish(upload_pipe_t *pipe);
+
+#endif /* __UPLOADPIPE_H__ */